@@ -25,7 +25,9 @@ LOCAL_SRC_FILES := \
 	alsa_route.c \
 	alsa_mixer.c \
 	voice_preprocess.c \
-	audio_hw_hdmi.c
+	audio_hw_hdmi.c \
+	audio_channel_map.c \
+	audio_props.c
 LOCAL_C_INCLUDES += \
 	$(call include-path-for, audio-utils) \
 	$(call include-path-for, audio-route) \
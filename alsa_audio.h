@@ -25,6 +25,9 @@
 #ifndef _AUDIO_H_
 #define _AUDIO_H_
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 typedef enum _AudioRoute {
     SPEAKER_NORMAL_ROUTE = 0,
     SPEAKER_INCALL_ROUTE, // 1
@@ -87,23 +90,69 @@ struct pcm {
     char error[PCM_ERROR_MAX];
 };
 
+/* the per mixer arena holding enum names and tlv data */
+#define MIXER_ARENA_BLOCK 4096
+
+struct mixer_arena_block {
+    struct mixer_arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
 struct mixer_ctl {
     struct mixer *mixer;
     struct snd_ctl_elem_info *info;
-    struct snd_ctl_tlv *tlv;
-    char **ename;
+    /*
+     * tlv and ename are read on first use, see mixer_get_dB_range() and mixer_ctl_select().
+     * They are published with release under mixer->lock, the fast path loads them with acquire.
+     */
+    struct snd_ctl_tlv *_Atomic tlv;
+    int tlv_failed;
+    char **_Atomic ename;
+    /* last value written or read back, info->count entries */
+    long long *shadow;
+    int shadow_valid;
 };
 
 struct mixer {
     int fd;
+    int card;
+    pthread_mutex_t lock;   /* serializes writes and the shadow values */
+    unsigned refs;          /* users holding it through a mixer_cache */
+    int cached;             /* still the mixer_cache entry of its card */
     struct snd_ctl_elem_info *info;
     struct mixer_ctl *ctl;
     unsigned count;
+    /* open addressed name+index -> ctl position + 1, 0 is empty */
+    unsigned *hash;
+    unsigned hash_mask;
+    struct mixer_arena_block *arena;
+    /* value change events keep the shadow values in sync with other writers */
+    int subscribed;
+    unsigned writes;
+    unsigned writes_skipped;
+};
+
+#define MIXER_CACHE_CARDS 8
+
+/*
+ * one open mixer per card shared by every user in the process, kept open
+ * while unused and reopened when its card went away
+ */
+struct mixer_cache {
+    pthread_mutex_t lock;
+    struct mixer *mixers[MIXER_CACHE_CARDS];
 };
 
 struct mixer *mixer_open_legacy(unsigned card);
 void mixer_close_legacy(struct mixer *mixer);
+void mixer_cache_init(struct mixer_cache *cache);
+void mixer_cache_release(struct mixer_cache *cache);
+struct mixer *mixer_cache_get(struct mixer_cache *cache, unsigned card);
+void mixer_cache_put(struct mixer_cache *cache, struct mixer *mixer);
 void mixer_dump(struct mixer *mixer);
+int mixer_alive(struct mixer *mixer);
 
 struct mixer_ctl *mixer_get_control(struct mixer *mixer,
                                     const char *name, unsigned index);
@@ -112,6 +161,8 @@ struct mixer_ctl *mixer_get_nth_control(struct mixer *mixer, unsigned n);
 int mixer_ctl_set_val(struct mixer_ctl *ctl,int value);
 int mixer_ctl_set(struct mixer_ctl *ctl, unsigned percent);
 int mixer_ctl_select(struct mixer_ctl *ctl, const char *value);
+int mixer_ctl_select_item(struct mixer_ctl *ctl, unsigned item);
+int mixer_ctl_get_item(struct mixer_ctl *ctl, const char *value);
 void mixer_ctl_print(struct mixer_ctl *ctl);
 int mixer_ctl_set_int_double(struct mixer_ctl *ctl, long long left, long long right);
 int mixer_ctl_set_int(struct mixer_ctl *ctl, long long value);
@@ -122,6 +173,7 @@ int mixer_get_dB_range(struct mixer_ctl *ctl, long rangemin, long rangemax,
                        float *dB_min, float *dB_max, float *dB_step);
 
 int route_init(void);
+void route_set_mixer_cache(struct mixer_cache *cache);
 void route_uninit(void);
 int route_set_input_source(const char *source);
 int route_set_voice_volume(const char *ctlName, float volume);
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <poll.h>
 
 #include <linux/ioctl.h>
 #define __force
@@ -117,6 +118,200 @@ static const char *elem_type_name(snd_ctl_elem_type_t n)
     }
 }
 
+/**
+ * @brief ctl_hash
+ * FNV-1a over the control name and index
+ */
+static unsigned ctl_hash(const char *name, unsigned index)
+{
+    unsigned h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    h ^= index;
+    h *= 16777619u;
+    return h;
+}
+
+/**
+ * @brief mixer_build_hash
+ * index every control by name and index, controls listed first win on
+ * duplicates like the linear search did. Without the index (no memory)
+ * mixer_get_control() falls back to the linear search.
+ *
+ * @param mixer
+ */
+static void mixer_build_hash(struct mixer *mixer)
+{
+    unsigned size = 16, n;
+
+    while (size < mixer->count * 2)
+        size <<= 1;
+
+    mixer->hash = calloc(size, sizeof(unsigned));
+    if (!mixer->hash)
+        return;
+    mixer->hash_mask = size - 1;
+
+    for (n = 0; n < mixer->count; n++) {
+        unsigned h = ctl_hash((char*) mixer->info[n].id.name, mixer->info[n].id.index);
+        while (mixer->hash[h & mixer->hash_mask])
+            h++;
+        mixer->hash[h & mixer->hash_mask] = n + 1;
+    }
+}
+
+/**
+ * @brief mixer_arena_alloc
+ * bump allocation from the mixer's arena, freed all at once on close.
+ * Caller holds mixer->lock.
+ *
+ * @param mixer
+ * @param size
+ *
+ * @returns 8 byte aligned memory or NULL
+ */
+static void *mixer_arena_alloc(struct mixer *mixer, size_t size)
+{
+    struct mixer_arena_block *blk = mixer->arena;
+    void *p;
+
+    size = (size + 7) & ~(size_t)7;
+    if (!blk || blk->used + size > blk->size) {
+        size_t bsize = size > MIXER_ARENA_BLOCK ? size : MIXER_ARENA_BLOCK;
+        blk = malloc(sizeof(*blk) + bsize);
+        if (!blk)
+            return NULL;
+        blk->size = bsize;
+        blk->used = 0;
+        blk->next = mixer->arena;
+        mixer->arena = blk;
+    }
+
+    p = blk->data + blk->used;
+    blk->used += size;
+    return p;
+}
+
+/**
+ * @brief mixer_ctl_load_enames
+ * read the enum item names of ctl on first use
+ *
+ * @param ctl
+ *
+ * @returns 0 or negative errno
+ */
+static int mixer_ctl_load_enames(struct mixer_ctl *ctl)
+{
+    struct mixer *mixer = ctl->mixer;
+    struct snd_ctl_elem_info *ei = ctl->info;
+    struct snd_ctl_elem_info tmp;
+    char **enames;
+    unsigned m;
+    int ret = 0;
+
+    if (ei->type != SNDRV_CTL_ELEM_TYPE_ENUMERATED)
+        return -EINVAL;
+    if (atomic_load_explicit(&ctl->ename, memory_order_acquire))
+        return 0;
+
+    pthread_mutex_lock(&mixer->lock);
+    if (ctl->ename)
+        goto out;
+
+    enames = mixer_arena_alloc(mixer, ei->value.enumerated.items * sizeof(char *));
+    if (!enames) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (m = 0; m < ei->value.enumerated.items; m++) {
+        size_t len;
+
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.id.numid = ei->id.numid;
+        tmp.value.enumerated.item = m;
+        if (ioctl(mixer->fd, SNDRV_CTL_IOCTL_ELEM_INFO, &tmp) < 0) {
+            ret = -errno;
+            goto out;
+        }
+        len = strnlen(tmp.value.enumerated.name, sizeof(tmp.value.enumerated.name));
+        enames[m] = mixer_arena_alloc(mixer, len + 1);
+        if (!enames[m]) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        memcpy(enames[m], tmp.value.enumerated.name, len);
+        enames[m][len] = '\0';
+    }
+    atomic_store_explicit(&ctl->ename, enames, memory_order_release);
+
+out:
+    pthread_mutex_unlock(&mixer->lock);
+    ALOGE_IF(ret, "mixer_ctl_load_enames() control %s: %d", ei->id.name, ret);
+    return ret;
+}
+
+/**
+ * @brief mixer_ctl_load_tlv
+ * read the dB information of a volume control on first use
+ * (add for incall volume by Jear.Chen)
+ *
+ * @param ctl
+ *
+ * @returns 0 or negative errno
+ */
+static int mixer_ctl_load_tlv(struct mixer_ctl *ctl)
+{
+    struct mixer *mixer = ctl->mixer;
+    unsigned i, max = sizeof(volume_controls_name_table) / sizeof(char *);
+
+    if (atomic_load_explicit(&ctl->tlv, memory_order_acquire))
+        return 0;
+
+    pthread_mutex_lock(&mixer->lock);
+    if (ctl->tlv || ctl->tlv_failed)
+        goto out;
+
+    for (i = 0; i < max; i++) {
+        if (!strcmp((char*) ctl->info->id.name, volume_controls_name_table[i]))
+            break;
+    }
+
+    if (i >= max || (ctl->info->access & SNDRV_CTL_ELEM_ACCESS_TLV_READWRITE) == 0) {
+        ALOGV("mixer_ctl_load_tlv() type of control %s is not TLVT_DB", ctl->info->id.name);
+        ctl->tlv_failed = 1;
+        goto out;
+    }
+
+    unsigned int tlv_size = 2 * sizeof(unsigned int) + 2 * sizeof(unsigned int);
+    struct snd_ctl_tlv *tlv = mixer_arena_alloc(mixer, sizeof(struct sndrv_ctl_tlv) + tlv_size);
+    if (!tlv)
+        goto out;
+
+    //tlv->numid < (info->id.numid + info->count) and
+    //tlv->numid >= info->id.numid
+    tlv->numid = ctl->info->id.numid;
+    //length >= tlv.p[1] + 2 * sizeof(unsigned int);
+    //tlv.p is DECLARE_TLV_DB_SCALE defined in kernel
+    tlv->length = tlv_size;
+
+    if (ioctl(mixer->fd, SNDRV_CTL_IOCTL_TLV_READ, tlv) < 0) {
+        ALOGE("mixer_ctl_load_tlv() get tlv for control %s fail", ctl->info->id.name);
+        ctl->tlv_failed = 1;
+        goto out;
+    }
+
+    ALOGV("mixer_ctl_load_tlv() get tlv for control %s", ctl->info->id.name);
+    atomic_store_explicit(&ctl->tlv, tlv, memory_order_release);
+
+out:
+    pthread_mutex_unlock(&mixer->lock);
+    return ctl->tlv ? 0 : -EINVAL;
+}
+
 /**
  * @brief mixer_close_legacy
  *
@@ -124,7 +319,7 @@ static const char *elem_type_name(snd_ctl_elem_type_t n)
  */
 void mixer_close_legacy(struct mixer *mixer)
 {
-    unsigned n,m;
+    unsigned n;
 
     if (!mixer)
         return;
@@ -134,23 +329,26 @@ void mixer_close_legacy(struct mixer *mixer)
 
     if (mixer->ctl) {
         for (n = 0; n < mixer->count; n++) {
-            if (mixer->ctl[n].tlv)
-                free(mixer->ctl[n].tlv);
-            if (mixer->ctl[n].ename) {
-                unsigned max = mixer->ctl[n].info->value.enumerated.items;
-                for (m = 0; m < max; m++)
-                    if(mixer->ctl[n].ename[m])
-                        free(mixer->ctl[n].ename[m]);
-                if(mixer->ctl[n].ename)
-                    free(mixer->ctl[n].ename);
-            }
+            if (mixer->ctl[n].shadow)
+                free(mixer->ctl[n].shadow);
         }
         free(mixer->ctl);
     }
 
+    /* enum names and tlv data */
+    while (mixer->arena) {
+        struct mixer_arena_block *next = mixer->arena->next;
+        free(mixer->arena);
+        mixer->arena = next;
+    }
+
     if (mixer->info)
         free(mixer->info);
 
+    if (mixer->hash)
+        free(mixer->hash);
+
+    pthread_mutex_destroy(&mixer->lock);
     free(mixer);
 }
 
@@ -165,10 +363,9 @@ struct mixer *mixer_open_legacy(unsigned card)
 {
     char dname[sizeof(SOUND_CTL_PREFIX) + 20];
     struct snd_ctl_elem_list elist;
-    struct snd_ctl_elem_info tmp;
     struct snd_ctl_elem_id *eid = NULL;
     struct mixer *mixer = NULL;
-    unsigned n, m, i, max = sizeof(volume_controls_name_table) / sizeof(char *);
+    unsigned n;
     int fd;
     sprintf(dname, SOUND_CTL_PREFIX, card);
 
@@ -186,6 +383,7 @@ struct mixer *mixer_open_legacy(unsigned card)
     mixer = calloc(1, sizeof(*mixer));
     if (!mixer)
         goto fail;
+    pthread_mutex_init(&mixer->lock, NULL);
 
     mixer->ctl = calloc(elist.count, sizeof(struct mixer_ctl));
     mixer->info = calloc(elist.count, sizeof(struct snd_ctl_elem_info));
@@ -198,6 +396,7 @@ struct mixer *mixer_open_legacy(unsigned card)
 
     mixer->count = elist.count;
     mixer->fd = fd;
+    mixer->card = card;
     elist.space = mixer->count;
     elist.pids = eid;
     if (ioctl(fd, SNDRV_CTL_IOCTL_ELEM_LIST, &elist) < 0)
@@ -210,63 +409,19 @@ struct mixer *mixer_open_legacy(unsigned card)
             goto fail;
         mixer->ctl[n].info = ei;
         mixer->ctl[n].mixer = mixer;
-        if (ei->type == SNDRV_CTL_ELEM_TYPE_ENUMERATED) {
-            char **enames = calloc(ei->value.enumerated.items, sizeof(char*));
-            if (!enames)
-                goto fail;
-            mixer->ctl[n].ename = enames;
-            for (m = 0; m < ei->value.enumerated.items; m++) {
-                memset(&tmp, 0, sizeof(tmp));
-                tmp.id.numid = ei->id.numid;
-                tmp.value.enumerated.item = m;
-                if (ioctl(fd, SNDRV_CTL_IOCTL_ELEM_INFO, &tmp) < 0)
-                    goto fail;
-                enames[m] = strdup(tmp.value.enumerated.name);
-                if (!enames[m])
-                    goto fail;
-            }
-        }
-
-        //add for incall volume by Jear.Chen. get tlv.
-        for (i = 0; i < max; i++) {
-            if (!strcmp((char*) mixer->ctl[n].info->id.name, volume_controls_name_table[i]))
-                break;
-        }
-
-        if (i >= max) {
-            mixer->ctl[n].tlv = NULL;
-            continue;
-        }
-
-        if ((mixer->ctl[n].info->access & SNDRV_CTL_ELEM_ACCESS_TLV_READWRITE) == 0) {
-            ALOGV("mixer_open() type of control %s is not TLVT_DB", mixer->ctl[n].info->id.name);
-            mixer->ctl[n].tlv = NULL;
-            continue;
-        }
-
-        unsigned int tlv_size = 2 * sizeof(unsigned int) + 2 * sizeof(unsigned int);
-        struct snd_ctl_tlv *tlv = malloc(sizeof(struct sndrv_ctl_tlv) + tlv_size);
+        /* enum names and tlv are loaded on first use */
+    }
 
-        //tlv->numid < (info->id.numid + info->count) and
-        //tlv->numid >= info->id.numid
-        tlv->numid = mixer->ctl[n].info->id.numid;
-        //length >= tlv.p[1] + 2 * sizeof(unsigned int);
-        //tlv.p is DECLARE_TLV_DB_SCALE defined in kernel
-        tlv->length = tlv_size;
+    free(eid);
 
-        if (ioctl(fd, SNDRV_CTL_IOCTL_TLV_READ, tlv) < 0) {
-            ALOGE("mixer_open() get tlv for control %s fail", mixer->ctl[n].info->id.name);
-            free(tlv);
-            mixer->ctl[n].tlv = tlv = NULL;
-            continue;
-        }
+    mixer_build_hash(mixer);
 
-        ALOGV("mixer_open() get tlv for control %s", mixer->ctl[n].info->id.name);
-        mixer->ctl[n].tlv = tlv;
-        //add for incall volume end
-    }
+    int subscribe = 1;
+    if (ioctl(fd, SNDRV_CTL_IOCTL_SUBSCRIBE_EVENTS, &subscribe) == 0)
+        mixer->subscribed = 1;
+    else
+        ALOGW("mixer_open() card %d can not subscribe events, shadow values disabled", card);
 
-    free(eid);
     return mixer;
 
 fail:
@@ -279,6 +434,100 @@ fail:
     return 0;
 }
 
+/**
+ * @brief mixer_cache_init
+ *
+ * @param cache
+ */
+void mixer_cache_init(struct mixer_cache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+/**
+ * @brief mixer_cache_release
+ * close every cached mixer, no user may hold one anymore
+ *
+ * @param cache
+ */
+void mixer_cache_release(struct mixer_cache *cache)
+{
+    unsigned card;
+
+    pthread_mutex_lock(&cache->lock);
+    for (card = 0; card < MIXER_CACHE_CARDS; card++) {
+        struct mixer *mixer = cache->mixers[card];
+        if (!mixer)
+            continue;
+        ALOGW_IF(mixer->refs, "mixer_cache_release() card %u still has %u users", card, mixer->refs);
+        mixer_close_legacy(mixer);
+        cache->mixers[card] = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/**
+ * @brief mixer_cache_get
+ * take a reference on the mixer of card, opening it on first use
+ *
+ * @param cache
+ * @param card
+ *
+ * @returns mixer or NULL, release with mixer_cache_put()
+ */
+struct mixer *mixer_cache_get(struct mixer_cache *cache, unsigned card)
+{
+    struct mixer *mixer;
+
+    if (card >= MIXER_CACHE_CARDS)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    mixer = cache->mixers[card];
+    if (mixer && !mixer_alive(mixer)) {
+        /* card was removed, users still holding the old one close it */
+        ALOGD("mixer_cache_get() card %u is gone, reopen", card);
+        cache->mixers[card] = NULL;
+        mixer->cached = 0;
+        if (mixer->refs == 0)
+            mixer_close_legacy(mixer);
+        mixer = NULL;
+    }
+    if (!mixer) {
+        mixer = mixer_open_legacy(card);
+        if (mixer) {
+            mixer->cached = 1;
+            cache->mixers[card] = mixer;
+        }
+    }
+    if (mixer)
+        mixer->refs++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return mixer;
+}
+
+/**
+ * @brief mixer_cache_put
+ *
+ * @param cache
+ * @param mixer from mixer_cache_get()
+ */
+void mixer_cache_put(struct mixer_cache *cache, struct mixer *mixer)
+{
+    if (!mixer)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    if (mixer->refs > 0)
+        mixer->refs--;
+    if (mixer->refs == 0 && !mixer->cached)
+        mixer_close_legacy(mixer);
+    pthread_mutex_unlock(&cache->lock);
+}
+
 /**
  * @brief mixer_ctl_print
  *
@@ -324,6 +573,8 @@ void mixer_ctl_print(struct mixer_ctl *ctl)
                ei->value.integer64.step);
         break;
     case SNDRV_CTL_ELEM_TYPE_ENUMERATED: {
+        if (mixer_ctl_load_enames(ctl) < 0)
+            break;
         for (m = 0; m < ei->count; m++) {
             unsigned v = ev.value.enumerated.item[m];
             printf(" (%d %s)", v,
@@ -387,6 +638,20 @@ struct mixer_ctl *mixer_get_control(struct mixer *mixer,
                                     const char *name, unsigned index)
 {
     unsigned n;
+
+    if (mixer->hash) {
+        unsigned h = ctl_hash(name, index);
+        while ((n = mixer->hash[h & mixer->hash_mask]) != 0) {
+            struct snd_ctl_elem_info *ei = mixer->info + n - 1;
+            if (ei->id.index == index && !strcmp(name, (char*) ei->id.name)) {
+                ALOGV("mixer_get_control() %s access 0x%08x", ei->id.name, ei->access);
+                return mixer->ctl + n - 1;
+            }
+            h++;
+        }
+        return 0;
+    }
+
     for (n = 0; n < mixer->count; n++) {
         if (mixer->info[n].id.index == index) {
             if (!strcmp(name, (char*) mixer->info[n].id.name)) {
@@ -398,6 +663,23 @@ struct mixer_ctl *mixer_get_control(struct mixer *mixer,
     return 0;
 }
 
+/**
+ * @brief mixer_alive
+ * check the control device still belongs to a present card
+ *
+ * @param mixer
+ *
+ * @returns 1 if usable
+ */
+int mixer_alive(struct mixer *mixer)
+{
+    int version;
+
+    if (!mixer || mixer->fd < 0)
+        return 0;
+    return ioctl(mixer->fd, SNDRV_CTL_IOCTL_PVERSION, &version) == 0;
+}
+
 /**
  * @brief mixer_get_nth_control
  *
@@ -458,6 +740,175 @@ static long long scale_int64(struct snd_ctl_elem_info *ei, unsigned _percent)
 
     return ei->value.integer.min + (range / percent);
 }
+/**
+ * @brief elem_value_get
+ * value n of ev in the form kept by the shadow cache
+ */
+static long long elem_value_get(struct snd_ctl_elem_info *ei,
+                                struct snd_ctl_elem_value *ev, unsigned n)
+{
+    switch (ei->type) {
+    case SNDRV_CTL_ELEM_TYPE_BOOLEAN:
+    case SNDRV_CTL_ELEM_TYPE_INTEGER:
+        return ev->value.integer.value[n];
+    case SNDRV_CTL_ELEM_TYPE_INTEGER64:
+        return ev->value.integer64.value[n];
+    case SNDRV_CTL_ELEM_TYPE_ENUMERATED:
+        return ev->value.enumerated.item[n];
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief mixer_ctl_shadow_store
+ *
+ * @param ctl
+ * @param ev value now held by the control
+ */
+static void mixer_ctl_shadow_store(struct mixer_ctl *ctl, struct snd_ctl_elem_value *ev)
+{
+    unsigned n;
+
+    /* the driver may change volatile controls behind our back */
+    if (!ctl->mixer->subscribed || (ctl->info->access & SNDRV_CTL_ELEM_ACCESS_VOLATILE))
+        return;
+
+    if (!ctl->shadow) {
+        ctl->shadow = calloc(ctl->info->count, sizeof(long long));
+        if (!ctl->shadow)
+            return;
+    }
+
+    for (n = 0; n < ctl->info->count; n++)
+        ctl->shadow[n] = elem_value_get(ctl->info, ev, n);
+    ctl->shadow_valid = 1;
+}
+
+/**
+ * @brief mixer_ctl_by_numid
+ */
+static struct mixer_ctl *mixer_ctl_by_numid(struct mixer *mixer, unsigned numid)
+{
+    unsigned n;
+
+    /* numids are normally 1..count in list order */
+    if (numid >= 1 && numid <= mixer->count && mixer->info[numid - 1].id.numid == numid)
+        return mixer->ctl + numid - 1;
+
+    for (n = 0; n < mixer->count; n++) {
+        if (mixer->info[n].id.numid == numid)
+            return mixer->ctl + n;
+    }
+    return NULL;
+}
+
+/**
+ * @brief mixer_shadow_sync
+ * consume pending control events: refresh the shadow of every control that
+ * changed since the last write, whoever changed it.
+ *
+ * @param mixer
+ */
+static void mixer_shadow_sync(struct mixer *mixer)
+{
+    struct pollfd pfd;
+    struct snd_ctl_event event;
+    struct snd_ctl_elem_value ev;
+    unsigned n;
+
+    if (!mixer->subscribed)
+        return;
+
+    pfd.fd = mixer->fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        if (read(mixer->fd, &event, sizeof(event)) != sizeof(event))
+            break;
+        if (event.type != SNDRV_CTL_EVENT_ELEM)
+            continue;
+
+        if (event.data.elem.mask == SNDRV_CTL_EVENT_MASK_REMOVE) {
+            for (n = 0; n < mixer->count; n++)
+                mixer->ctl[n].shadow_valid = 0;
+            continue;
+        }
+        if (!(event.data.elem.mask & SNDRV_CTL_EVENT_MASK_VALUE))
+            continue;
+
+        struct mixer_ctl *ctl = mixer_ctl_by_numid(mixer, event.data.elem.id.numid);
+        if (!ctl || !ctl->shadow_valid)
+            continue;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.id.numid = ctl->info->id.numid;
+        if (ioctl(mixer->fd, SNDRV_CTL_IOCTL_ELEM_READ, &ev) == 0)
+            mixer_ctl_shadow_store(ctl, &ev);
+        else
+            ctl->shadow_valid = 0;
+    }
+}
+
+/**
+ * @brief mixer_ctl_write
+ * write ev to the control unless the control already holds that value
+ *
+ * @param ctl
+ * @param ev
+ *
+ * @returns ioctl result
+ */
+static int mixer_ctl_write_l(struct mixer_ctl *ctl, struct snd_ctl_elem_value *ev)
+{
+    struct mixer *mixer = ctl->mixer;
+    unsigned n;
+    int ret;
+
+    mixer_shadow_sync(mixer);
+
+    /* first write since open: a read is much cheaper than a write that
+     * goes through the codec driver and DAPM */
+    if (!ctl->shadow_valid && mixer->subscribed &&
+            !(ctl->info->access & SNDRV_CTL_ELEM_ACCESS_VOLATILE) &&
+            (ctl->info->access & SNDRV_CTL_ELEM_ACCESS_READ)) {
+        struct snd_ctl_elem_value cur;
+        memset(&cur, 0, sizeof(cur));
+        cur.id.numid = ctl->info->id.numid;
+        if (ioctl(mixer->fd, SNDRV_CTL_IOCTL_ELEM_READ, &cur) == 0)
+            mixer_ctl_shadow_store(ctl, &cur);
+    }
+
+    if (ctl->shadow_valid) {
+        for (n = 0; n < ctl->info->count; n++) {
+            if (ctl->shadow[n] != elem_value_get(ctl->info, ev, n))
+                break;
+        }
+        if (n == ctl->info->count) {
+            ALOGV("mixer_ctl_write() %s unchanged, skip", ctl->info->id.name);
+            mixer->writes_skipped++;
+            return 0;
+        }
+    }
+
+    mixer->writes++;
+    ret = ioctl(mixer->fd, SNDRV_CTL_IOCTL_ELEM_WRITE, ev);
+    if (ret < 0)
+        ctl->shadow_valid = 0;
+    else
+        mixer_ctl_shadow_store(ctl, ev);
+    return ret;
+}
+
+static int mixer_ctl_write(struct mixer_ctl *ctl, struct snd_ctl_elem_value *ev)
+{
+    int ret;
+
+    pthread_mutex_lock(&ctl->mixer->lock);
+    ret = mixer_ctl_write_l(ctl, ev);
+    pthread_mutex_unlock(&ctl->mixer->lock);
+    return ret;
+}
+
 /**
  * @brief mixer_ctl_set_val
  *
@@ -489,7 +940,7 @@ defalut:
         errno = EINVAL;
         return -1;
     }
-    return ioctl(ctl->mixer->fd, SNDRV_CTL_IOCTL_ELEM_WRITE, &ev);
+    return mixer_ctl_write(ctl, &ev);
 }
 
 /**
@@ -529,7 +980,7 @@ int mixer_ctl_set(struct mixer_ctl *ctl, unsigned percent)
         return -1;
     }
 
-    return ioctl(ctl->mixer->fd, SNDRV_CTL_IOCTL_ELEM_WRITE, &ev);
+    return mixer_ctl_write(ctl, &ev);
 }
 
 /**
@@ -543,29 +994,74 @@ int mixer_ctl_set(struct mixer_ctl *ctl, unsigned percent)
 int mixer_ctl_select(struct mixer_ctl *ctl, const char *value)
 {
     unsigned n, max;
-    struct snd_ctl_elem_value ev;
 
     if (ctl->info->type != SNDRV_CTL_ELEM_TYPE_ENUMERATED) {
         errno = EINVAL;
         return -1;
     }
 
+    if (mixer_ctl_load_enames(ctl) < 0)
+        return -1;
+
     max = ctl->info->value.enumerated.items;
     for (n = 0; n < max; n++) {
-        if (!strcmp(value, ctl->ename[n])) {
-            memset(&ev, 0, sizeof(ev));
-            ev.value.enumerated.item[0] = n;
-            ev.id.numid = ctl->info->id.numid;
-            if (ioctl(ctl->mixer->fd, SNDRV_CTL_IOCTL_ELEM_WRITE, &ev) < 0)
-                return -1;
-            return 0;
-        }
+        if (!strcmp(value, ctl->ename[n]))
+            return mixer_ctl_select_item(ctl, n);
     }
 
     errno = EINVAL;
     return -1;
 }
 
+/**
+ * @brief mixer_ctl_get_item
+ *
+ * @param ctl
+ * @param value
+ *
+ * @returns index of enum item value, -1 if none
+ */
+int mixer_ctl_get_item(struct mixer_ctl *ctl, const char *value)
+{
+    unsigned n;
+
+    if (mixer_ctl_load_enames(ctl) < 0)
+        return -1;
+
+    for (n = 0; n < ctl->info->value.enumerated.items; n++) {
+        if (!strcmp(value, ctl->ename[n]))
+            return n;
+    }
+    return -1;
+}
+
+/**
+ * @brief mixer_ctl_select_item
+ * select an enum item already resolved with mixer_ctl_get_item()
+ *
+ * @param ctl
+ * @param item
+ *
+ * @returns
+ */
+int mixer_ctl_select_item(struct mixer_ctl *ctl, unsigned item)
+{
+    struct snd_ctl_elem_value ev;
+
+    if (ctl->info->type != SNDRV_CTL_ELEM_TYPE_ENUMERATED ||
+            item >= ctl->info->value.enumerated.items) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.value.enumerated.item[0] = item;
+    ev.id.numid = ctl->info->id.numid;
+    if (mixer_ctl_write(ctl, &ev) < 0)
+        return -1;
+    return 0;
+}
+
 /**
  * @brief mixer_ctl_set_int_double
  *
@@ -626,13 +1122,13 @@ int mixer_ctl_set_int_double(struct mixer_ctl *ctl, long long left, long long ri
     }
     case SNDRV_CTL_ELEM_TYPE_ENUMERATED:
         max = ctl->info->value.enumerated.items;
-        return mixer_ctl_select(ctl, ctl->ename[value > max ? max : value]);
+        return mixer_ctl_select_item(ctl, value >= max ? max - 1 : value);
     default:
         errno = EINVAL;
         return -1;
     }
 
-    return ioctl(ctl->mixer->fd, SNDRV_CTL_IOCTL_ELEM_WRITE, &ev);
+    return mixer_ctl_write(ctl, &ev);
 }
 
 /**
@@ -764,7 +1260,7 @@ int mixer_get_dB_range(struct mixer_ctl *ctl, long rangemin, long rangemax,
     unsigned int *tlv;
     long min, max;
 
-    if (ctl->tlv == NULL) {
+    if (mixer_ctl_load_tlv(ctl) < 0) {
         ALOGE("mixer_get_dB_range() tlv of control %s is NULL", ctl->info->id.name);
         return -EINVAL;
     }
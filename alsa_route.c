@@ -51,6 +51,21 @@ struct pcm* mPcm[PCM_MAX + 1];
 struct mixer* mMixerPlayback;
 struct mixer* mMixerCapture;
 
+/* a route control resolved against an open mixer */
+struct route_ctl {
+    struct mixer_ctl *ctl;  /* NULL if the card has no such control */
+    int item;               /* enum item of str_val, -1 if unknown */
+};
+
+/* per route resolution of the controls, built when the mixer is opened */
+static struct route_ctl *mPlaybackCtls[MAX_ROUTE];
+static struct route_ctl *mCaptureCtls[MAX_ROUTE];
+
+/* mixers shared with the rest of the hal, private mixers when NULL */
+static struct mixer_cache *mMixerCache;
+
+static void route_mixer_close(int is_playback);
+
 /**
  * @brief route_init 
  *
@@ -156,6 +171,17 @@ int route_card_init(int card)
     return 0;
 }
 
+/**
+ * @brief route_set_mixer_cache
+ * take the playback and capture mixers from cache from now on
+ *
+ * @param cache
+ */
+void route_set_mixer_cache(struct mixer_cache *cache)
+{
+    mMixerCache = cache;
+}
+
 /**
  * @brief route_uninit 
  */
@@ -165,6 +191,9 @@ void route_uninit(void)
     route_pcm_close(PLAYBACK_OFF_ROUTE);
 
 	route_pcm_close(CAPTURE_OFF_ROUTE);
+
+    route_mixer_close(1);
+    route_mixer_close(0);
 }
 
 /**
@@ -389,15 +418,41 @@ const struct config_route *get_route_config(unsigned route)
 }
 
 /**
- * @brief set_controls 
+ * @brief route_has_control
+ *
+ * @param route
+ * @param name
+ *
+ * @returns 1 if route sets the control
+ */
+static int route_has_control(const struct config_route *route, const char *name)
+{
+    unsigned i;
+
+    if (!route)
+        return 0;
+
+    for (i = 0; i < route->controls_count; i++) {
+        if (!strcmp(route->controls[i].ctl_name, name))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief set_controls_except
+ * apply ctls but leave alone the controls that next sets anyway, so a
+ * transition off -> next writes each control at most once
  *
  * @param mixer
  * @param ctls
  * @param ctls_count
+ * @param next
  *
- * @returns 
+ * @returns
  */
-int set_controls(struct mixer *mixer, const struct config_control *ctls, const unsigned ctls_count)
+static int set_controls_except(struct mixer *mixer, const struct config_control *ctls,
+                               const unsigned ctls_count, const struct config_route *next)
 {
     struct mixer_ctl *ctl;
     unsigned i;
@@ -410,6 +465,9 @@ int set_controls(struct mixer *mixer, const struct config_control *ctls, const u
     }
 
     for (i = 0; i < ctls_count; i++) {
+        if (route_has_control(next, ctls[i].ctl_name))
+            continue;
+
         ctl = mixer_get_control(mixer, ctls[i].ctl_name, 0);
         if (!ctl) {
             ALOGE_IF(route_table != &default_config_table, "set_controls() Can not get ctl : %s", ctls[i].ctl_name);
@@ -448,15 +506,177 @@ int set_controls(struct mixer *mixer, const struct config_control *ctls, const u
 }
 
 /**
- * @brief route_set_controls 
+ * @brief set_controls 
+ *
+ * @param mixer
+ * @param ctls
+ * @param ctls_count
+ *
+ * @returns 
+ */
+int set_controls(struct mixer *mixer, const struct config_control *ctls, const unsigned ctls_count)
+{
+    return set_controls_except(mixer, ctls, ctls_count, NULL);
+}
+
+/**
+ * @brief set_resolved_controls
+ * same as set_controls_except() with the controls already looked up,
+ * no string compare unless something fails
+ *
+ * @param ctls
+ * @param rctls resolution of ctls
+ * @param ctls_count
+ * @param next
+ * @param next_rctls resolution of next
+ *
+ * @returns
+ */
+static int set_resolved_controls(const struct config_control *ctls, const struct route_ctl *rctls,
+                                 const unsigned ctls_count, const struct config_route *next,
+                                 const struct route_ctl *next_rctls)
+{
+    struct mixer_ctl *ctl;
+    unsigned i, j;
+
+    for (i = 0; i < ctls_count; i++) {
+        ctl = rctls[i].ctl;
+
+        if (next && ctl) {
+            for (j = 0; j < next->controls_count; j++) {
+                if (next_rctls[j].ctl == ctl)
+                    break;
+            }
+            if (j < next->controls_count)
+                continue;
+        }
+
+        if (!ctl) {
+            ALOGE_IF(route_table != &default_config_table, "set_controls() Can not get ctl : %s", ctls[i].ctl_name);
+            ALOGV_IF(route_table == &default_config_table, "set_controls() Can not get ctl : %s", ctls[i].ctl_name);
+            return -EINVAL;
+        }
+
+        if (ctl->info->type != SNDRV_CTL_ELEM_TYPE_BOOLEAN &&
+            ctl->info->type != SNDRV_CTL_ELEM_TYPE_INTEGER &&
+            ctl->info->type != SNDRV_CTL_ELEM_TYPE_INTEGER64 &&
+            ctl->info->type != SNDRV_CTL_ELEM_TYPE_ENUMERATED) {
+            ALOGE("set_controls() ctl %s is not a type of INT or ENUMERATED", ctls[i].ctl_name);
+            return -EINVAL;
+        }
+
+        if (ctls[i].str_val) {
+            if (ctl->info->type != SNDRV_CTL_ELEM_TYPE_ENUMERATED) {
+                ALOGE("set_controls() ctl %s is not a type of ENUMERATED", ctls[i].ctl_name);
+                return -EINVAL;
+            }
+            if (rctls[i].item < 0 || mixer_ctl_select_item(ctl, rctls[i].item) != 0) {
+                ALOGE("set_controls() Can not set ctl %s to %s", ctls[i].ctl_name, ctls[i].str_val);
+                return -EINVAL;
+            }
+            ALOGV("set_controls() set ctl %s to %s", ctls[i].ctl_name, ctls[i].str_val);
+        } else {
+            if (mixer_ctl_set_int_double(ctl, ctls[i].int_val[0], ctls[i].int_val[1]) != 0) {
+                ALOGE("set_controls() can not set ctl %s to %d", ctls[i].ctl_name, ctls[i].int_val[0]);
+                return -EINVAL;
+            }
+            ALOGV("set_controls() set ctl %s to %d", ctls[i].ctl_name, ctls[i].int_val[0]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief route_resolve
+ * look up every control of every route once against a freshly opened mixer
+ *
+ * @param mixer
+ * @param table per route resolution to fill
+ */
+static void route_resolve(struct mixer *mixer, struct route_ctl **table)
+{
+    unsigned route, i;
+
+    for (route = 0; route < MAX_ROUTE; route++) {
+        const struct config_route *route_info = get_route_config(route);
+
+        table[route] = NULL;
+        if (!route_info || route_info->controls_count == 0)
+            continue;
+
+        table[route] = calloc(route_info->controls_count, sizeof(struct route_ctl));
+        if (!table[route])
+            continue;
+
+        for (i = 0; i < route_info->controls_count; i++) {
+            const struct config_control *cc = route_info->controls + i;
+            struct mixer_ctl *ctl = mixer_get_control(mixer, cc->ctl_name, 0);
+
+            table[route][i].ctl = ctl;
+            table[route][i].item = (ctl && cc->str_val) ? mixer_ctl_get_item(ctl, cc->str_val) : -1;
+        }
+    }
+}
+
+/**
+ * @brief route_mixer_open
+ *
+ * @param is_playback
+ * @param card
+ *
+ * @returns the playback or capture mixer, with its routes resolved
+ */
+static struct mixer *route_mixer_open(int is_playback, int card)
+{
+    struct mixer **mixer = is_playback ? &mMixerPlayback : &mMixerCapture;
+
+    if (*mixer == NULL) {
+        *mixer = mMixerCache ? mixer_cache_get(mMixerCache, card) : mixer_open_legacy(card);
+        if (*mixer)
+            route_resolve(*mixer, is_playback ? mPlaybackCtls : mCaptureCtls);
+    }
+    return *mixer;
+}
+
+/**
+ * @brief route_mixer_close
+ *
+ * @param is_playback
+ */
+static void route_mixer_close(int is_playback)
+{
+    struct mixer **mixer = is_playback ? &mMixerPlayback : &mMixerCapture;
+    struct route_ctl **table = is_playback ? mPlaybackCtls : mCaptureCtls;
+    unsigned route;
+
+    for (route = 0; route < MAX_ROUTE; route++) {
+        free(table[route]);
+        table[route] = NULL;
+    }
+
+    if (*mixer) {
+        if (mMixerCache)
+            mixer_cache_put(mMixerCache, *mixer);
+        else
+            mixer_close_legacy(*mixer);
+        *mixer = NULL;
+    }
+}
+
+/**
+ * @brief route_apply
+ * set the controls of route, skipping those of next_route when given
  *
  * @param route
+ * @param next_route route applied right after, or -1
  *
  * @returns 
  */
-int route_set_controls(unsigned route)
+static int route_apply(unsigned route, int next_route)
 {
     struct mixer* mMixer;
+    struct route_ctl **table;
 
     if (route >= MAX_ROUTE) {
         ALOGE("route_set_controls() route %d error!", route);
@@ -488,6 +708,7 @@ int route_set_controls(unsigned route)
     ALOGD("route_set_controls() set route %d", route);
 
     mMixer = is_playback_route(route) ? mMixerPlayback : mMixerCapture;
+    table = is_playback_route(route) ? mPlaybackCtls : mCaptureCtls;
 
     if (!mMixer) {
         ALOGE("route_set_controls() mMixer is NULL!");
@@ -501,14 +722,23 @@ int route_set_controls(unsigned route)
     }
 
     if (route_info->controls_count > 0) {
-        int ret = set_controls(mMixer, route_info->controls, route_info->controls_count);
+        unsigned writes = mMixer->writes;
+        unsigned skipped = mMixer->writes_skipped;
+        const struct config_route *next = (next_route >= 0) ? get_route_config(next_route) : NULL;
+        int ret;
+
+        if (table[route] && (!next || next->controls_count == 0 || table[next_route]))
+            ret = set_resolved_controls(route_info->controls, table[route], route_info->controls_count,
+                                        next, next ? table[next_route] : NULL);
+        else
+            ret = set_controls_except(mMixer, route_info->controls, route_info->controls_count, next);
         if (ret != 0) {
             ALOGE("route_set_controls() failed to apply route %d (controls=%u, ret=%d)",
                   route, route_info->controls_count, ret);
             return ret;
         }
-        ALOGD("route_set_controls() applied route %d (controls=%u)", route,
-              route_info->controls_count);
+        ALOGD("route_set_controls() applied route %d (controls=%u, written=%u, unchanged=%u)", route,
+              route_info->controls_count, mMixer->writes - writes, mMixer->writes_skipped - skipped);
     } else {
         ALOGW("route_set_controls() route %d has no controls configured", route);
     }
@@ -516,6 +746,46 @@ int route_set_controls(unsigned route)
     return 0;
 }
 
+/**
+ * @brief route_set_controls 
+ *
+ * @param route
+ *
+ * @returns 
+ */
+int route_set_controls(unsigned route)
+{
+    return route_apply(route, -1);
+}
+
+/**
+ * @brief route_mixer_check
+ * The mixers stay open between routes so the values they cached stay
+ * useful. Drop the mixer of off_route when it belongs to another card
+ * than the one about to be used, or its card went away.
+ *
+ * @param off_route
+ * @param card
+ */
+static void route_mixer_check(unsigned off_route, int card)
+{
+    struct mixer **mixer = is_playback_route(off_route) ? &mMixerPlayback : &mMixerCapture;
+    int alive;
+
+    if (*mixer == NULL)
+        return;
+
+    alive = mixer_alive(*mixer);
+    if (alive && (*mixer)->card == card)
+        return;
+
+    ALOGD("route_mixer_check() release mixer of card %d (alive %d) for card %d",
+          (*mixer)->card, alive, card);
+    if (alive)
+        route_set_controls(off_route);
+    route_mixer_close(is_playback_route(off_route));
+}
+
 /**
  * @brief route_pcm_open 
  *
@@ -579,27 +849,21 @@ void route_pcm_open(uint32_t route)
    
 
     if (is_playback) {
-        //close all route and pcm
+        //close all route, controls the new route sets are written only once
+        route_mixer_check(PLAYBACK_OFF_ROUTE, route_info->sound_card);
         if (mMixerPlayback) {
-            route_set_controls(INCALL_OFF_ROUTE);
-            route_set_controls(VOIP_OFF_ROUTE);
+            route_apply(INCALL_OFF_ROUTE, route);
+            route_apply(VOIP_OFF_ROUTE, route);
+            route_apply(PLAYBACK_OFF_ROUTE, route);
         }
-        route_pcm_close(PLAYBACK_OFF_ROUTE);
-
-        //Open playback and capture of device 2
-        
     } else {
-        route_pcm_close(CAPTURE_OFF_ROUTE);
+        route_mixer_check(CAPTURE_OFF_ROUTE, route_info->sound_card);
+        if (mMixerCapture)
+            route_apply(CAPTURE_OFF_ROUTE, route);
     }
 
     //update mMixer
-    if (is_playback) {
-        if (mMixerPlayback == NULL)
-            mMixerPlayback = mixer_open_legacy(route_info->sound_card);
-    } else {
-        if (mMixerCapture == NULL)
-            mMixerCapture = mixer_open_legacy(route_info->sound_card);
-    }
+    route_mixer_open(is_playback, route_info->sound_card);
 
     //set controls
     if (route_info->controls_count > 0)
@@ -670,38 +934,24 @@ void route_pcm_card_open(int card, uint32_t route)
         route_info->devices == DEVICES_0_1_2 ? "2" : "");
 
     if (is_playback) {
-        //close all route and pcm
+        //close all route, controls the new route sets are written only once
+        route_mixer_check(PLAYBACK_OFF_ROUTE, card);
         if (mMixerPlayback) {
-            route_set_controls(INCALL_OFF_ROUTE);
-            route_set_controls(VOIP_OFF_ROUTE);
+            route_apply(INCALL_OFF_ROUTE, route);
+            route_apply(VOIP_OFF_ROUTE, route);
+            route_apply(PLAYBACK_OFF_ROUTE, route);
         }
-        route_pcm_close(PLAYBACK_OFF_ROUTE);
-
-        //Open playback and capture of device 2
-
     } else {
-        route_pcm_close(CAPTURE_OFF_ROUTE);
+        route_mixer_check(CAPTURE_OFF_ROUTE, card);
+        if (mMixerCapture)
+            route_apply(CAPTURE_OFF_ROUTE, route);
     }
 
     //update mMixer
-    if (is_playback) {
-        if (mMixerPlayback == NULL) {
-            mMixerPlayback = mixer_open_legacy(card);
-            if (mMixerPlayback == NULL) {
-                ALOGE("route_pcm_card_open() failed to open playback mixer for card %d (route %d): %s",
-                      card, route, strerror(errno));
-                goto __exit;
-            }
-        }
-    } else {
-        if (mMixerCapture == NULL) {
-            mMixerCapture = mixer_open_legacy(card);
-            if (mMixerCapture == NULL) {
-                ALOGE("route_pcm_card_open() failed to open capture mixer for card %d (route %d): %s",
-                      card, route, strerror(errno));
-                goto __exit;
-            }
-        }
+    if (route_mixer_open(is_playback, card) == NULL) {
+        ALOGE("route_pcm_card_open() failed to open %s mixer for card %d (route %d): %s",
+              is_playback ? "playback" : "capture", card, route, strerror(errno));
+        goto __exit;
     }
 
     //set controls
@@ -744,23 +994,10 @@ int route_pcm_close(unsigned route)
 
     ALOGV("route_pcm_close() route %d", route);
 
-	//set controls
+	//set controls, the mixer stays open until route_uninit() or a card change
     if (is_playback_route(route) ? mMixerPlayback : mMixerCapture)
         route_set_controls(route);
 
-    //close mixer
-    if (route == PLAYBACK_OFF_ROUTE) {
-        if (mMixerPlayback) {
-            mixer_close_legacy(mMixerPlayback);
-            mMixerPlayback = NULL;
-        }
-    } else if (route == CAPTURE_OFF_ROUTE) {
-        if (mMixerCapture) {
-            mixer_close_legacy(mMixerCapture);
-            mMixerCapture = NULL;
-        }
-    }
-
     return 0;
 }
 
@@ -1,8 +1,12 @@
 #include "audio_bitstream.h"
 #include "stdio.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <cutils/log.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 /* b, p, c, u, v, 0, 0, 0*/
 #define B_BIT_SHIFT    7
@@ -32,9 +36,6 @@
 #define CHASTA_BIT38   38
 #define CHASTA_BIT39   39
 
-
-static int scount = 0;
-
 bool isValidSamplerate(int samplerate)
 {
     if ((samplerate == 44100) || (samplerate== 48000) || (samplerate == 32000) ||
@@ -50,7 +51,6 @@ bool isValidSamplerate(int samplerate)
  */
 void initchnsta(char* buffer)
 {
-    scount = 0;
     if(buffer != NULL){
         memset(buffer, 0x0, CHASTA_SUB_NUM);
         buffer[CHASTA_BIT1*2] = 1;
@@ -270,37 +270,64 @@ void setChanSta(char* buffer,int samplerate, int channel)
     }
 }
 
-void fill_hdmi_bitstream_buf(void * in, void* out,void* chan, int length)
+/**
+ * @brief fill_hdmi_bitstream_buf
+ * pack 16 bit samples into IEC60958 subframes for the hdmi ip:
+ * bits 3~18 sample, bits 16~23 of the word also carry b/p/c/u/v from the
+ * channel status table. The parity covers everything except the B bit.
+ * Every output word is fully written, out needs no clearing.
+ *
+ * @param in 16 bit samples
+ * @param out 2*length bytes
+ * @param chan channel status table, CHASTA_SUB_NUM entries
+ * @param pos the stream's position in chan, updated
+ * @param length bytes of in
+ */
+void fill_hdmi_bitstream_buf(void * in, void* out,void* chan, int* pos, int length)
 {
-    int temp, p, j = 0;
-    char *ptr = (char *)in;
-    char *ptr_end = (char *)in+length;
-    char *newptr = (char *)out;
-    char* channel = (char *)chan;
-    if((ptr == NULL) || (newptr == NULL) || (channel == NULL) || (length <= 0))
+    const uint16_t *src = (const uint16_t *)in;
+    uint32_t *dst = (uint32_t *)out;
+    const uint8_t *channel = (const uint8_t *)chan;
+    int n = length/2;
+    int cur;
+
+    if((src == NULL) || (dst == NULL) || (channel == NULL) || (pos == NULL) || (length <= 0))
         return ;
 
-    while (ptr < ptr_end) {
-        newptr[0] = (ptr[0]&0x1f)<<3;
-        newptr[1] = ((ptr[0]&0xe0)>>5)|((ptr[1]&0x1f)<<3);
-        newptr[2] = (ptr[1]&0xe0)>>5;
-        newptr[2] |= channel[scount];
-        temp = (newptr[2]<<24) | (newptr[1]<<16) | (newptr[0]<<8);
-        j=0;
-        p=0;
-        while (j<31) {
-            p ^= temp&0x1;
-            p &= 0x1;
-            temp >>= 1;
-            j++;
+    cur = *pos;
+    while (n > 0) {
+#ifdef __ARM_NEON
+        /* 8 subframes at a time while the status bits are contiguous */
+        while ((n >= 8) && (cur + 8 <= CHASTA_SUB_NUM)) {
+            uint16x8_t s = vld1q_u16(src);
+            uint16x8_t c = vmovl_u8(vld1_u8(channel + cur));
+            uint16x8_t x = veorq_u16(s, vandq_u16(c, vdupq_n_u16(0x7f)));
+            uint16x8_t p = vandq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u16(x))), vdupq_n_u16(1));
+            uint16x8x2_t w;
+
+            w.val[0] = vshlq_n_u16(s, 3);
+            w.val[1] = vorrq_u16(vshrq_n_u16(s, 13), vorrq_u16(c, vshlq_n_u16(p, 6)));
+            vst2q_u16((uint16_t *)dst, w);
+            src += 8;
+            dst += 8;
+            n -= 8;
+            cur += 8;
         }
-        newptr[2] |= (p&0x01)<<6;
-        newptr[3] = 0x00;
-        scount++;
-        scount %= 384;
-        ptr +=2;
-        newptr +=4;
+        if (cur == CHASTA_SUB_NUM)
+            cur = 0;
+        if (n == 0)
+            break;
+#endif
+        uint16_t s = *src++;
+        uint8_t c = channel[cur];
+        uint32_t p = __builtin_parity(s ^ (c & 0x7f));
+
+        *dst++ = ((uint32_t)s << 3) | ((uint32_t)(c | (p << 6)) << 16);
+        n--;
+        if (++cur == CHASTA_SUB_NUM)
+            cur = 0;
     }
+    *pos = cur;
 }
 
 
@@ -25,5 +25,5 @@
 extern bool isValidSamplerate(int samplerate);
 extern void initchnsta(char* buffer);
 extern void setChanSta(char* buffer,int samplerate, int channel);
-extern void fill_hdmi_bitstream_buf(void * in, void* out,void* chan, int length);
+extern void fill_hdmi_bitstream_buf(void * in, void* out,void* chan, int* pos, int length);
 #endif
\ No newline at end of file
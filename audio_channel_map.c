@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2018 Fuzhou Rockchip Electronics Co., Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file audio_channel_map.c
+ * @brief capture channel mapping kernels, NEON with a scalar tail that gives
+ *        the same results
+ */
+
+#define LOG_TAG "audio_channel_map"
+
+#include "audio_channel_map.h"
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <cutils/log.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* Q14 rounding, as vqrshrn_n_s32(x, 14) does */
+static inline int16_t channel_map_round(int32_t acc)
+{
+    acc = (acc + (1 << 13)) >> 14;
+    if (acc > INT16_MAX)
+        return INT16_MAX;
+    if (acc < INT16_MIN)
+        return INT16_MIN;
+    return (int16_t)acc;
+}
+
+static void map_identity(const struct channel_map *map, int16_t *buffer, size_t frames)
+{
+    (void)map;
+    (void)buffer;
+    (void)frames;
+}
+
+/* (l + r) >> 1, so the NEON halving add and the tail agree */
+static void map_stereo_to_mono_avg(const struct channel_map *map, int16_t *buffer,
+                                   size_t frames)
+{
+    size_t i = 0;
+
+    (void)map;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t lr = vld2q_s16(buffer + 2 * i);
+        vst1q_s16(buffer + i, vhaddq_s16(lr.val[0], lr.val[1]));
+    }
+#endif
+    for (; i < frames; i++)
+        buffer[i] = (int16_t)(((int32_t)buffer[2 * i] + buffer[2 * i + 1]) >> 1);
+}
+
+static void map_stereo_to_mono(const struct channel_map *map, int16_t *buffer,
+                               size_t frames)
+{
+    const int16_t c0 = map->coef[0][0];
+    const int16_t c1 = map->coef[0][1];
+    size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t lr = vld2q_s16(buffer + 2 * i);
+        int32x4_t lo = vmull_n_s16(vget_low_s16(lr.val[0]), c0);
+        int32x4_t hi = vmull_n_s16(vget_high_s16(lr.val[0]), c0);
+        lo = vmlal_n_s16(lo, vget_low_s16(lr.val[1]), c1);
+        hi = vmlal_n_s16(hi, vget_high_s16(lr.val[1]), c1);
+        vst1q_s16(buffer + i, vcombine_s16(vqrshrn_n_s32(lo, 14), vqrshrn_n_s32(hi, 14)));
+    }
+#endif
+    for (; i < frames; i++)
+        buffer[i] = channel_map_round(c0 * buffer[2 * i] + c1 * buffer[2 * i + 1]);
+}
+
+/* grows the data, so walks from the end */
+static void map_mono_to_stereo(const struct channel_map *map, int16_t *buffer,
+                               size_t frames)
+{
+    size_t i = frames;
+
+    (void)map;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    size_t vec = frames & ~(size_t)7;
+    for (; i > vec; i--)
+        buffer[2 * (i - 1)] = buffer[2 * (i - 1) + 1] = buffer[i - 1];
+    for (; i >= 8; i -= 8) {
+        int16x8x2_t dup;
+        dup.val[0] = dup.val[1] = vld1q_s16(buffer + i - 8);
+        vst2q_s16(buffer + 2 * (i - 8), dup);
+    }
+#else
+    for (; i > 0; i--)
+        buffer[2 * (i - 1)] = buffer[2 * (i - 1) + 1] = buffer[i - 1];
+#endif
+}
+
+static void map_quad_to_stereo(const struct channel_map *map, int16_t *buffer,
+                               size_t frames)
+{
+    const int16_t *l = map->coef[0];
+    const int16_t *r = map->coef[1];
+    size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 4 <= frames; i += 4) {
+        int16x4x4_t in = vld4_s16(buffer + 4 * i);
+        int32x4_t accl = vmull_n_s16(in.val[0], l[0]);
+        int32x4_t accr = vmull_n_s16(in.val[0], r[0]);
+        accl = vmlal_n_s16(accl, in.val[1], l[1]);
+        accr = vmlal_n_s16(accr, in.val[1], r[1]);
+        accl = vmlal_n_s16(accl, in.val[2], l[2]);
+        accr = vmlal_n_s16(accr, in.val[2], r[2]);
+        accl = vmlal_n_s16(accl, in.val[3], l[3]);
+        accr = vmlal_n_s16(accr, in.val[3], r[3]);
+        int16x4x2_t out;
+        out.val[0] = vqrshrn_n_s32(accl, 14);
+        out.val[1] = vqrshrn_n_s32(accr, 14);
+        vst2_s16(buffer + 2 * i, out);
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *in = buffer + 4 * i;
+        int32_t accl = l[0] * in[0] + l[1] * in[1] + l[2] * in[2] + l[3] * in[3];
+        int32_t accr = r[0] * in[0] + r[1] * in[1] + r[2] * in[2] + r[3] * in[3];
+        buffer[2 * i] = channel_map_round(accl);
+        buffer[2 * i + 1] = channel_map_round(accr);
+    }
+}
+
+/* any shape with out_channels <= in_channels, front to back */
+static void map_matrix_down(const struct channel_map *map, int16_t *buffer,
+                            size_t frames)
+{
+    const unsigned int in_ch = map->in_channels;
+    const unsigned int out_ch = map->out_channels;
+    int32_t in[CHANNEL_MAP_MAX_CHANNELS];
+
+    for (size_t i = 0; i < frames; i++) {
+        for (unsigned int c = 0; c < in_ch; c++)
+            in[c] = buffer[i * in_ch + c];
+        for (unsigned int o = 0; o < out_ch; o++) {
+            int32_t acc = 0;
+            for (unsigned int c = 0; c < in_ch; c++)
+                acc += map->coef[o][c] * in[c];
+            buffer[i * out_ch + o] = channel_map_round(acc);
+        }
+    }
+}
+
+/* any shape with out_channels > in_channels, back to front */
+static void map_matrix_up(const struct channel_map *map, int16_t *buffer,
+                          size_t frames)
+{
+    const unsigned int in_ch = map->in_channels;
+    const unsigned int out_ch = map->out_channels;
+    int32_t in[CHANNEL_MAP_MAX_CHANNELS];
+
+    for (size_t i = frames; i > 0; i--) {
+        for (unsigned int c = 0; c < in_ch; c++)
+            in[c] = buffer[(i - 1) * in_ch + c];
+        for (unsigned int o = 0; o < out_ch; o++) {
+            int32_t acc = 0;
+            for (unsigned int c = 0; c < in_ch; c++)
+                acc += map->coef[o][c] * in[c];
+            buffer[(i - 1) * out_ch + o] = channel_map_round(acc);
+        }
+    }
+}
+
+static bool channel_map_is_identity(const struct channel_map *map)
+{
+    if (map->in_channels != map->out_channels)
+        return false;
+    for (unsigned int o = 0; o < map->out_channels; o++) {
+        for (unsigned int c = 0; c < map->in_channels; c++) {
+            if (map->coef[o][c] != (o == c ? CHANNEL_MAP_UNITY : 0))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* pick the most specific kernel for the shape and weights */
+static void channel_map_select(struct channel_map *map)
+{
+    const unsigned int in_ch = map->in_channels;
+    const unsigned int out_ch = map->out_channels;
+
+    if (channel_map_is_identity(map)) {
+        map->kernel = map_identity;
+        map->name = "identity";
+    } else if (in_ch == 2 && out_ch == 1 &&
+               map->coef[0][0] == CHANNEL_MAP_UNITY / 2 &&
+               map->coef[0][1] == CHANNEL_MAP_UNITY / 2) {
+        map->kernel = map_stereo_to_mono_avg;
+        map->name = "stereo->mono average";
+    } else if (in_ch == 2 && out_ch == 1) {
+        map->kernel = map_stereo_to_mono;
+        map->name = "stereo->mono";
+    } else if (in_ch == 1 && out_ch == 2 &&
+               map->coef[0][0] == CHANNEL_MAP_UNITY &&
+               map->coef[1][0] == CHANNEL_MAP_UNITY) {
+        map->kernel = map_mono_to_stereo;
+        map->name = "mono->stereo";
+    } else if (in_ch == 4 && out_ch == 2) {
+        map->kernel = map_quad_to_stereo;
+        map->name = "4ch->stereo";
+    } else if (out_ch <= in_ch) {
+        map->kernel = map_matrix_down;
+        map->name = "matrix";
+    } else {
+        map->kernel = map_matrix_up;
+        map->name = "matrix up";
+    }
+}
+
+int channel_map_init(struct channel_map *map, unsigned int in_channels,
+                     unsigned int out_channels, const int16_t *coef)
+{
+    if (map == NULL || coef == NULL ||
+            in_channels == 0 || in_channels > CHANNEL_MAP_MAX_CHANNELS ||
+            out_channels == 0 || out_channels > CHANNEL_MAP_MAX_CHANNELS) {
+        return -EINVAL;
+    }
+
+    memset(map->coef, 0, sizeof(map->coef));
+    for (unsigned int o = 0; o < out_channels; o++) {
+        int32_t gain = 0;
+        for (unsigned int c = 0; c < in_channels; c++) {
+            int16_t w = coef[o * in_channels + c];
+            map->coef[o][c] = w;
+            gain += w < 0 ? -w : w;
+        }
+        /* keeps the 32 bit accumulators of every kernel from overflowing */
+        if (gain > 2 * CHANNEL_MAP_UNITY) {
+            ALOGE("%s: output %u gain %d exceeds 2.0", __FUNCTION__, o, gain);
+            return -EINVAL;
+        }
+    }
+    map->in_channels = in_channels;
+    map->out_channels = out_channels;
+    channel_map_select(map);
+    ALOGV("%s: %u -> %u channels, %s", __FUNCTION__, in_channels, out_channels, map->name);
+
+    return 0;
+}
+
+int channel_map_init_default(struct channel_map *map, unsigned int in_channels,
+                             audio_channel_mask_t out_mask)
+{
+    int16_t coef[CHANNEL_MAP_MAX_CHANNELS * CHANNEL_MAP_MAX_CHANNELS];
+    unsigned int out_channels = audio_channel_count_from_in_mask(out_mask);
+
+    if (in_channels == 0 || in_channels > CHANNEL_MAP_MAX_CHANNELS)
+        return -EINVAL;
+    if (out_channels == 0 || out_channels > CHANNEL_MAP_MAX_CHANNELS)
+        out_channels = in_channels;
+
+    memset(coef, 0, sizeof(coef));
+    for (unsigned int o = 0; o < out_channels; o++) {
+        int16_t *row = coef + o * in_channels;
+        if (out_channels == 1) {
+            /* every mic counts, instead of keeping only the first one */
+            for (unsigned int c = 0; c < in_channels; c++)
+                row[c] = CHANNEL_MAP_UNITY / in_channels;
+        } else if (in_channels == 1) {
+            row[0] = CHANNEL_MAP_UNITY;
+        } else if (in_channels == 4 && out_channels == 2) {
+            /* a mic array interleaved as L R L R */
+            row[o] = CHANNEL_MAP_UNITY / 2;
+            row[o + 2] = CHANNEL_MAP_UNITY / 2;
+        } else {
+            row[o % in_channels] = CHANNEL_MAP_UNITY;
+        }
+    }
+
+    return channel_map_init(map, in_channels, out_channels, coef);
+}
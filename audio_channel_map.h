@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018 Fuzhou Rockchip Electronics Co., Ltd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * map the channels of a capture period to the channels of the stream, in place.
+ * Each output channel is a weighted sum of the input channels, the weights are
+ * Q14 (CHANNEL_MAP_UNITY is 1.0). The kernel is chosen once when the map is
+ * set up, so the per-sample loops carry no format checks.
+ */
+
+#ifndef AUDIO_CHANNEL_MAP_H
+#define AUDIO_CHANNEL_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <system/audio.h>
+
+#define CHANNEL_MAP_MAX_CHANNELS    8
+#define CHANNEL_MAP_UNITY           16384
+
+struct channel_map;
+
+typedef void (*channel_map_kernel_t)(const struct channel_map *map, int16_t *buffer,
+                                     size_t frames);
+
+struct channel_map {
+    unsigned int in_channels;
+    unsigned int out_channels;
+    /* coef[out][in], Q14 */
+    int16_t coef[CHANNEL_MAP_MAX_CHANNELS][CHANNEL_MAP_MAX_CHANNELS];
+    channel_map_kernel_t kernel;
+    const char *name;
+};
+
+/*
+ * set up a map from explicit weights, coef holds out_channels rows of
+ * in_channels entries. The buffer given to channel_map_apply() must hold
+ * frames * max(in_channels, out_channels) samples.
+ * return 0 or -EINVAL
+ */
+extern int channel_map_init(struct channel_map *map, unsigned int in_channels,
+                            unsigned int out_channels, const int16_t *coef);
+
+/*
+ * set up the default map from a pcm with in_channels to a stream channel mask:
+ * downmix to mono averages all inputs, mono is copied to every output, a four
+ * mic array folds its pairs (0,2) and (1,3) into stereo
+ */
+extern int channel_map_init_default(struct channel_map *map, unsigned int in_channels,
+                                    audio_channel_mask_t out_mask);
+
+static inline void channel_map_apply(const struct channel_map *map, int16_t *buffer,
+                                     size_t frames)
+{
+    map->kernel(map, buffer, frames);
+}
+
+#endif
@@ -45,12 +45,15 @@
 #include "codec_config/config.h"
 #include "audio_bitstream.h"
 #include "audio_setting.h"
+#include "audio_props.h"
 #include <unistd.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <stdio.h>
-#define SNDRV_CARDS 8
-#define SNDRV_DEVICES 8
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #define SND_CARDS_NODE          "/proc/asound/cards"
@@ -61,126 +64,543 @@
 #define IN_SIMCOM_PCM(in)    ((in)->dev->simcom_rx_pcm)
 
 static int simcom_prepare_tx_resampler(struct stream_out *out);
-static void simcom_release_tx_resampler(struct stream_out *out);
-static int simcom_ensure_tx_resampler_buffer(struct stream_out *out,
-                                             size_t frames,
-                                             size_t channels);
+static void simcom_log_pcm_snapshot(const char *tag, const void *buffer, size_t bytes);
 
 static bool simcom_force_patch_enabled(void)
 {
     return property_get_bool("persist.vendor.audio.simcom.force_patch", false);
 }
 
-static void simcom_rx_bus_init(struct simcom_rx_bus *bus)
+static int capture_bus_init(struct capture_bus *bus, size_t ring_bytes)
 {
     pthread_mutex_init(&bus->lock, NULL);
     pthread_cond_init(&bus->cond, NULL);
-    bus->frame_ready = false;
-    bus->producer_active = false;
-    bus->frame_bytes = 0;
-    bus->frame_gen = 0;
-    bus->pending_consumers = 0;
+    atomic_init(&bus->head, 0);
+    atomic_init(&bus->reserve, 0);
+    atomic_init(&bus->producing, false);
+    atomic_init(&bus->waiters, 0);
+    atomic_init(&bus->stamp_seq, 0);
+    atomic_init(&bus->stamp_head, 0);
+    atomic_init(&bus->stamp_ns, 0);
+    bus->ring = (uint8_t *)malloc(ring_bytes);
+    bus->ring_bytes = bus->ring ? ring_bytes : 0;
+    return bus->ring ? 0 : -ENOMEM;
+}
+
+/* only called while no consumer is reading: first open and last close of the pcm */
+static void capture_bus_reset(struct capture_bus *bus)
+{
+    atomic_store(&bus->reserve, 0);
+    atomic_store(&bus->head, 0);
+    atomic_store(&bus->producing, false);
+    atomic_store(&bus->stamp_head, 0);
+    atomic_store(&bus->stamp_ns, 0);
 }
 
 static void simcom_rx_bus_reset(struct audio_device *adev)
 {
-    struct simcom_rx_bus *bus = &adev->simcom_rx_bus;
-    pthread_mutex_lock(&bus->lock);
-    bus->frame_ready = false;
-    bus->producer_active = false;
-    bus->frame_bytes = 0;
-    bus->frame_gen = 0;
-    bus->pending_consumers = 0;
-    pthread_cond_broadcast(&bus->cond);
-    pthread_mutex_unlock(&bus->lock);
+    capture_bus_reset(&adev->simcom_rx_bus);
 }
 
-static void simcom_rx_bus_drop_consumer(struct audio_device *adev)
+/**
+ * @brief simcom_rx_bus_attach
+ * a new consumer starts at the live edge of the ring
+ *
+ * @param in
+ */
+static void simcom_rx_bus_attach(struct stream_in *in)
 {
-    struct simcom_rx_bus *bus = &adev->simcom_rx_bus;
-    pthread_mutex_lock(&bus->lock);
-    if (bus->frame_ready && bus->pending_consumers > 0) {
-        if (--bus->pending_consumers == 0) {
-            bus->frame_ready = false;
-            pthread_cond_broadcast(&bus->cond);
-        }
-    }
-    pthread_mutex_unlock(&bus->lock);
+    in->simcom_rx_cursor = atomic_load(&in->dev->simcom_rx_bus.head);
+    memset(&in->simcom_plc, 0, sizeof(in->simcom_plc));
 }
 
-static int simcom_rx_bus_acquire(struct stream_in *in, size_t bytes)
+static void capture_bus_release(struct capture_bus *bus)
 {
-    struct audio_device *adev = in->dev;
-    struct simcom_rx_bus *bus = &adev->simcom_rx_bus;
+    free(bus->ring);
+    bus->ring = NULL;
+    bus->ring_bytes = 0;
+}
 
-    if (bytes > SIMCOM_RX_BUS_MAX_BYTES) {
-        ALOGE("SIMCOM: requested RX chunk %zu exceeds bus buffer %zu",
-              bytes, (size_t)SIMCOM_RX_BUS_MAX_BYTES);
-        return -EINVAL;
+/* producer side, must own bus->producing */
+static void capture_bus_stamp(struct capture_bus *bus, uint64_t head)
+{
+    struct timespec now;
+    unsigned int seq = atomic_load_explicit(&bus->stamp_seq, memory_order_relaxed);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    atomic_store_explicit(&bus->stamp_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&bus->stamp_head, head, memory_order_relaxed);
+    atomic_store_explicit(&bus->stamp_ns, (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec,
+                          memory_order_relaxed);
+    atomic_store_explicit(&bus->stamp_seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief capture_bus_get_stamp
+ * the ring position and time of the last pcm_read() through the bus
+ *
+ * @returns false if nothing was read since the pcm was opened
+ */
+static bool capture_bus_get_stamp(struct capture_bus *bus, uint64_t *head, int64_t *ns)
+{
+    unsigned int seq;
+
+    do {
+        seq = atomic_load_explicit(&bus->stamp_seq, memory_order_acquire);
+        *head = atomic_load_explicit(&bus->stamp_head, memory_order_relaxed);
+        *ns = atomic_load_explicit(&bus->stamp_ns, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&bus->stamp_seq, memory_order_relaxed));
+
+    return *ns != 0;
+}
+
+static void capture_bus_wake(struct capture_bus *bus)
+{
+    /* seq_cst pairs with the increment in the waiter, one of the two sides sees the other */
+    if (atomic_load(&bus->waiters) > 0) {
+        pthread_mutex_lock(&bus->lock);
+        pthread_cond_broadcast(&bus->cond);
+        pthread_mutex_unlock(&bus->lock);
     }
+}
 
-    if (adev->simcom_rx_users <= 1) {
-        return pcm_read(in->pcm, in->buffer, bytes);
+/**
+ * @brief capture_bus_produce
+ * read bytes from the pcm straight into the ring, must own bus->producing
+ */
+static int capture_bus_produce(struct capture_bus *bus, struct pcm *pcm, size_t bytes)
+{
+    uint64_t head = atomic_load_explicit(&bus->head, memory_order_relaxed);
+    size_t pos = (size_t)(head & (bus->ring_bytes - 1));
+    size_t first = bus->ring_bytes - pos;
+    int status;
+
+    if (first > bytes)
+        first = bytes;
+
+    /* announce the region about to be overwritten before touching it */
+    atomic_store_explicit(&bus->reserve, head + bytes, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    status = pcm_read(pcm, bus->ring + pos, first);
+    if (status == 0 && bytes > first)
+        status = pcm_read(pcm, bus->ring, bytes - first);
+    if (status == 0) {
+        capture_bus_stamp(bus, head + bytes);
+        atomic_store_explicit(&bus->head, head + bytes, memory_order_release);
+    } else
+        atomic_store_explicit(&bus->reserve, head, memory_order_release);
+
+    return status;
+}
+
+/**
+ * @brief capture_bus_read
+ * read bytes of the shared capture into buffer. The first consumer that catches
+ * up with the ring reads the next chunk from the pcm into it, every consumer
+ * then copies from its own cursor without locking. A consumer left more than a
+ * ring, or more than jitter_max, behind skips ahead and the skipped bytes are
+ * added to *lost.
+ *
+ * @param bus
+ * @param single   only one consumer is attached, it may read the pcm directly
+ * @param pcm      the shared pcm
+ * @param cursor_p consumer read position
+ * @param lost     consumer lost byte count
+ * @param buffer
+ * @param bytes
+ * @param jitter_max
+ *
+ * @returns 0 or pcm_read() error
+ */
+static int capture_bus_read(struct capture_bus *bus, bool single, struct pcm *pcm,
+                            uint64_t *cursor_p, uint64_t *lost, void *buffer, size_t bytes,
+                            uint64_t jitter_max)
+{
+    if (bytes > bus->ring_bytes / 2) {
+        ALOGE("%s: requested chunk %zu exceeds half the ring (%zu)", __func__,
+              bytes, bus->ring_bytes);
+        return -EINVAL;
     }
 
-    pthread_mutex_lock(&bus->lock);
     while (true) {
-        if (bus->frame_ready && bus->frame_bytes == bytes &&
-            in->simcom_rx_last_gen != bus->frame_gen) {
-            memcpy(in->buffer, bus->frame_buf, bytes);
-            in->simcom_rx_last_gen = bus->frame_gen;
-            if (bus->pending_consumers > 0 && --bus->pending_consumers == 0) {
-                bus->frame_ready = false;
-                pthread_cond_broadcast(&bus->cond);
-            }
-            pthread_mutex_unlock(&bus->lock);
-            return 0;
+        bool expected = false;
+        if (single && atomic_compare_exchange_strong(&bus->producing, &expected, true)) {
+            /* sole reader, bypass the ring; keep the cursor live for a later joiner */
+            int status = pcm_read(pcm, buffer, bytes);
+            *cursor_p = atomic_load_explicit(&bus->head, memory_order_acquire);
+            if (status == 0)
+                capture_bus_stamp(bus, *cursor_p);
+            atomic_store(&bus->producing, false);
+            capture_bus_wake(bus);
+            return status;
         }
 
-        if (!bus->frame_ready || bus->frame_bytes != bytes || bus->pending_consumers == 0) {
-            if (bus->producer_active) {
-                pthread_cond_wait(&bus->cond, &bus->lock);
+        uint64_t head = atomic_load_explicit(&bus->head, memory_order_acquire);
+        uint64_t cursor = *cursor_p;
+
+        if (head - cursor > bus->ring_bytes - bytes) {
+            /* the producer has lapped this consumer */
+            *lost += head - cursor;
+            *cursor_p = cursor = head;
+            ALOGW("%s: consumer %p overrun, skipped %llu bytes", __func__, cursor_p,
+                  (unsigned long long)*lost);
+        } else if (head - cursor > jitter_max + bytes) {
+            /* bounded latency: drop the oldest audio beyond the jitter budget */
+            *lost += head - cursor - bytes;
+            *cursor_p = cursor = head - bytes;
+        }
+
+        if (head - cursor >= bytes) {
+            size_t pos = (size_t)(cursor & (bus->ring_bytes - 1));
+            size_t first = bus->ring_bytes - pos;
+            if (first > bytes)
+                first = bytes;
+            memcpy(buffer, bus->ring + pos, first);
+            memcpy((uint8_t *)buffer + first, bus->ring, bytes - first);
+            /* seqlock style check: was any copied byte overwritten meanwhile? */
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&bus->reserve, memory_order_relaxed) >
+                    cursor + bus->ring_bytes) {
+                *lost += bytes;
+                *cursor_p = atomic_load(&bus->head);
                 continue;
             }
+            *cursor_p = cursor + bytes;
+            return 0;
+        }
 
-            bus->producer_active = true;
-            pthread_mutex_unlock(&bus->lock);
-            int status = pcm_read(in->pcm, in->buffer, bytes);
-            pthread_mutex_lock(&bus->lock);
-            bus->producer_active = false;
-
-            if (status != 0) {
-                bus->frame_ready = false;
-                pthread_cond_broadcast(&bus->cond);
-                pthread_mutex_unlock(&bus->lock);
+        expected = false;
+        if (atomic_compare_exchange_strong(&bus->producing, &expected, true)) {
+            int status = capture_bus_produce(bus, pcm, bytes);
+            atomic_store(&bus->producing, false);
+            capture_bus_wake(bus);
+            if (status != 0)
                 return status;
-            }
+            continue;
+        }
 
-            memcpy(bus->frame_buf, in->buffer, bytes);
-            bus->frame_bytes = bytes;
-            bus->frame_gen++;
-            bus->frame_ready = true;
-            bus->pending_consumers = adev->simcom_rx_users;
-            if (bus->pending_consumers == 0) {
-                bus->pending_consumers = 1;
-            }
-            pthread_cond_broadcast(&bus->cond);
+        /* another consumer is reading the pcm, wait for its chunk */
+        pthread_mutex_lock(&bus->lock);
+        atomic_fetch_add(&bus->waiters, 1);
+        while (atomic_load(&bus->head) == head && atomic_load(&bus->producing))
+            pthread_cond_wait(&bus->cond, &bus->lock);
+        atomic_fetch_sub(&bus->waiters, 1);
+        pthread_mutex_unlock(&bus->lock);
+    }
+}
 
-            if (bus->pending_consumers > 0 && --bus->pending_consumers == 0) {
-                bus->frame_ready = false;
-                pthread_cond_broadcast(&bus->cond);
-            }
-            in->simcom_rx_last_gen = bus->frame_gen;
-            pthread_mutex_unlock(&bus->lock);
-            return 0;
+/* modem downlink: every SIMCOM RX stream and the call engine read through here */
+static int simcom_rx_bus_read(struct audio_device *adev, struct pcm *pcm,
+                              uint64_t *cursor_p, uint64_t *lost, void *buffer, size_t bytes)
+{
+    const uint64_t jitter_max = (uint64_t)adev->simcom_rate * SIMCOM_PCM_CHANNELS *
+                                (SIMCOM_PCM_BITS / 8) * SIMCOM_RX_JITTER_MAX_MS / 1000;
+
+    return capture_bus_read(&adev->simcom_rx_bus, adev->simcom_rx_users <= 1, pcm,
+                            cursor_p, lost, buffer, bytes, jitter_max);
+}
+
+/**
+ * @brief mic_hub_init
+ * size the ring for the configured pre-roll, at least MIC_HUB_RING_BYTES
+ *
+ * @param hub
+ *
+ * @returns 0 or -ENOMEM
+ */
+static int mic_hub_init(struct mic_hub *hub)
+{
+    size_t ring_bytes = MIC_HUB_RING_BYTES;
+    size_t history;
+    int preroll_ms = property_get_int32("persist.vendor.audio.mic.preroll_ms", 0);
+
+    if (preroll_ms < 0)
+        preroll_ms = 0;
+    hub->preroll_ms = preroll_ms > MIC_HUB_PREROLL_MAX_MS ? MIC_HUB_PREROLL_MAX_MS : preroll_ms;
+
+    /* pcm_config_in is the largest format the mic is opened with; keep twice the history */
+    history = (size_t)pcm_config_in.rate * pcm_config_in.channels * sizeof(int16_t) *
+              hub->preroll_ms / 1000;
+    while (ring_bytes < 2 * history)
+        ring_bytes <<= 1;
+
+    if (hub->preroll_ms)
+        ALOGI("%s: keeping %u ms of mic history in %zu bytes", __func__,
+              hub->preroll_ms, ring_bytes);
+    return capture_bus_init(&hub->bus, ring_bytes);
+}
+
+/**
+ * @brief mic_hub_join_cursor
+ * where a new client starts reading: the live edge, or up to the pre-roll
+ * back in time for a voice recognition stream while a hotword client has kept
+ * the ring filled
+ *
+ * @param in
+ *
+ * @returns ring position
+ */
+static uint64_t mic_hub_join_cursor(struct stream_in *in)
+{
+    struct mic_hub *hub = &in->dev->mic_hub;
+    uint64_t head = atomic_load(&hub->bus.head);
+    size_t frame_bytes = hub->config.channels * sizeof(int16_t);
+    uint64_t back;
+
+    if (in->input_source != AUDIO_SOURCE_VOICE_RECOGNITION ||
+            !hub->preroll_ms || !hub->history_users)
+        return head;
+
+    back = (uint64_t)hub->config.rate * frame_bytes * hub->preroll_ms / 1000;
+    /* leave half the ring between this reader and the producer */
+    if (back > hub->bus.ring_bytes / 2)
+        back = hub->bus.ring_bytes / 2;
+    if (back > head)
+        back = head;
+    back -= back % frame_bytes;
+
+    ALOGD("%s: voice recognition stream %p starts %llu bytes back", __func__, in,
+          (unsigned long long)back);
+    return head - back;
+}
+
+/**
+ * @brief mic_hub_acquire
+ * attach a mic stream to the shared codec capture, opening the pcm for the
+ * first client. Later clients join at the live edge and must ask for the same
+ * rate and channel count, the period size may differ.
+ * must be called with adev->lock held
+ *
+ * @param in
+ * @param card
+ * @param device
+ *
+ * @returns 0, -EBUSY if the pcm is open in an incompatible format, -ENODEV
+ */
+static int mic_hub_acquire(struct stream_in *in, int card, int device)
+{
+    struct audio_device *adev = in->dev;
+    struct mic_hub *hub = &adev->mic_hub;
+
+    if (in->mic_hub_attached)
+        return 0;
+
+    if (hub->users > 0) {
+        if (hub->card != card || hub->device != device ||
+                hub->config.rate != in->config->rate ||
+                hub->config.channels != in->config->channels) {
+            ALOGE("%s: hub busy on %d,%d %uHz %uch, stream wants %d,%d %uHz %uch", __func__,
+                  hub->card, hub->device, hub->config.rate, hub->config.channels,
+                  card, device, in->config->rate, in->config->channels);
+            return -EBUSY;
+        }
+    } else {
+        hub->pcm = pcm_open(card, device, PCM_IN, in->config);
+        if (!hub->pcm || !pcm_is_ready(hub->pcm)) {
+            ALOGE("%s: pcm_open() failed: %s", __func__,
+                  hub->pcm ? pcm_get_error(hub->pcm) : "no memory");
+            if (hub->pcm)
+                pcm_close(hub->pcm);
+            hub->pcm = NULL;
+            return -ENODEV;
+        }
+        hub->config = *in->config;
+        hub->card = card;
+        hub->device = device;
+        capture_bus_reset(&hub->bus);
+    }
+
+    hub->users++;
+    if (in->input_source == AUDIO_SOURCE_HOTWORD)
+        hub->history_users++;
+    in->pcm = hub->pcm;
+    in->mic_cursor = mic_hub_join_cursor(in);
+    in->mic_hub_attached = true;
+    ALOGD("%s: stream %p attached, %d users", __func__, in, hub->users);
+    return 0;
+}
+
+/**
+ * @brief mic_hub_release
+ * detach a mic stream, the last one closes the pcm
+ * must be called with adev->lock held
+ *
+ * @param in
+ *
+ * @returns remaining users
+ */
+static int mic_hub_release(struct stream_in *in)
+{
+    struct mic_hub *hub = &in->dev->mic_hub;
+
+    if (!in->mic_hub_attached)
+        return hub->users;
+
+    in->mic_hub_attached = false;
+    in->pcm = NULL;
+    if (in->input_source == AUDIO_SOURCE_HOTWORD)
+        hub->history_users--;
+    if (--hub->users == 0) {
+        pcm_close(hub->pcm);
+        hub->pcm = NULL;
+        capture_bus_reset(&hub->bus);
+    }
+    ALOGD("%s: stream %p detached, %d users", __func__, in, hub->users);
+    return hub->users;
+}
+
+/* one chunk of the shared mic capture, never buffers more than a ring */
+static int mic_hub_read(struct stream_in *in, void *buffer, size_t bytes)
+{
+    struct mic_hub *hub = &in->dev->mic_hub;
+    /* the history is only kept if the ring is filled, even with one reader */
+    bool single = hub->users <= 1 && !(hub->preroll_ms && hub->history_users);
+
+    return capture_bus_read(&hub->bus, single, in->pcm, &in->mic_cursor,
+                            &in->mic_lost_bytes, buffer, bytes, hub->bus.ring_bytes);
+}
+
+/* restart the history when the modem rate changed under it */
+static void simcom_plc_set_rate(struct simcom_plc *plc, unsigned int rate)
+{
+    if (plc->rate == rate)
+        return;
+    plc->rate = rate;
+    plc->hist_len = rate * SIMCOM_PLC_HIST_MS / 1000;
+    plc->hist_fill = 0;
+    plc->in_gap = false;
+}
+
+/* keep the newest good downlink, fading back in after a concealed gap */
+static void simcom_plc_good(struct simcom_plc *plc, int16_t *buf, size_t samples)
+{
+    const size_t len = plc->hist_len;
+
+    if (plc->in_gap) {
+        const size_t ramp_len = plc->rate * SIMCOM_PLC_RAMP_MS / 1000;
+        size_t ramp = samples < ramp_len ? samples : ramp_len;
+        for (size_t i = 0; i < ramp; i++)
+            buf[i] = (int16_t)((int32_t)buf[i] * (int32_t)i / (int32_t)ramp_len);
+        plc->in_gap = false;
+    }
+
+    if (samples >= len) {
+        memcpy(plc->hist, buf + samples - len, len * sizeof(int16_t));
+        plc->hist_fill = len;
+        return;
+    }
+    memmove(plc->hist, plc->hist + samples, (len - samples) * sizeof(int16_t));
+    memcpy(plc->hist + len - samples, buf, samples * sizeof(int16_t));
+    plc->hist_fill += samples;
+    if (plc->hist_fill > len)
+        plc->hist_fill = len;
+}
+
+/* strongest normalised autocorrelation lag of the history, 2.5 to 15 ms */
+static size_t simcom_plc_pitch(const struct simcom_plc *plc)
+{
+    const size_t min_lag = plc->rate / 400;
+    const size_t max_lag = plc->rate * 15 / 1000;
+    const int16_t *x = plc->hist;
+    size_t best = max_lag;
+    float best_score = 0.0f;
+
+    if (plc->hist_fill < plc->hist_len)
+        return plc->hist_fill;
+
+    for (size_t lag = min_lag; lag <= max_lag; lag++) {
+        int64_t corr = 0, energy = 0;
+        for (size_t i = max_lag; i < plc->hist_len; i++) {
+            corr += (int32_t)x[i] * x[i - lag];
+            energy += (int32_t)x[i - lag] * x[i - lag];
         }
+        if (corr <= 0 || energy == 0)
+            continue;
+        float score = (float)corr * (float)corr / (float)energy;
+        if (score > best_score) {
+            best_score = score;
+            best = lag;
+        }
+    }
+    return best;
+}
+
+static void simcom_plc_conceal(struct simcom_plc *plc, int16_t *buf, size_t samples)
+{
+    const size_t fade = plc->rate * SIMCOM_PLC_FADE_MS / 1000;
+
+    if (!plc->in_gap) {
+        plc->in_gap = true;
+        plc->pitch = simcom_plc_pitch(plc);
+        plc->pos = 0;
+        plc->faded = 0;
+        plc->gaps++;
+    }
 
-        pthread_cond_wait(&bus->cond, &bus->lock);
+    for (size_t i = 0; i < samples; i++) {
+        if (plc->pitch == 0 || plc->faded >= fade) {
+            buf[i] = 0;
+            continue;
+        }
+        int32_t s = plc->hist[plc->hist_len - plc->pitch + plc->pos];
+        buf[i] = (int16_t)(s * (int32_t)(fade - plc->faded) / (int32_t)fade);
+        plc->pos = (plc->pos + 1) % plc->pitch;
+        plc->faded++;
     }
+    plc->concealed += samples;
+}
+
+/**
+ * @brief simcom_rx_read_concealed
+ * simcom_rx_bus_read() that never fails and never waits longer than one chunk:
+ * a failed read is replaced by concealment and paced to the chunk duration.
+ *
+ * @returns 0
+ */
+static int simcom_rx_read_concealed(struct audio_device *adev, struct pcm *pcm,
+                                    uint64_t *cursor, uint64_t *lost,
+                                    struct simcom_plc *plc, void *buffer, size_t bytes)
+{
+    const size_t samples = bytes / sizeof(int16_t);
+    struct timespec start, now;
+
+    const unsigned int rate = adev->simcom_rate;
+
+    simcom_plc_set_rate(plc, rate);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = simcom_rx_bus_read(adev, pcm, cursor, lost, buffer, bytes);
+    if (status == 0) {
+        simcom_plc_good(plc, (int16_t *)buffer, samples);
+        return 0;
+    }
+
+    if (!plc->in_gap) {
+        ALOGW("SIMCOM: RX read failed (%d), concealing gap %llu", status,
+              (unsigned long long)plc->gaps + 1);
+    }
+    simcom_plc_conceal(plc, (int16_t *)buffer, samples);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t chunk_us = (int64_t)samples * 1000000 / rate;
+    int64_t spent_us = (int64_t)(now.tv_sec - start.tv_sec) * 1000000 +
+                       (now.tv_nsec - start.tv_nsec) / 1000;
+    if (spent_us < chunk_us)
+        usleep((useconds_t)(chunk_us - spent_us));
+    return 0;
+}
+
+static int simcom_rx_bus_acquire(struct stream_in *in, size_t bytes)
+{
+    return simcom_rx_read_concealed(in->dev, in->pcm, &in->simcom_rx_cursor,
+                                    &in->simcom_rx_lost_bytes, &in->simcom_plc,
+                                    in->buffer, bytes);
 }
 
 static bool simcom_detect_card(struct audio_device *adev);
-static int simcom_wait_for_pcm_node(struct audio_device *adev, bool is_rx, bool wait_for_device);
+static struct pcm *simcom_attach_take(struct audio_device *adev, bool is_rx);
 
 static inline int simcom_pcm_card_index(const struct audio_device *adev)
 {
@@ -222,7 +642,149 @@ static struct pcm_config simcom_pcm_config_rx = {
     .avail_min = 800,
 };
 
-static int simcom_acquire_tx_pcm(struct audio_device *adev, bool wait_for_device)
+/**
+ * @brief simcom_pcm_config_set_rate
+ * scale a modem pcm config to another rate, keeping period and threshold durations
+ */
+static void simcom_pcm_config_set_rate(struct pcm_config *config, unsigned int rate)
+{
+    const unsigned int from = config->rate;
+
+    config->period_size = config->period_size * rate / from;
+    config->start_threshold = config->start_threshold * rate / from;
+    config->stop_threshold = config->stop_threshold * rate / from;
+    config->avail_min = config->avail_min * rate / from;
+    config->rate = rate;
+}
+
+/**
+ * @brief simcom_set_rate
+ * switch the modem configs to a newly probed rate. Deferred while a modem pcm
+ * or a stream sized for the old rate is open, every user of the old rate has
+ * to go first. Called with adev->lock held.
+ */
+static void simcom_set_rate(struct audio_device *adev, unsigned int rate)
+{
+    if (rate == 0 || rate == adev->simcom_rate)
+        return;
+    if (adev->simcom_tx_pcm || adev->simcom_rx_pcm || adev->simcom_rate_pins > 0) {
+        ALOGW("SIMCOM: modem offers %u Hz, keeping %u Hz while it is in use",
+              rate, adev->simcom_rate);
+        return;
+    }
+    simcom_pcm_config_set_rate(&simcom_pcm_config_tx, rate);
+    simcom_pcm_config_set_rate(&simcom_pcm_config_rx, rate);
+    ALOGI("SIMCOM: modem rate %u -> %u Hz", adev->simcom_rate, rate);
+    adev->simcom_rate = rate;
+}
+
+/**
+ * @brief simcom_rate_pin
+ * a stream is about to size its buffers and resampler for the modem rate, keep
+ * that rate until simcom_rate_unpin(). The first pin probes the modem again, so
+ * a rate deferred for earlier streams is picked up.
+ *
+ * @returns the rate to open the stream at
+ */
+static unsigned int simcom_rate_pin(struct audio_device *adev)
+{
+    unsigned int rate;
+
+    pthread_mutex_lock(&adev->lock);
+    if (adev->simcom_rate_pins == 0)
+        simcom_detect_card(adev);
+    adev->simcom_rate_pins++;
+    rate = adev->simcom_rate;
+    pthread_mutex_unlock(&adev->lock);
+
+    return rate;
+}
+
+static void simcom_rate_unpin(struct audio_device *adev)
+{
+    pthread_mutex_lock(&adev->lock);
+    adev->simcom_rate_pins--;
+    pthread_mutex_unlock(&adev->lock);
+}
+
+static bool simcom_pcm_supports_rate(int card, int device, unsigned int flags,
+                                     unsigned int rate, bool *known)
+{
+    struct pcm_params *params = pcm_params_get(card, device, flags);
+    if (!params) {
+        *known = false;
+        return false;
+    }
+    bool ok = pcm_params_get_min(params, PCM_PARAM_RATE) <= rate &&
+              rate <= pcm_params_get_max(params, PCM_PARAM_RATE);
+    pcm_params_free(params);
+    return ok;
+}
+
+/**
+ * @brief simcom_probe_rate
+ * wideband when both directions of the modem pcm accept it, unless
+ * persist.vendor.audio.simcom.wideband is false
+ *
+ * @returns the rate, or 0 while the pcm nodes can not be queried yet
+ */
+static unsigned int simcom_probe_rate(int card, int device)
+{
+    bool known = true;
+
+    if (!property_get_bool("persist.vendor.audio.simcom.wideband", true))
+        return SIMCOM_PCM_RATE;
+    bool tx = simcom_pcm_supports_rate(card, device, PCM_OUT, SIMCOM_PCM_RATE_WB, &known);
+    bool rx = simcom_pcm_supports_rate(card, device, PCM_IN, SIMCOM_PCM_RATE_WB, &known);
+    if (!known)
+        return 0;
+    return (tx && rx) ? SIMCOM_PCM_RATE_WB : SIMCOM_PCM_RATE;
+}
+
+static int simcom_tx_fifo_init(struct simcom_tx_fifo *fifo)
+{
+    const size_t max_period = simcom_pcm_config_tx.period_size *
+                              (SIMCOM_PCM_RATE_MAX / simcom_pcm_config_tx.rate);
+
+    pthread_mutex_init(&fifo->lock, NULL);
+    fifo->period_bytes = simcom_pcm_config_tx.period_size * SIMCOM_PCM_CHANNELS *
+                         (SIMCOM_PCM_BITS / 8);
+    fifo->size = fifo->period_bytes * SIMCOM_TX_FIFO_PERIODS;
+    fifo->prefill_bytes = simcom_pcm_config_tx.start_threshold * SIMCOM_PCM_CHANNELS *
+                          (SIMCOM_PCM_BITS / 8);
+    fifo->buf = (uint8_t *)calloc(1, max_period * SIMCOM_PCM_CHANNELS * (SIMCOM_PCM_BITS / 8) *
+                                     SIMCOM_TX_FIFO_PERIODS);
+    fifo->fill = 0;
+    fifo->primed = false;
+    return fifo->buf ? 0 : -ENOMEM;
+}
+
+static void simcom_tx_fifo_release(struct simcom_tx_fifo *fifo)
+{
+    free(fifo->buf);
+    fifo->buf = NULL;
+    pthread_mutex_destroy(&fifo->lock);
+}
+
+/* a new TX pcm starts empty and needs its prefill again, at the current modem rate */
+static void simcom_tx_fifo_reset_l(struct simcom_tx_fifo *fifo)
+{
+    fifo->period_bytes = simcom_pcm_config_tx.period_size * SIMCOM_PCM_CHANNELS *
+                         (SIMCOM_PCM_BITS / 8);
+    fifo->size = fifo->period_bytes * SIMCOM_TX_FIFO_PERIODS;
+    fifo->prefill_bytes = simcom_pcm_config_tx.start_threshold * SIMCOM_PCM_CHANNELS *
+                          (SIMCOM_PCM_BITS / 8);
+    fifo->fill = 0;
+    fifo->primed = false;
+}
+
+/**
+ * @brief simcom_acquire_tx_pcm
+ * take a reference on the modem TX pcm. Never blocks: when the pcm is not open
+ * yet the request is handed to the attach thread and -EAGAIN is returned.
+ * Must be called with adev->lock held.
+ */
+static int simcom_acquire_tx_pcm(struct audio_device *adev)
 {
     if (!adev) {
         return -EINVAL;
@@ -234,54 +796,19 @@ static int simcom_acquire_tx_pcm(struct audio_device *adev, bool wait_for_device
         return 0;
     }
 
-    if (!simcom_detect_card(adev)) {
-        ALOGE("SIMCOM: telephony TX requested but SIMCOM device not detected");
-        return -ENODEV;
-    }
-
-    int ret = simcom_wait_for_pcm_node(adev, false, wait_for_device);
-    if (ret != 0) {
-        return (ret == -ETIMEDOUT || ret == -ENOENT) ? -EAGAIN : ret;
-    }
-
-    const int card = simcom_pcm_card_index(adev);
-    const int device = simcom_pcm_device_index(adev);
-    const int attempts = wait_for_device ? 5 : 1;
-    int last_err = -EIO;
-
-    for (int attempt = 1; attempt <= attempts; ++attempt) {
-        ALOGD("SIMCOM: opening shared telephony TX PCM (card %d device %d), attempt %d/%d",
-              card, device, attempt, attempts);
-        struct pcm *pcm_handle = pcm_open(card, device,
-                                          PCM_OUT | PCM_MONOTONIC,
-                                          &simcom_pcm_config_tx);
-        if (pcm_handle && pcm_is_ready(pcm_handle)) {
-            adev->simcom_tx_pcm = pcm_handle;
-            adev->simcom_tx_users = 1;
-            ALOGI("SIMCOM: telephony TX PCM ready on card %d device %d", card, device);
-            return 0;
-        }
-
-        int err = errno ? -errno : -ENODEV;
-        last_err = err;
-        if (pcm_handle) {
-            ALOGE("SIMCOM: failed to open TX PCM: %s",
-                  pcm_get_error(pcm_handle));
-            pcm_close(pcm_handle);
-        } else {
-            ALOGE("SIMCOM: failed to allocate TX PCM handle (err=%d)", -err);
-        }
-
-        if (!wait_for_device ||
-            (err != -EBUSY && err != -EAGAIN && err != -ENOENT && err != -EINVAL)) {
-            break;
-        }
-        usleep(SIMCOM_WAIT_STEP_MS * 1000);
+    struct pcm *pcm_handle = simcom_attach_take(adev, false);
+    if (!pcm_handle) {
+        return -EAGAIN;
     }
 
-    adev->simcom_tx_pcm = NULL;
-    adev->simcom_tx_users = 0;
-    return (last_err == 0) ? -ENODEV : last_err;
+    pthread_mutex_lock(&adev->simcom_tx_fifo.lock);
+    adev->simcom_tx_pcm = pcm_handle;
+    simcom_tx_fifo_reset_l(&adev->simcom_tx_fifo);
+    pthread_mutex_unlock(&adev->simcom_tx_fifo.lock);
+    adev->simcom_tx_users = 1;
+    ALOGI("SIMCOM: telephony TX PCM ready on card %d device %d",
+          simcom_pcm_card_index(adev), simcom_pcm_device_index(adev));
+    return 0;
 }
 
 static void simcom_release_tx_pcm(struct audio_device *adev)
@@ -290,8 +817,12 @@ static void simcom_release_tx_pcm(struct audio_device *adev)
         adev->simcom_tx_users--;
         if (adev->simcom_tx_users == 0) {
             if (adev->simcom_tx_pcm) {
+                /* a writer may still be inside simcom_tx_write() */
+                pthread_mutex_lock(&adev->simcom_tx_fifo.lock);
                 pcm_close(adev->simcom_tx_pcm);
                 adev->simcom_tx_pcm = NULL;
+                simcom_tx_fifo_reset_l(&adev->simcom_tx_fifo);
+                pthread_mutex_unlock(&adev->simcom_tx_fifo.lock);
                 ALOGI("SIMCOM: telephony TX PCM closed");
             }
         } else {
@@ -300,7 +831,11 @@ static void simcom_release_tx_pcm(struct audio_device *adev)
     }
 }
 
-static int simcom_acquire_rx_pcm(struct audio_device *adev, bool wait_for_device)
+/**
+ * @brief simcom_acquire_rx_pcm
+ * RX counterpart of simcom_acquire_tx_pcm(), same locking and -EAGAIN contract
+ */
+static int simcom_acquire_rx_pcm(struct audio_device *adev)
 {
     if (!adev) {
         return -EINVAL;
@@ -312,59 +847,22 @@ static int simcom_acquire_rx_pcm(struct audio_device *adev, bool wait_for_device
         return 0;
     }
 
-    if (!simcom_detect_card(adev)) {
-        ALOGE("SIMCOM: telephony RX requested but SIMCOM device not detected");
-        return -ENODEV;
+    struct pcm *pcm_handle = simcom_attach_take(adev, true);
+    if (!pcm_handle) {
+        return -EAGAIN;
     }
 
-    int ret = simcom_wait_for_pcm_node(adev, true, wait_for_device);
-    if (ret != 0) {
-        return (ret == -ETIMEDOUT || ret == -ENOENT) ? -EAGAIN : ret;
-    }
-
-    const int card = simcom_pcm_card_index(adev);
-    const int device = simcom_pcm_device_index(adev);
-    const int attempts = wait_for_device ? 5 : 1;
-    int last_err = -EIO;
-
-    for (int attempt = 1; attempt <= attempts; ++attempt) {
-        ALOGD("SIMCOM: opening shared telephony RX PCM (card %d device %d), attempt %d/%d",
-              card, device, attempt, attempts);
-        struct pcm *pcm_handle = pcm_open(card, device, PCM_IN, &simcom_pcm_config_rx);
-        if (pcm_handle && pcm_is_ready(pcm_handle)) {
-            adev->simcom_rx_pcm = pcm_handle;
-            adev->simcom_rx_users = 1;
-            simcom_rx_bus_reset(adev);
-            ALOGI("SIMCOM: telephony RX PCM ready on card %d device %d", card, device);
-            return 0;
-        }
-
-        int err = errno ? -errno : -ENODEV;
-        last_err = err;
-        if (pcm_handle) {
-            ALOGE("SIMCOM: failed to open RX PCM: %s",
-                  pcm_get_error(pcm_handle));
-            pcm_close(pcm_handle);
-        } else {
-            ALOGE("SIMCOM: failed to allocate RX PCM handle (err=%d)", -err);
-        }
-
-        if (!wait_for_device ||
-            (err != -EBUSY && err != -EAGAIN && err != -ENOENT && err != -EINVAL)) {
-            break;
-        }
-        usleep(SIMCOM_WAIT_STEP_MS * 1000);
-    }
-
-    adev->simcom_rx_pcm = NULL;
-    adev->simcom_rx_users = 0;
-    return (last_err == 0) ? -ENODEV : last_err;
+    adev->simcom_rx_pcm = pcm_handle;
+    adev->simcom_rx_users = 1;
+    simcom_rx_bus_reset(adev);
+    ALOGI("SIMCOM: telephony RX PCM ready on card %d device %d",
+          simcom_pcm_card_index(adev), simcom_pcm_device_index(adev));
+    return 0;
 }
 
 static void simcom_release_rx_pcm(struct audio_device *adev)
 {
     if (adev->simcom_rx_users > 0) {
-        simcom_rx_bus_drop_consumer(adev);
         adev->simcom_rx_users--;
         if (adev->simcom_rx_users == 0) {
             if (adev->simcom_rx_pcm) {
@@ -379,97 +877,405 @@ static void simcom_release_rx_pcm(struct audio_device *adev)
     }
 }
 
-static void simcom_release_tx_resampler(struct stream_out *out)
+/**
+ * @brief simcom_downmix_to_mono
+ * average all channels of each frame, stereo uses (l + r) >> 1 so the NEON
+ * halving add and the scalar tail give identical results
+ */
+static void simcom_downmix_to_mono(int16_t *dst, const int16_t *src,
+                                   size_t frames, uint32_t channels)
+{
+    size_t i = 0;
+
+    if (channels == 2) {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x2_t lr = vld2q_s16(src + 2 * i);
+            vst1q_s16(dst + i, vhaddq_s16(lr.val[0], lr.val[1]));
+        }
+#endif
+        for (; i < frames; i++) {
+            dst[i] = (int16_t)(((int32_t)src[2 * i] + src[2 * i + 1]) >> 1);
+        }
+        return;
+    }
+
+    for (; i < frames; i++) {
+        int32_t sum = 0;
+        uint32_t ch;
+        for (ch = 0; ch < channels; ch++) {
+            sum += src[i * channels + ch];
+        }
+        dst[i] = (int16_t)(sum / (int32_t)channels);
+    }
+}
+
+/**
+ * @brief mono_fan_out
+ * copy each mono sample, scaled by a Q14 gain, to every channel of dst.
+ * The scalar tail rounds like the NEON narrowing shift.
+ */
+static void mono_fan_out(int16_t *dst, const int16_t *src, size_t frames,
+                         uint32_t channels, int16_t gain)
+{
+    size_t i = 0;
+
+    if (gain == CHANNEL_MAP_UNITY) {
+        if (channels == 2) {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+            for (; i + 8 <= frames; i += 8) {
+                int16x8x2_t dup;
+                dup.val[0] = dup.val[1] = vld1q_s16(src + i);
+                vst2q_s16(dst + 2 * i, dup);
+            }
+#endif
+            for (; i < frames; i++)
+                dst[2 * i] = dst[2 * i + 1] = src[i];
+            return;
+        }
+        for (; i < frames; i++) {
+            for (uint32_t ch = 0; ch < channels; ch++)
+                dst[i * channels + ch] = src[i];
+        }
+        return;
+    }
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (channels == 2) {
+        for (; i + 8 <= frames; i += 8) {
+            int16x8_t x = vld1q_s16(src + i);
+            int32x4_t lo = vmull_n_s16(vget_low_s16(x), gain);
+            int32x4_t hi = vmull_n_s16(vget_high_s16(x), gain);
+            int16x8x2_t dup;
+            dup.val[0] = dup.val[1] = vcombine_s16(vqrshrn_n_s32(lo, 14),
+                                                   vqrshrn_n_s32(hi, 14));
+            vst2q_s16(dst + 2 * i, dup);
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        int32_t v = ((int32_t)src[i] * gain + (1 << 13)) >> 14;
+        int16_t sample = v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : (int16_t)v);
+        for (uint32_t ch = 0; ch < channels; ch++)
+            dst[i * channels + ch] = sample;
+    }
+}
+
+/**
+ * @brief simcom_drift_update
+ * feed the playback fill of pcm, measured right after a write, to the controller
+ */
+static void simcom_drift_update(struct simcom_drift *d, struct pcm *pcm)
+{
+    unsigned int avail;
+    struct timespec ts;
+    int32_t size = (int32_t)pcm_get_buffer_size(pcm);
+    int32_t fill;
+
+    /* fails until the pcm is running */
+    if (pcm_get_htimestamp(pcm, &avail, &ts) != 0)
+        return;
+    fill = size - (int32_t)avail;
+    if (d->target == 0) {
+        d->target = fill > size / 4 ? fill : size / 4;
+        d->fill_q4 = fill << 4;
+        return;
+    }
+
+    d->fill_q4 += fill - (d->fill_q4 >> 4);
+    int32_t err = (d->fill_q4 >> 4) - d->target;
+    d->integ += err;
+    if (d->integ > SIMCOM_DRIFT_MAX_PPM * 64)
+        d->integ = SIMCOM_DRIFT_MAX_PPM * 64;
+    else if (d->integ < -SIMCOM_DRIFT_MAX_PPM * 64)
+        d->integ = -SIMCOM_DRIFT_MAX_PPM * 64;
+
+    /* too full: the sink clock is slower than ours, produce fewer samples */
+    int64_t ppm = -((int64_t)err * 5 / 4 + d->integ / 64);
+    if (ppm > SIMCOM_DRIFT_MAX_PPM)
+        ppm = SIMCOM_DRIFT_MAX_PPM;
+    else if (ppm < -SIMCOM_DRIFT_MAX_PPM)
+        ppm = -SIMCOM_DRIFT_MAX_PPM;
+    d->ppm = (int32_t)ppm;
+}
+
+/**
+ * @brief simcom_drift_apply
+ * insert or drop at most one mono sample at the end of buf, blending the last
+ * pair so the slip does not click. buf must have room for frames + 1.
+ *
+ * @returns the new frame count
+ */
+static size_t simcom_drift_apply(struct simcom_drift *d, int16_t *buf, size_t frames)
+{
+    if (d->ppm == 0 || frames < 2)
+        return frames;
+
+    d->phase += (int64_t)d->ppm * (int64_t)frames;
+    if (d->phase >= 1000000) {
+        d->phase -= 1000000;
+        buf[frames] = buf[frames - 1];
+        buf[frames - 1] = (int16_t)(((int32_t)buf[frames - 2] + buf[frames - 1]) / 2);
+        frames++;
+        d->slips++;
+    } else if (d->phase <= -1000000) {
+        d->phase += 1000000;
+        buf[frames - 2] = (int16_t)(((int32_t)buf[frames - 2] + buf[frames - 1]) / 2);
+        frames--;
+        d->slips++;
+    }
+    return frames;
+}
+
+static void simcom_uplink_release(struct simcom_uplink *ul)
 {
-    if (!out) {
-        return;
-    }
-    if (out->simcom_resampler) {
-        release_resampler(out->simcom_resampler);
-        out->simcom_resampler = NULL;
+    if (ul->drift.slips) {
+        ALOGI("SIMCOM: uplink drift trim slipped %llu samples, last trim %d ppm",
+              (unsigned long long)ul->drift.slips, ul->drift.ppm);
     }
-    if (out->simcom_resampler_buffer) {
-        free(out->simcom_resampler_buffer);
-        out->simcom_resampler_buffer = NULL;
-        out->simcom_resampler_buffer_frames = 0;
+    if (ul->resampler) {
+        release_resampler(ul->resampler);
     }
-    out->simcom_resampler_in_rate = 0;
+    free(ul->mono);
+    free(ul->out);
+    memset(ul, 0, sizeof(*ul));
 }
 
-static int simcom_ensure_tx_resampler_buffer(struct stream_out *out,
-                                             size_t frames,
-                                             size_t channels)
+/**
+ * @brief simcom_uplink_prepare
+ * (re)build the converter when the input format changes, no-op otherwise
+ *
+ * @param ul
+ * @param in_rate
+ * @param in_channels
+ * @param out_rate
+ * @param frames  expected input frames per call, sizes the chunk buffers
+ *
+ * @returns 0 on success
+ */
+static int simcom_uplink_prepare(struct simcom_uplink *ul, uint32_t in_rate,
+                                 uint32_t in_channels, uint32_t out_rate, size_t frames)
 {
-    if (!out || channels == 0) {
+    if (in_rate == 0 || in_channels == 0 || out_rate == 0) {
         return -EINVAL;
     }
-    if (frames <= out->simcom_resampler_buffer_frames &&
-            out->simcom_resampler_buffer != NULL) {
+    if (ul->in_channels == in_channels && ul->in_rate == in_rate &&
+            ul->out_rate == out_rate) {
         return 0;
     }
 
-    size_t new_frames = frames;
-    if (new_frames < out->simcom_resampler_buffer_frames * 2) {
-        new_frames = out->simcom_resampler_buffer_frames * 2;
+    simcom_uplink_release(ul);
+    if (frames == 0) {
+        frames = in_rate / 50; /* one 20 ms frame */
     }
-    if (new_frames == 0) {
-        new_frames = frames;
+    ul->max_in_frames = frames;
+    /* a few spare frames so the resampler always consumes the whole chunk */
+    ul->out_frames = (size_t)(((uint64_t)frames * out_rate) / in_rate) + 16;
+    if (in_channels != 1) {
+        ul->mono = (int16_t *)malloc(frames * sizeof(int16_t));
     }
-
-    size_t bytes = new_frames * channels * sizeof(int16_t);
-    int16_t *buf = (int16_t *)realloc(out->simcom_resampler_buffer, bytes);
-    if (buf == NULL) {
-        ALOGE("SIMCOM: unable to allocate TX resampler buffer (%zu frames)", new_frames);
+    if (in_rate != out_rate) {
+        ul->out = (int16_t *)malloc(ul->out_frames * sizeof(int16_t));
+    }
+    if ((in_channels != 1 && ul->mono == NULL) ||
+            (in_rate != out_rate && ul->out == NULL)) {
+        ALOGE("SIMCOM: unable to allocate uplink buffers (%zu frames)", frames);
+        simcom_uplink_release(ul);
         return -ENOMEM;
     }
-    out->simcom_resampler_buffer = buf;
-    out->simcom_resampler_buffer_frames = new_frames;
+    if (in_rate != out_rate) {
+        int ret = create_resampler(in_rate, out_rate, 1, RESAMPLER_QUALITY_DEFAULT,
+                                   NULL, &ul->resampler);
+        if (ret != 0) {
+            ALOGE("SIMCOM: failed to create uplink resampler %u->%u (ret=%d)",
+                  in_rate, out_rate, ret);
+            simcom_uplink_release(ul);
+            return -EINVAL;
+        }
+    }
+    ul->in_rate = in_rate;
+    ul->in_channels = in_channels;
+    ul->out_rate = out_rate;
+    ALOGI("SIMCOM: uplink %u Hz %u ch -> %u Hz mono, %zu frames per chunk",
+          in_rate, in_channels, out_rate, frames);
     return 0;
 }
 
+/**
+ * @brief simcom_tx_write
+ * queue modem format data for the TX pcm and write out every whole period.
+ * Safe to call from any stream or the call engine while holding a TX reference.
+ *
+ * @param adev
+ * @param data
+ * @param bytes
+ * @param drift  controller to feed with the pcm fill after a write, or NULL
+ *
+ * @returns 0, -ENODEV without TX pcm, or the first pcm_write() error
+ */
+static int simcom_tx_write(struct audio_device *adev, const void *data, size_t bytes,
+                           struct simcom_drift *drift)
+{
+    struct simcom_tx_fifo *fifo = &adev->simcom_tx_fifo;
+    const uint8_t *src = (const uint8_t *)data;
+    int ret = 0;
+
+    pthread_mutex_lock(&fifo->lock);
+    struct pcm *pcm = adev->simcom_tx_pcm;
+    if (!pcm || !fifo->buf) {
+        pthread_mutex_unlock(&fifo->lock);
+        return -ENODEV;
+    }
+
+    fifo->bytes_in += bytes;
+    if (!fifo->primed) {
+        /* fill up to the start threshold so the pcm starts with a cushion */
+        size_t prefill = fifo->prefill_bytes;
+        if (prefill > fifo->size)
+            prefill = fifo->size;
+        fifo->fill = 0;
+        memset(fifo->buf, 0, prefill);
+        ret = pcm_write(pcm, fifo->buf, prefill);
+        fifo->pcm_writes++;
+        fifo->prefills++;
+        if (ret == 0)
+            fifo->primed = true;
+        else
+            fifo->errors++;
+    }
+
+    while (bytes > 0) {
+        size_t n = fifo->size - fifo->fill;
+        if (n > bytes)
+            n = bytes;
+        memcpy(fifo->buf + fifo->fill, src, n);
+        fifo->fill += n;
+        src += n;
+        bytes -= n;
+        if (fifo->fill > fifo->max_fill)
+            fifo->max_fill = fifo->fill;
+
+        size_t whole = fifo->fill - fifo->fill % fifo->period_bytes;
+        if (whole == 0)
+            continue;
+        int err = pcm_write(pcm, fifo->buf, whole);
+        fifo->pcm_writes++;
+        if (err) {
+            ALOGE("SIMCOM: TX pcm_write failed ret=%d err=%s", err, pcm_get_error(pcm));
+            fifo->errors++;
+            if (ret == 0)
+                ret = err;
+            /* the pcm was re-prepared, start over with a fresh prefill */
+            fifo->fill = 0;
+            fifo->primed = false;
+            continue;
+        }
+        memmove(fifo->buf, fifo->buf + whole, fifo->fill - whole);
+        fifo->fill -= whole;
+        if (drift)
+            simcom_drift_update(drift, pcm);
+    }
+    pthread_mutex_unlock(&fifo->lock);
+
+    return ret;
+}
+
+static void simcom_tx_fifo_dump(struct audio_device *adev, int fd)
+{
+    struct simcom_tx_fifo *fifo = &adev->simcom_tx_fifo;
+
+    pthread_mutex_lock(&fifo->lock);
+    dprintf(fd, "SIMCOM TX fifo: fill %zu/%zu bytes (max %zu), period %zu bytes, %s\n",
+            fifo->fill, fifo->size, fifo->max_fill, fifo->period_bytes,
+            fifo->primed ? "primed" : "not primed");
+    dprintf(fd, "  in %llu bytes, %llu pcm writes, %llu prefills, %llu errors\n",
+            (unsigned long long)fifo->bytes_in, (unsigned long long)fifo->pcm_writes,
+            (unsigned long long)fifo->prefills, (unsigned long long)fifo->errors);
+    pthread_mutex_unlock(&fifo->lock);
+}
+
+/**
+ * @brief simcom_uplink_write
+ * convert interleaved S16 input to modem format and queue it for the TX pcm
+ *
+ * @param ul      prepared converter
+ * @param adev
+ * @param buffer
+ * @param frames  input frames
+ * @param tag     log tag
+ *
+ * @returns 0 or the first simcom_tx_write() error
+ */
+static int simcom_uplink_write(struct simcom_uplink *ul, struct audio_device *adev,
+                               const int16_t *buffer, size_t frames, const char *tag)
+{
+    int ret = 0;
+
+    while (frames > 0) {
+        size_t chunk = frames < ul->max_in_frames ? frames : ul->max_in_frames;
+        const int16_t *mono = buffer;
+        const int16_t *data;
+        size_t out_frames = chunk;
+
+        if (ul->in_channels != 1) {
+            simcom_downmix_to_mono(ul->mono, buffer, chunk, ul->in_channels);
+            mono = ul->mono;
+        }
+        data = mono;
+        if (ul->resampler) {
+            size_t in_frames = chunk;
+            /* keep one frame free for the drift trim */
+            out_frames = ul->out_frames - 1;
+            ul->resampler->resample_from_input(ul->resampler, mono, &in_frames,
+                                               ul->out, &out_frames);
+            out_frames = simcom_drift_apply(&ul->drift, ul->out, out_frames);
+            data = ul->out;
+        }
+
+        if (out_frames > 0) {
+            simcom_log_pcm_snapshot(tag, data, out_frames * sizeof(int16_t));
+            int err = simcom_tx_write(adev, data, out_frames * sizeof(int16_t),
+                                      ul->resampler ? &ul->drift : NULL);
+            if (err && ret == 0) {
+                ALOGE("SIMCOM: %s write failed ret=%d", tag, err);
+                ret = err;
+            }
+        }
+        buffer += chunk * ul->in_channels;
+        frames -= chunk;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief simcom_prepare_tx_resampler
+ * set up the uplink of a telephony TX stream, from the client rate to the modem rate.
+ * Called with adev->lock held once the TX pcm is attached, when the rate is final.
+ */
 static int simcom_prepare_tx_resampler(struct stream_out *out)
 {
     if (!out || !out->is_simcom_voice) {
-        simcom_release_tx_resampler(out);
+        if (out) {
+            simcom_uplink_release(&out->simcom_uplink);
+        }
         return 0;
     }
 
+    out->config = simcom_pcm_config_tx;
+
     uint32_t requested = out->requested_rate;
     if (requested == 0) {
         requested = out->config.rate;
     }
-    if (requested == out->config.rate) {
-        simcom_release_tx_resampler(out);
-        return 0;
-    }
-
-    if (out->simcom_resampler &&
-            out->simcom_resampler_in_rate == requested) {
-        return 0;
-    }
-
-    simcom_release_tx_resampler(out);
 
     size_t channels = out->config.channels;
     if (channels == 0) {
         channels = 1;
     }
 
-    int ret = create_resampler(requested,
-                               out->config.rate,
-                               channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               NULL,
-                               &out->simcom_resampler);
-    if (ret != 0) {
-        ALOGE("SIMCOM: failed to create TX resampler %u->%u (ret=%d)",
-              requested, out->config.rate, ret);
-        simcom_release_tx_resampler(out);
-        return -EINVAL;
-    }
-
-    out->simcom_resampler_in_rate = requested;
-    return 0;
+    return simcom_uplink_prepare(&out->simcom_uplink, requested, channels,
+                                 out->config.rate, out->config.period_size);
 }
 
 struct SurroundFormat {
@@ -523,7 +1329,7 @@ FILE *in_debug;
 
 int in_dump(const struct audio_stream *stream, int fd);
 int out_dump(const struct audio_stream *stream, int fd);
-static inline bool hasExtCodec();
+static inline bool hasExtCodec(struct audio_device *adev);
 
 /**
  * @brief get_output_device_id
@@ -599,140 +1405,644 @@ int get_input_source_id(audio_source_t source)
  */
 static void force_non_hdmi_out_standby(struct audio_device *adev)
 {
-    enum output_type type;
-    struct stream_out *out;
-    for (type = 0; type < OUTPUT_TOTAL; ++type) {
-        out = adev->outputs[type];
-        if (type == OUTPUT_HDMI_MULTI|| !out)
-            continue;
-        /* This will never recurse more than 2 levels deep. */
-        do_out_standby(out);
+    enum output_type type;
+    struct stream_out *out;
+    for (type = 0; type < OUTPUT_TOTAL; ++type) {
+        out = adev->outputs[type];
+        if (type == OUTPUT_HDMI_MULTI|| !out)
+            continue;
+        /* This will never recurse more than 2 levels deep. */
+        do_out_standby(out);
+    }
+}
+
+static int simcom_parse_card_index(const char *line)
+{
+    if (!line) {
+        return -1;
+    }
+
+    while (*line && !isdigit((unsigned char)*line)) {
+        ++line;
+    }
+    if (!*line) {
+        return -1;
+    }
+
+    char *end = NULL;
+    long value = strtol(line, &end, 10);
+    if (end == line || value < 0 || value >= SNDRV_CARDS) {
+        return -1;
+    }
+    return (int)value;
+}
+
+static bool simcom_detect_card(struct audio_device *adev)
+{
+    if (!adev) {
+        return false;
+    }
+
+    FILE *fp = fopen(SND_CARDS_NODE, "r");
+    if (!fp) {
+        ALOGW("SIMCOM: failed to open %s: %s", SND_CARDS_NODE, strerror(errno));
+        adev->simcom_card_available = false;
+        adev->simcom_pcm_card = -1;
+        return false;
+    }
+
+    char line[256];
+    int detected = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strstr(line, SIMCOM_CARD_ID_STRING)) {
+            detected = simcom_parse_card_index(line);
+            if (detected >= 0) {
+                ALOGI("SIMCOM audio device detected on card %d: %s", detected, line);
+            } else {
+                ALOGW("SIMCOM: identifier found but card index parse failed: %s", line);
+            }
+            break;
+        }
+    }
+    fclose(fp);
+
+    if (detected >= 0) {
+        if (adev->simcom_pcm_card != detected) {
+            ALOGI("SIMCOM: card index updated %d -> %d",
+                  adev->simcom_pcm_card, detected);
+        }
+        if (detected != SIMCOM_PCM_CARD_FALLBACK) {
+            ALOGW("SIMCOM: card index is %d (expected %d); HAL will adapt dynamically",
+                  detected, SIMCOM_PCM_CARD_FALLBACK);
+        }
+        adev->simcom_pcm_card = detected;
+        adev->simcom_card_available = true;
+        simcom_set_rate(adev, simcom_probe_rate(detected, simcom_pcm_device_index(adev)));
+        return true;
+    }
+
+    if (adev->simcom_card_available) {
+        ALOGW("SIMCOM: audio device disappeared from %s", SND_CARDS_NODE);
+    } else {
+        ALOGW("SIMCOM: audio device not found in %s", SND_CARDS_NODE);
+    }
+    adev->simcom_card_available = false;
+    adev->simcom_pcm_card = -1;
+    return false;
+}
+
+/**
+ * @brief simcom_attach_open
+ * one non-blocking attempt to open a modem pcm on the given card
+ *
+ * @param config  modem config at the rate negotiated for this card
+ *
+ * @returns the ready handle or NULL
+ */
+static struct pcm *simcom_attach_open(struct audio_device *adev, bool is_rx, int card,
+                                      struct pcm_config *config)
+{
+    const int device = simcom_pcm_device_index(adev);
+    char node_path[64];
+
+    snprintf(node_path, sizeof(node_path), "/dev/snd/pcmC%dD%d%c",
+             card, device, is_rx ? 'c' : 'p');
+    if (access(node_path, F_OK) != 0) {
+        ALOGV("SIMCOM: %s PCM node %s not there yet", is_rx ? "RX" : "TX", node_path);
+        return NULL;
+    }
+
+    struct pcm *pcm_handle = pcm_open(card, device, is_rx ? PCM_IN : PCM_OUT | PCM_MONOTONIC,
+                                      config);
+    if (pcm_handle && pcm_is_ready(pcm_handle)) {
+        return pcm_handle;
+    }
+
+    if (pcm_handle) {
+        ALOGE("SIMCOM: failed to open %s PCM: %s", is_rx ? "RX" : "TX",
+              pcm_get_error(pcm_handle));
+        pcm_close(pcm_handle);
+    } else {
+        ALOGE("SIMCOM: failed to allocate %s PCM handle (err=%d)",
+              is_rx ? "RX" : "TX", errno);
+    }
+    return NULL;
+}
+
+/**
+ * @brief simcom_attach_take
+ * hand over a pcm opened by the attach thread, or queue a request for one.
+ * Called with adev->lock held; only ever waits for attach->lock, which the
+ * attach thread never holds across a scan or pcm_open().
+ */
+static struct pcm *simcom_attach_take(struct audio_device *adev, bool is_rx)
+{
+    struct simcom_attach *attach = &adev->simcom_attach;
+    struct pcm *pcm_handle;
+
+    if (!attach->running) {
+        /* no attach thread: single attempt, as the non-waiting path used to do */
+        if (!simcom_detect_card(adev)) {
+            return NULL;
+        }
+        return simcom_attach_open(adev, is_rx, simcom_pcm_card_index(adev),
+                                  is_rx ? &simcom_pcm_config_rx : &simcom_pcm_config_tx);
+    }
+
+    pthread_mutex_lock(&attach->lock);
+    pcm_handle = atomic_exchange(&attach->ready[is_rx], NULL);
+    if (pcm_handle && attach->rate[is_rx] != adev->simcom_rate) {
+        /* opened before the rate was renegotiated, let the thread reopen it */
+        ALOGI("SIMCOM: dropping %s PCM opened at %u Hz, now %u Hz", is_rx ? "RX" : "TX",
+              attach->rate[is_rx], adev->simcom_rate);
+        pcm_close(pcm_handle);
+        pcm_handle = NULL;
+        pthread_cond_signal(&attach->cond);
+    }
+    if (pcm_handle) {
+        attach->want[is_rx] = false;
+    } else if (!attach->want[is_rx]) {
+        attach->want[is_rx] = true;
+        pthread_cond_signal(&attach->cond);
+        ALOGD("SIMCOM: %s PCM requested from attach thread", is_rx ? "RX" : "TX");
+    }
+    pthread_mutex_unlock(&attach->lock);
+    return pcm_handle;
+}
+
+/**
+ * @brief simcom_attach_kick
+ * a sound card came or went, make the attach thread rescan
+ */
+static void simcom_attach_kick(struct audio_device *adev)
+{
+    struct simcom_attach *attach = &adev->simcom_attach;
+
+    if (!attach->running)
+        return;
+    pthread_mutex_lock(&attach->lock);
+    attach->kick = true;
+    pthread_cond_signal(&attach->cond);
+    pthread_mutex_unlock(&attach->lock);
+}
+
+static void simcom_attach_drop_ready(struct simcom_attach *attach)
+{
+    for (int i = 0; i < 2; i++) {
+        struct pcm *pcm_handle = atomic_exchange(&attach->ready[i], NULL);
+        if (pcm_handle)
+            pcm_close(pcm_handle);
+    }
+}
+
+/**
+ * @brief simcom_attach_loop
+ * rescan on card uevents, and retry every SIMCOM_ATTACH_RETRY_MS while a
+ * stream is waiting for a pcm that could not be opened yet
+ */
+static void *simcom_attach_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct simcom_attach *attach = &adev->simcom_attach;
+
+    pthread_mutex_lock(&attach->lock);
+    while (!attach->exit) {
+        bool pending = (attach->want[0] && !atomic_load(&attach->ready[0])) ||
+                       (attach->want[1] && !atomic_load(&attach->ready[1]));
+        if (!attach->kick) {
+            if (pending) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += SIMCOM_ATTACH_RETRY_MS / 1000;
+                ts.tv_nsec += (SIMCOM_ATTACH_RETRY_MS % 1000) * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&attach->cond, &attach->lock, &ts);
+            } else {
+                pthread_cond_wait(&attach->cond, &attach->lock);
+            }
+        }
+        if (attach->exit)
+            break;
+
+        bool want_tx = attach->want[0] && !atomic_load(&attach->ready[0]);
+        bool want_rx = attach->want[1] && !atomic_load(&attach->ready[1]);
+        bool kicked = attach->kick;
+        attach->kick = false;
+        pthread_mutex_unlock(&attach->lock);
+
+        if (kicked || want_tx || want_rx) {
+            /* snapshot the configs, simcom_set_rate() changes them under adev->lock */
+            struct pcm_config tx_config, rx_config;
+            pthread_mutex_lock(&adev->lock);
+            int card = simcom_detect_card(adev) ? simcom_pcm_card_index(adev) : -1;
+            tx_config = simcom_pcm_config_tx;
+            rx_config = simcom_pcm_config_rx;
+            pthread_mutex_unlock(&adev->lock);
+
+            if (card < 0) {
+                /* handles nobody picked up belong to a modem that is gone */
+                simcom_attach_drop_ready(attach);
+            } else {
+                if (want_tx) {
+                    struct pcm *pcm_handle = simcom_attach_open(adev, false, card, &tx_config);
+                    if (pcm_handle) {
+                        attach->rate[0] = tx_config.rate;
+                        atomic_store(&attach->ready[0], pcm_handle);
+                        ALOGI("SIMCOM: TX PCM opened in background on card %d at %u Hz",
+                              card, tx_config.rate);
+                    }
+                }
+                if (want_rx) {
+                    struct pcm *pcm_handle = simcom_attach_open(adev, true, card, &rx_config);
+                    if (pcm_handle) {
+                        attach->rate[1] = rx_config.rate;
+                        atomic_store(&attach->ready[1], pcm_handle);
+                        ALOGI("SIMCOM: RX PCM opened in background on card %d at %u Hz",
+                              card, rx_config.rate);
+                    }
+                }
+            }
+        }
+        pthread_mutex_lock(&attach->lock);
+    }
+    pthread_mutex_unlock(&attach->lock);
+
+    return NULL;
+}
+
+static void simcom_attach_init(struct audio_device *adev)
+{
+    struct simcom_attach *attach = &adev->simcom_attach;
+
+    pthread_mutex_init(&attach->lock, NULL);
+    pthread_cond_init(&attach->cond, NULL);
+    attach->exit = false;
+    attach->kick = false;
+    attach->want[0] = attach->want[1] = false;
+    atomic_init(&attach->ready[0], NULL);
+    atomic_init(&attach->ready[1], NULL);
+    attach->running =
+            pthread_create(&attach->thread, NULL, simcom_attach_loop, adev) == 0;
+    if (!attach->running) {
+        ALOGW("SIMCOM: no attach thread, modem pcms are only opened when already present");
+    }
+}
+
+static void simcom_attach_release(struct audio_device *adev)
+{
+    struct simcom_attach *attach = &adev->simcom_attach;
+
+    if (attach->running) {
+        pthread_mutex_lock(&attach->lock);
+        attach->exit = true;
+        pthread_cond_signal(&attach->cond);
+        pthread_mutex_unlock(&attach->lock);
+        pthread_join(attach->thread, NULL);
+        attach->running = false;
+    }
+    simcom_attach_drop_ready(attach);
+    pthread_cond_destroy(&attach->cond);
+    pthread_mutex_destroy(&attach->lock);
+}
+
+static bool simcom_voice_mode_active(struct audio_device *adev)
+{
+    return adev->simcom_card_available &&
+           adev->voice_call_active &&
+           adev->mode == AUDIO_MODE_IN_CALL;
+}
+
+static void card_registry_refresh(struct audio_device *adev);
+
+static bool simcom_call_engine_enabled(void)
+{
+    return property_get_bool("persist.vendor.audio.simcom.call_engine", false);
+}
+
+static inline bool simcom_call_owns_uplink(struct audio_device *adev)
+{
+    return atomic_load_explicit(&adev->simcom_call.uplink, memory_order_relaxed);
+}
+
+/* state of the call engine, only touched by the engine thread */
+struct simcom_call_ctx {
+    struct audio_device *adev;
+    struct pcm *mic;
+    struct pcm *spk;
+    struct pcm_config mic_config;
+    struct pcm_config spk_config;
+    bool have_tx;
+    bool have_rx;
+    unsigned int rate;                  /* modem rate, fixed while the engine holds the pcms */
+    uint64_t rx_cursor;
+    uint64_t rx_lost;
+    struct simcom_uplink uplink;        /* mic -> modem */
+    struct resampler_itfe *downlink;    /* modem rate -> speaker rate, mono */
+    int16_t *mic_buf;                   /* one frame at the mic config */
+    int16_t *dl_buf;                    /* one frame at the modem rate */
+    int16_t *dl_mono;                   /* dl_buf at the speaker rate */
+    int16_t *spk_buf;                   /* dl_mono spread over the speaker channels */
+    size_t dl_mono_frames;
+    struct simcom_drift dl_drift;       /* modem clock vs speaker clock */
+    struct simcom_plc dl_plc;
+    unsigned int retry;                 /* cycles until the next local pcm open attempt */
+};
+
+static void simcom_call_frame_config(struct pcm_config *config, const struct pcm_config *base)
+{
+    *config = *base;
+    config->period_size = config->rate * SIMCOM_CALL_FRAME_MS / 1000;
+    config->period_count = SIMCOM_CALL_PERIOD_COUNT;
+    config->start_threshold = config->period_size;
+    config->stop_threshold = config->period_size * config->period_count;
+    config->silence_threshold = 0;
+    config->avail_min = config->period_size;
+}
+
+static void simcom_call_close_mic(struct simcom_call_ctx *ctx)
+{
+    atomic_store(&ctx->adev->simcom_call.uplink, false);
+    if (ctx->mic) {
+        pcm_close(ctx->mic);
+        ctx->mic = NULL;
     }
+    simcom_uplink_release(&ctx->uplink);
+    free(ctx->mic_buf);
+    ctx->mic_buf = NULL;
 }
 
-static int simcom_parse_card_index(const char *line)
+static void simcom_call_close_spk(struct simcom_call_ctx *ctx)
 {
-    if (!line) {
-        return -1;
+    if (ctx->spk) {
+        pcm_close(ctx->spk);
+        ctx->spk = NULL;
     }
+    if (ctx->downlink) {
+        release_resampler(ctx->downlink);
+        ctx->downlink = NULL;
+    }
+    free(ctx->dl_mono);
+    free(ctx->spk_buf);
+    ctx->dl_mono = NULL;
+    ctx->spk_buf = NULL;
+    memset(&ctx->dl_drift, 0, sizeof(ctx->dl_drift));
+}
 
-    while (*line && !isdigit((unsigned char)*line)) {
-        ++line;
+static void simcom_call_open_mic(struct simcom_call_ctx *ctx, const struct dev_info *mic)
+{
+    struct pcm_config *config = &ctx->mic_config;
+
+    simcom_call_frame_config(config, &pcm_config_in);
+    ctx->mic = pcm_open(mic->card, mic->device, PCM_IN, config);
+    if (!ctx->mic || !pcm_is_ready(ctx->mic)) {
+        ALOGW("SIMCOM: call engine can not open mic card %d: %s, uplink left to streams",
+              mic->card, ctx->mic ? pcm_get_error(ctx->mic) : "no memory");
+        simcom_call_close_mic(ctx);
+        return;
     }
-    if (!*line) {
-        return -1;
+    ctx->mic_buf = (int16_t *)malloc(config->period_size * config->channels * sizeof(int16_t));
+    if (!ctx->mic_buf ||
+            simcom_uplink_prepare(&ctx->uplink, config->rate, config->channels,
+                                  ctx->rate, config->period_size) != 0) {
+        simcom_call_close_mic(ctx);
+        return;
     }
+    atomic_store(&ctx->adev->simcom_call.uplink, true);
+    ALOGI("SIMCOM: call engine uplink from card %d (%u Hz %u ch)",
+          mic->card, config->rate, config->channels);
+}
 
-    char *end = NULL;
-    long value = strtol(line, &end, 10);
-    if (end == line || value < 0 || value >= SNDRV_CARDS) {
-        return -1;
+static void simcom_call_open_spk(struct simcom_call_ctx *ctx, const struct dev_info *spk)
+{
+    struct pcm_config *config = &ctx->spk_config;
+
+    simcom_call_frame_config(config, &pcm_config);
+    ctx->spk = pcm_open(spk->card, spk->device, PCM_OUT | PCM_MONOTONIC, config);
+    if (!ctx->spk || !pcm_is_ready(ctx->spk)) {
+        ALOGW("SIMCOM: call engine can not open speaker card %d: %s, downlink left to streams",
+              spk->card, ctx->spk ? pcm_get_error(ctx->spk) : "no memory");
+        simcom_call_close_spk(ctx);
+        return;
     }
-    return (int)value;
+    /* spare frames so the resampler always consumes the whole modem frame, plus the drift trim */
+    ctx->dl_mono_frames = config->period_size + 16;
+    ctx->dl_mono = (int16_t *)malloc(ctx->dl_mono_frames * sizeof(int16_t));
+    ctx->spk_buf = (int16_t *)malloc(ctx->dl_mono_frames * config->channels * sizeof(int16_t));
+    if (!ctx->dl_mono || !ctx->spk_buf) {
+        simcom_call_close_spk(ctx);
+        return;
+    }
+    if (config->rate != ctx->rate &&
+            create_resampler(ctx->rate, config->rate, 1, RESAMPLER_QUALITY_DEFAULT,
+                             NULL, &ctx->downlink) != 0) {
+        ALOGE("SIMCOM: call engine failed to create downlink resampler %u->%u",
+              ctx->rate, config->rate);
+        ctx->downlink = NULL;
+        simcom_call_close_spk(ctx);
+        return;
+    }
+    ALOGI("SIMCOM: call engine downlink to card %d (%u Hz %u ch)",
+          spk->card, config->rate, config->channels);
 }
 
-static bool simcom_detect_card(struct audio_device *adev)
+/**
+ * @brief simcom_call_open_local
+ * open whichever of the primary mic and speaker is not open yet. A card kept
+ * busy by a regular stream is retried about once a second.
+ */
+static void simcom_call_open_local(struct simcom_call_ctx *ctx)
 {
-    if (!adev) {
-        return false;
-    }
+    struct audio_device *adev = ctx->adev;
+    struct dev_info mic, spk;
 
-    FILE *fp = fopen(SND_CARDS_NODE, "r");
-    if (!fp) {
-        ALOGW("SIMCOM: failed to open %s: %s", SND_CARDS_NODE, strerror(errno));
-        adev->simcom_card_available = false;
-        adev->simcom_pcm_card = -1;
-        return false;
+    if (ctx->retry > 0) {
+        ctx->retry--;
+        return;
     }
+    ctx->retry = 1000 / SIMCOM_CALL_FRAME_MS;
 
-    char line[256];
-    int detected = -1;
-    while (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, SIMCOM_CARD_ID_STRING)) {
-            detected = simcom_parse_card_index(line);
-            if (detected >= 0) {
-                ALOGI("SIMCOM audio device detected on card %d: %s", detected, line);
-            } else {
-                ALOGW("SIMCOM: identifier found but card index parse failed: %s", line);
-            }
-            break;
-        }
-    }
-    fclose(fp);
+    card_registry_refresh(adev);
+    pthread_mutex_lock(&adev->cards.lock);
+    mic = adev->cards.dev_in[SND_IN_SOUND_CARD_MIC];
+    spk = adev->cards.dev_out[SND_OUT_SOUND_CARD_SPEAKER];
+    pthread_mutex_unlock(&adev->cards.lock);
 
-    if (detected >= 0) {
-        if (adev->simcom_pcm_card != detected) {
-            ALOGI("SIMCOM: card index updated %d -> %d",
-                  adev->simcom_pcm_card, detected);
-        }
-        if (detected != SIMCOM_PCM_CARD_FALLBACK) {
-            ALOGW("SIMCOM: card index is %d (expected %d); HAL will adapt dynamically",
-                  detected, SIMCOM_PCM_CARD_FALLBACK);
-        }
-        adev->simcom_pcm_card = detected;
-        adev->simcom_card_available = true;
-        return true;
-    }
+    if (!ctx->mic && mic.card != (int)SND_IN_SOUND_CARD_UNKNOWN)
+        simcom_call_open_mic(ctx, &mic);
+    if (!ctx->spk && spk.card != (int)SND_OUT_SOUND_CARD_UNKNOWN)
+        simcom_call_open_spk(ctx, &spk);
+}
 
-    if (adev->simcom_card_available) {
-        ALOGW("SIMCOM: audio device disappeared from %s", SND_CARDS_NODE);
-    } else {
-        ALOGW("SIMCOM: audio device not found in %s", SND_CARDS_NODE);
-    }
-    adev->simcom_card_available = false;
-    adev->simcom_pcm_card = -1;
-    return false;
+static void simcom_call_attach_modem(struct simcom_call_ctx *ctx)
+{
+    struct audio_device *adev = ctx->adev;
+
+    pthread_mutex_lock(&adev->lock);
+    if (!ctx->have_tx && simcom_acquire_tx_pcm(adev) == 0)
+        ctx->have_tx = true;
+    if (!ctx->have_rx && simcom_acquire_rx_pcm(adev) == 0) {
+        ctx->have_rx = true;
+        ctx->rx_cursor = atomic_load(&adev->simcom_rx_bus.head);
+        memset(&ctx->dl_plc, 0, sizeof(ctx->dl_plc));
+    }
+    if (ctx->have_tx && ctx->have_rx)
+        ctx->rate = adev->simcom_rate;
+    pthread_mutex_unlock(&adev->lock);
 }
 
-static int simcom_wait_for_pcm_node(struct audio_device *adev, bool is_rx, bool wait_for_device)
+static void simcom_call_write_downlink(struct simcom_call_ctx *ctx, size_t frames)
 {
-    if (!adev) {
-        return -EINVAL;
+    const unsigned int channels = ctx->spk_config.channels;
+    int16_t *mono = ctx->dl_buf;
+
+    if (ctx->downlink) {
+        size_t in_frames = frames;
+        size_t out_frames = ctx->dl_mono_frames - 1;
+        ctx->downlink->resample_from_input(ctx->downlink, ctx->dl_buf, &in_frames,
+                                           ctx->dl_mono, &out_frames);
+        mono = ctx->dl_mono;
+        frames = simcom_drift_apply(&ctx->dl_drift, mono, out_frames);
     }
+    if (frames == 0)
+        return;
 
-    const int timeout_ms = is_rx ? SIMCOM_RX_TIMEOUT_MS : SIMCOM_TX_TIMEOUT_MS;
-    int elapsed_ms = 0;
-    char node_path[64];
+    for (size_t i = 0; i < frames; i++)
+        for (unsigned int ch = 0; ch < channels; ch++)
+            ctx->spk_buf[i * channels + ch] = mono[i];
 
-    while (true) {
-        const int card = simcom_pcm_card_index(adev);
-        const int device = simcom_pcm_device_index(adev);
-        snprintf(node_path, sizeof(node_path), "/dev/snd/pcmC%dD%d%c",
-                 card, device, is_rx ? 'c' : 'p');
-
-        if (access(node_path, F_OK) == 0) {
-            if (wait_for_device && elapsed_ms > 0) {
-                ALOGI("SIMCOM: %s PCM node %s ready after %d ms",
-                      is_rx ? "RX" : "TX", node_path, elapsed_ms);
+    if (pcm_write(ctx->spk, ctx->spk_buf, frames * channels * sizeof(int16_t)) != 0)
+        ALOGW("SIMCOM: call engine speaker write failed: %s", pcm_get_error(ctx->spk));
+    else if (ctx->downlink)
+        simcom_drift_update(&ctx->dl_drift, ctx->spk);
+}
+
+/**
+ * @brief simcom_call_loop
+ * one cycle moves one frame each way. The blocking pcm_read() of the mic, or of
+ * the modem when there is no mic, paces the loop.
+ */
+static void *simcom_call_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct simcom_call *call = &adev->simcom_call;
+    struct simcom_call_ctx ctx;
+    int16_t dl_buf[SIMCOM_PCM_RATE_MAX * SIMCOM_CALL_FRAME_MS / 1000];
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.adev = adev;
+    ctx.dl_buf = dl_buf;
+
+    while (!atomic_load(&call->exit)) {
+        if (!ctx.have_tx || !ctx.have_rx)
+            simcom_call_attach_modem(&ctx);
+        /* the local converters need the modem rate, known once both pcms are held */
+        if (ctx.have_tx && ctx.have_rx && (!ctx.mic || !ctx.spk))
+            simcom_call_open_local(&ctx);
+
+        bool paced = false;
+        if (ctx.mic) {
+            const size_t frames = ctx.mic_config.period_size;
+            if (pcm_read(ctx.mic, ctx.mic_buf,
+                         frames * ctx.mic_config.channels * sizeof(int16_t)) == 0) {
+                if (adev->mic_mute)
+                    memset(ctx.mic_buf, 0, frames * ctx.mic_config.channels * sizeof(int16_t));
+                if (ctx.have_tx)
+                    simcom_uplink_write(&ctx.uplink, adev, ctx.mic_buf,
+                                        frames, "TX<-call engine");
+                paced = true;
+            } else {
+                ALOGW("SIMCOM: call engine mic read failed: %s", pcm_get_error(ctx.mic));
             }
-            return 0;
         }
-
-        if (!wait_for_device) {
-            return -ENOENT;
+        if (ctx.have_rx && ctx.have_tx) {
+            const size_t modem_frames = ctx.rate * SIMCOM_CALL_FRAME_MS / 1000;
+            simcom_rx_read_concealed(adev, adev->simcom_rx_pcm, &ctx.rx_cursor, &ctx.rx_lost,
+                                     &ctx.dl_plc, dl_buf, modem_frames * sizeof(int16_t));
+            if (ctx.spk)
+                simcom_call_write_downlink(&ctx, modem_frames);
+            paced = true;
         }
+        if (!paced)
+            usleep(SIMCOM_CALL_FRAME_MS * 1000);
+    }
 
-        if (elapsed_ms == 0) {
-            ALOGW("SIMCOM: waiting for %s PCM node %s", is_rx ? "RX" : "TX", node_path);
-        }
+    simcom_call_close_mic(&ctx);
+    simcom_call_close_spk(&ctx);
+    pthread_mutex_lock(&adev->lock);
+    if (ctx.have_tx)
+        simcom_release_tx_pcm(adev);
+    if (ctx.have_rx)
+        simcom_release_rx_pcm(adev);
+    pthread_mutex_unlock(&adev->lock);
+    if (ctx.rx_lost)
+        ALOGW("SIMCOM: call engine lost %llu downlink bytes",
+              (unsigned long long)ctx.rx_lost);
 
-        if (elapsed_ms >= timeout_ms) {
-            ALOGE("SIMCOM: %s PCM node %s not available within %d ms",
-                  is_rx ? "RX" : "TX", node_path, timeout_ms);
-            return -ETIMEDOUT;
-        }
+    return NULL;
+}
 
-        usleep(SIMCOM_WAIT_STEP_MS * 1000);
-        elapsed_ms += SIMCOM_WAIT_STEP_MS;
-        simcom_detect_card(adev);
+/**
+ * @brief simcom_call_start
+ * start the call engine if persist.vendor.audio.simcom.call_engine is set.
+ * Must be called without adev->lock, the engine thread takes it.
+ */
+static void simcom_call_start(struct audio_device *adev)
+{
+    struct simcom_call *call = &adev->simcom_call;
+    pthread_attr_t attr;
+    struct sched_param param;
+    int ret;
+
+    if (!simcom_call_engine_enabled())
+        return;
+
+    pthread_mutex_lock(&call->lock);
+    if (call->running) {
+        pthread_mutex_unlock(&call->lock);
+        return;
     }
+
+    atomic_store(&call->exit, false);
+    pthread_attr_init(&attr);
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = SIMCOM_CALL_PRIORITY;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+    ret = pthread_create(&call->thread, &attr, simcom_call_loop, adev);
+    pthread_attr_destroy(&attr);
+    if (ret == EPERM) {
+        ALOGW("SIMCOM: no permission for SCHED_FIFO, call engine runs with normal priority");
+        ret = pthread_create(&call->thread, NULL, simcom_call_loop, adev);
+    }
+    call->running = (ret == 0);
+    if (call->running) {
+        ALOGI("SIMCOM: call engine started");
+    } else {
+        ALOGE("SIMCOM: failed to start call engine: %s", strerror(ret));
+    }
+    pthread_mutex_unlock(&call->lock);
 }
 
-static bool simcom_voice_mode_active(struct audio_device *adev)
+/**
+ * @brief simcom_call_stop
+ * same locking rule as simcom_call_start()
+ */
+static void simcom_call_stop(struct audio_device *adev)
 {
-    return adev->simcom_card_available &&
-           adev->voice_call_active &&
-           adev->mode == AUDIO_MODE_IN_CALL;
+    struct simcom_call *call = &adev->simcom_call;
+
+    pthread_mutex_lock(&call->lock);
+    if (call->running) {
+        atomic_store(&call->exit, true);
+        pthread_join(call->thread, NULL);
+        call->running = false;
+        ALOGI("SIMCOM: call engine stopped");
+    }
+    pthread_mutex_unlock(&call->lock);
 }
 
 /**
@@ -1128,162 +2438,433 @@ static bool get_specified_in_dev(struct dev_info *devinfo,
             return true;
         }
     }
-    return false;
+    return false;
+}
+
+static bool is_specified_in_sound_card(char *id, struct dev_proc_info *match)
+{
+    int i = 0;
+
+    /*
+     * mic: diffrent product may have diffrent card name,modify codes here
+     * for example: 0 [rockchiprk3328 ]: rockchip-rk3328 - rockchip-rk3328
+     */
+    if (!match)
+        return true;/* match any */
+    while (match[i].cid) {
+        if (!strcmp(id, match[i].cid)) {
+            return true;
+  }
+        i++;
+    }
+    return false;
+}
+
+static void set_default_dev_info( struct dev_info *info, int size, int rid)
+{
+    for(int i =0; i < size; i++) {
+        if (rid) {
+            info[i].id = NULL;
+        }
+        info[i].card = (int)SND_OUT_SOUND_CARD_UNKNOWN;
+    }
+}
+
+static void dumpdev_info(const char *tag, struct dev_info  *devinfo, int count)
+{
+    ALOGD("dump %s device info", tag);
+    for(int i = 0; i < count; i++) {
+        if (devinfo[i].id && devinfo[i].card != SND_OUT_SOUND_CARD_UNKNOWN)
+            ALOGD("dev_info %s  card=%d, device:%d", devinfo[i].id,
+                  devinfo[i].card,
+                  devinfo[i].device);
+    }
+}
+
+/**
+ * @brief card_registry_rebuild_l
+ * parse /proc/asound once: card ids, out/in dev_info matches and ext codec flag
+ * must be called with card registry mutex locked
+ *
+ * @param adev
+ */
+static void card_registry_rebuild_l(struct audio_device *adev)
+{
+    struct card_registry *reg = &adev->cards;
+    unsigned int generation = atomic_load(&reg->generation);
+    int card = 0;
+    char str[32];
+    char line[80];
+    size_t len;
+    FILE* file = NULL;
+    bool ext_codec = false;
+
+    set_default_dev_info(reg->dev_out, SND_OUT_SOUND_CARD_MAX, 0);
+    set_default_dev_info(reg->dev_in, SND_IN_SOUND_CARD_MAX, 0);
+    memset(reg->ids, 0, sizeof(reg->ids));
+    for (card = 0; card < SNDRV_CARDS; card++) {
+        char *id = reg->ids[card];
+
+        sprintf(str, "proc/asound/card%d/id", card);
+        if (access(str, 0)) {
+            ALOGD("No exist %s, break and finish parsing", str);
+            break;
+        }
+        file = fopen(str, "r");
+        if (!file) {
+            ALOGD("Could reading %s property", str);
+            continue;
+        }
+        len = fread(id, sizeof(char), SND_CARD_ID_LEN - 1, file);
+        fclose(file);
+        if (len == 0)
+            continue;
+        if (id[len - 1] == '\n') {
+            len--;
+        }
+        id[len] = '\0';
+        ALOGD("card%d id:%s", card, id);
+        get_specified_out_dev(&reg->dev_out[SND_OUT_SOUND_CARD_SPEAKER], card, id, SPEAKER_OUT_NAME);
+        get_specified_out_dev(&reg->dev_out[SND_OUT_SOUND_CARD_HDMI], card, id, HDMI_OUT_NAME);
+        get_specified_out_dev(&reg->dev_out[SND_OUT_SOUND_CARD_SPDIF], card, id, SPDIF_OUT_NAME);
+        get_specified_out_dev(&reg->dev_out[SND_OUT_SOUND_CARD_BT], card, id, BT_OUT_NAME);
+        get_specified_out_dev(&reg->dev_out[SND_OUT_SOUND_CARD_SIMCOM], card, id, SIMCOM_OUT_NAME);
+        get_specified_in_dev(&reg->dev_in[SND_IN_SOUND_CARD_MIC], card, id, MIC_IN_NAME);
+        /* set HDMI audio input info if need hdmi audio input */
+        get_specified_in_dev(&reg->dev_in[SND_IN_SOUND_CARD_HDMI], card, id, HDMI_IN_NAME);
+        get_specified_in_dev(&reg->dev_in[SND_IN_SOUND_CARD_BT], card, id, BT_IN_NAME);
+        get_specified_in_dev(&reg->dev_in[SND_IN_SOUND_CARD_SIMCOM], card, id, SIMCOM_IN_NAME);
+    }
+    reg->count = card;
+
+    file = fopen("proc/asound/cards", "r");
+    if (file != NULL) {
+        memset(line, 0, sizeof(line));
+        while (fgets(line, sizeof(line), file) != NULL) {
+            line[sizeof(line) - 1] = '\0';
+            if (strstr(line, "realtekrt5651co")) {
+                ext_codec = true;
+                break;
+            }
+        }
+        fclose(file);
+    }
+    atomic_store(&reg->ext_codec, ext_codec);
+
+    reg->built_generation = generation;
+    reg->valid = true;
+    ALOGD("%s: %d cards, ext codec %d, generation %u", __FUNCTION__,
+          reg->count, ext_codec, generation);
+}
+
+/**
+ * @brief card_registry_refresh
+ * rebuild the registry only if a card uevent arrived since the last build.
+ * Without a uevent socket every call rebuilds, as the old per-start scan did.
+ *
+ * @param adev
+ */
+static void card_registry_refresh(struct audio_device *adev)
+{
+    struct card_registry *reg = &adev->cards;
+
+    pthread_mutex_lock(&reg->lock);
+    if (!reg->valid || !reg->uevent_running ||
+            reg->built_generation != atomic_load(&reg->generation)) {
+        card_registry_rebuild_l(adev);
+    }
+    pthread_mutex_unlock(&reg->lock);
+}
+
+static int64_t elapsed_ms(const struct timespec *since);
+
+static bool hdmi_monitor_node_enabled(void)
+{
+#ifdef USE_DRM
+    const char *path = "/sys/class/drm/card0-HDMI-A-1/enabled";
+#else
+    const char *path = "/sys/class/display/HDMI/enabled";
+#endif
+    char buffer[32];
+    bool enabled = false;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+    ssize_t size = read(fd, buffer, sizeof(buffer) - 1);
+    if (size > 0) {
+        buffer[size] = '\0';
+        enabled = strstr(buffer, "enabled") != NULL;
+    }
+    close(fd);
+    return enabled;
+}
+
+static bool hdmi_monitor_has_node(void)
+{
+#ifdef USE_DRM
+    return access("/sys/class/drm/card0-HDMI-A-1/enabled", R_OK) == 0;
+#else
+    return access("/sys/class/display/HDMI/enabled", R_OK) == 0;
+#endif
+}
+
+/**
+ * @brief hdmi_monitor_kick
+ * HDMI was plugged: writes are dropped until the display side has configured
+ * it again. Called from the uevent thread and adev_set_parameters().
+ */
+static void hdmi_monitor_kick(struct audio_device *adev)
+{
+    struct hdmi_monitor *mon = &adev->hdmi_monitor;
+
+    atomic_fetch_add(&mon->plugs, 1);
+    hdmi_edid_cache_invalidate(&adev->hdmi_edid);
+    if (!mon->running)
+        return;
+    atomic_store_explicit(&mon->configured, false, memory_order_release);
+    pthread_mutex_lock(&mon->lock);
+    mon->kick = true;
+    pthread_cond_signal(&mon->cond);
+    pthread_mutex_unlock(&mon->lock);
+}
+
+static bool hdmi_monitor_configured(struct audio_device *adev)
+{
+    return atomic_load_explicit(&adev->hdmi_monitor.configured, memory_order_acquire);
+}
+
+/* wait up to ms for a kick or exit, must hold mon->lock */
+static void hdmi_monitor_wait_l(struct hdmi_monitor *mon, int ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&mon->cond, &mon->lock, &ts);
+}
+
+/**
+ * @brief hdmi_monitor_loop
+ * after each plug, poll the HDMI enabled node every HDMI_MONITOR_POLL_MS (or
+ * wait HDMI_MONITOR_SETTLE_MS without a node) and mark HDMI configured. A plug
+ * arriving meanwhile restarts the wait. Gives up after HDMI_MONITOR_TIMEOUT_MS.
+ * The EDID of the new sink is then read here, not by the next stream open.
+ */
+static void *hdmi_monitor_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct hdmi_monitor *mon = &adev->hdmi_monitor;
+
+    pthread_mutex_lock(&mon->lock);
+    while (!mon->exit) {
+        while (!mon->kick && !mon->exit)
+            pthread_cond_wait(&mon->cond, &mon->lock);
+        if (mon->exit)
+            break;
+
+        struct timespec start;
+        bool ready = false;
+        bool has_node = hdmi_monitor_has_node();
+
+        mon->kick = false;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (!mon->exit && !mon->kick) {
+            int64_t waited = elapsed_ms(&start);
+            if (has_node) {
+                pthread_mutex_unlock(&mon->lock);
+                ready = hdmi_monitor_node_enabled();
+                pthread_mutex_lock(&mon->lock);
+            } else {
+                ready = waited >= HDMI_MONITOR_SETTLE_MS;
+            }
+            if (ready || waited >= HDMI_MONITOR_TIMEOUT_MS)
+                break;
+            hdmi_monitor_wait_l(mon, has_node ? HDMI_MONITOR_POLL_MS :
+                                HDMI_MONITOR_SETTLE_MS - (int)waited);
+        }
+        if (mon->kick || mon->exit)
+            continue;
+
+        if (!ready)
+            ALOGW("%s: HDMI not configured after %d ms, writing anyway", __FUNCTION__,
+                  HDMI_MONITOR_TIMEOUT_MS);
+        else
+            ALOGD("%s: HDMI configured after %lld ms", __FUNCTION__,
+                  (long long)elapsed_ms(&start));
+        atomic_store_explicit(&mon->configured, true, memory_order_release);
+        pthread_mutex_unlock(&mon->lock);
+        hdmi_edid_cache_refresh(&adev->hdmi_edid);
+        pthread_mutex_lock(&mon->lock);
+    }
+    pthread_mutex_unlock(&mon->lock);
+
+    return NULL;
 }
 
-static bool is_specified_in_sound_card(char *id, struct dev_proc_info *match)
+static void hdmi_monitor_init(struct audio_device *adev)
 {
-    int i = 0;
+    struct hdmi_monitor *mon = &adev->hdmi_monitor;
 
-    /*
-     * mic: diffrent product may have diffrent card name,modify codes here
-     * for example: 0 [rockchiprk3328 ]: rockchip-rk3328 - rockchip-rk3328
-     */
-    if (!match)
-        return true;/* match any */
-    while (match[i].cid) {
-        if (!strcmp(id, match[i].cid)) {
-            return true;
-  }
-        i++;
-    }
-    return false;
+    pthread_mutex_init(&mon->lock, NULL);
+    pthread_cond_init(&mon->cond, NULL);
+    mon->exit = false;
+    mon->kick = false;
+    atomic_init(&mon->configured, true);
+    atomic_init(&mon->plugs, 0);
+    mon->running = pthread_create(&mon->thread, NULL, hdmi_monitor_loop, adev) == 0;
+    if (!mon->running)
+        ALOGW("%s: no HDMI monitor thread, bitstream is written right after a plug",
+              __FUNCTION__);
 }
 
-static void set_default_dev_info( struct dev_info *info, int size, int rid)
+static void hdmi_monitor_release(struct audio_device *adev)
 {
-    for(int i =0; i < size; i++) {
-        if (rid) {
-            info[i].id = NULL;
+    struct hdmi_monitor *mon = &adev->hdmi_monitor;
+
+    if (mon->running) {
+        pthread_mutex_lock(&mon->lock);
+        mon->exit = true;
+        pthread_cond_signal(&mon->cond);
+        pthread_mutex_unlock(&mon->lock);
+        pthread_join(mon->thread, NULL);
+        mon->running = false;
+    }
+    pthread_cond_destroy(&mon->cond);
+    pthread_mutex_destroy(&mon->lock);
+}
+
+/**
+ * @brief card_registry_uevent_loop
+ * invalidate the registry when a sound card is added or removed, and hand
+ * DRM hotplug events to the HDMI monitor
+ *
+ * @param context
+ *
+ * @returns
+ */
+static void *card_registry_uevent_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct card_registry *reg = &adev->cards;
+    struct pollfd fds;
+    char msg[1024];
+
+    fds.fd = uevent_get_fd();
+    fds.events = POLLIN;
+    while (!atomic_load(&reg->uevent_exit)) {
+        /* bounded wait so adev_close() can join this thread */
+        if (poll(&fds, 1, 1000) <= 0 || !(fds.revents & POLLIN))
+            continue;
+        int len = uevent_next_event(msg, sizeof(msg) - 1);
+        if (len <= 0)
+            continue;
+        msg[len] = '\0';
+        if ((!strncmp(msg, "add@", 4) || !strncmp(msg, "remove@", 7)) &&
+                strstr(msg, "/sound/card")) {
+            atomic_fetch_add(&reg->generation, 1);
+            simcom_attach_kick(adev);
+            ALOGD("%s: %s", __FUNCTION__, msg);
+        } else if (!strncmp(msg, "change@", 7) &&
+                   (strstr(msg, "/drm/card") || strstr(msg, "/display/HDMI"))) {
+            hdmi_monitor_kick(adev);
+            ALOGD("%s: %s", __FUNCTION__, msg);
         }
-        info[i].card = (int)SND_OUT_SOUND_CARD_UNKNOWN;
     }
+
+    return NULL;
 }
 
-static void dumpdev_info(const char *tag, struct dev_info  *devinfo, int count)
+/**
+ * @brief card_registry_init
+ * must be called after adev->dev_out/dev_in ids are set
+ *
+ * @param adev
+ */
+static void card_registry_init(struct audio_device *adev)
 {
-    ALOGD("dump %s device info", tag);
-    for(int i = 0; i < count; i++) {
-        if (devinfo[i].id && devinfo[i].card != SND_OUT_SOUND_CARD_UNKNOWN)
-            ALOGD("dev_info %s  card=%d, device:%d", devinfo[i].id,
-                  devinfo[i].card,
-                  devinfo[i].device);
+    struct card_registry *reg = &adev->cards;
+
+    pthread_mutex_init(&reg->lock, NULL);
+    atomic_init(&reg->generation, 0);
+    atomic_init(&reg->ext_codec, false);
+    atomic_init(&reg->uevent_exit, false);
+    memcpy(reg->dev_out, adev->dev_out, sizeof(reg->dev_out));
+    memcpy(reg->dev_in, adev->dev_in, sizeof(reg->dev_in));
+
+    if (uevent_init() &&
+            pthread_create(&reg->uevent_thread, NULL, card_registry_uevent_loop, adev) == 0) {
+        reg->uevent_running = true;
+    } else {
+        ALOGW("%s: no uevent monitor, sound cards are rescanned on every stream start",
+              __FUNCTION__);
+    }
+
+    pthread_mutex_lock(&reg->lock);
+    card_registry_rebuild_l(adev);
+    pthread_mutex_unlock(&reg->lock);
+}
+
+static void card_registry_release(struct audio_device *adev)
+{
+    struct card_registry *reg = &adev->cards;
+
+    if (reg->uevent_running) {
+        atomic_store(&reg->uevent_exit, true);
+        pthread_join(reg->uevent_thread, NULL);
+        reg->uevent_running = false;
     }
+    pthread_mutex_destroy(&reg->lock);
 }
 
 /*
- * get sound card infor by parser node: /proc/asound/cards
+ * get sound card infor from the card registry
  * the sound card number is not always the same value
  */
 static void read_out_sound_card(struct stream_out *out)
 {
-
     struct audio_device *device = NULL;
-    int card = 0;
-    char str[32];
-    char id[20];
-    size_t len;
-    FILE* file = NULL;
 
     if((out == NULL) || (out->dev == NULL)) {
         return ;
     }
     device = out->dev;
-    set_default_dev_info(device->dev_out, SND_OUT_SOUND_CARD_UNKNOWN, 0);
-    for (card = 0; card < SNDRV_CARDS; card++) {
-        sprintf(str, "proc/asound/card%d/id", card);
-        if (access(str, 0)) {
-            ALOGD("No exist %s, break and finish parsing", str);
-            break;
-        }
-        file = fopen(str, "r");
-        if (!file) {
-            ALOGD("Could reading %s property", str);
-            continue;
-        }
-        len = fread(id, sizeof(char), sizeof(id)/sizeof(char), file);
-        fclose(file);
-        if (len == 0 || len > sizeof(id)/sizeof(char))
-            continue;
-        if (id[len - 1] == '\n') {
-            len--;
-            id[len] = '\0';
-        }
-        ALOGD("card%d id:%s", card, id);
-        get_specified_out_dev(&device->dev_out[SND_OUT_SOUND_CARD_SPEAKER], card, id, SPEAKER_OUT_NAME);
-        get_specified_out_dev(&device->dev_out[SND_OUT_SOUND_CARD_HDMI], card, id, HDMI_OUT_NAME);
-        get_specified_out_dev(&device->dev_out[SND_OUT_SOUND_CARD_SPDIF], card, id, SPDIF_OUT_NAME);
-        get_specified_out_dev(&device->dev_out[SND_OUT_SOUND_CARD_BT], card, id, BT_OUT_NAME);
-        get_specified_out_dev(&device->dev_out[SND_OUT_SOUND_CARD_SIMCOM], card, id, SIMCOM_OUT_NAME);
-    }
+    card_registry_refresh(device);
+    pthread_mutex_lock(&device->cards.lock);
+    memcpy(device->dev_out, device->cards.dev_out, sizeof(device->dev_out));
+    pthread_mutex_unlock(&device->cards.lock);
     dumpdev_info("out", device->dev_out, SND_OUT_SOUND_CARD_MAX);
     return ;
 }
 
 /*
- * get sound card infor by parser node: /proc/asound/cards
+ * get sound card infor from the card registry
  * the sound card number is not always the same value
  */
 static void read_in_sound_card(struct stream_in *in)
 {
     struct audio_device *device = NULL;
-    int card = 0;
-    char str[32];
-    char id[20];
-    size_t len;
-    FILE* file = NULL;
 
     if((in == NULL) || (in->dev == NULL)){
         return ;
     }
     device = in->dev;
-    set_default_dev_info(device->dev_in, SND_IN_SOUND_CARD_UNKNOWN, 0);
-    for (card = 0; card < SNDRV_CARDS; card++) {
-        sprintf(str, "proc/asound/card%d/id", card);
-        if(access(str, 0)) {
-            ALOGD("No exist %s, break and finish parsing", str);
-                break;
-        }
-        file = fopen(str, "r");
-        if (!file) {
-            ALOGD("Could reading %s property", str);
-            continue;
-        }
-        len = fread(id, sizeof(char), sizeof(id)/sizeof(char), file);
-        fclose(file);
-        if (len == 0 || len > sizeof(id)/sizeof(char))
-            continue;
-        if (id[len - 1] == '\n') {
-            len--;
-           id[len] = '\0';
-        }
-        get_specified_in_dev(&device->dev_in[SND_IN_SOUND_CARD_MIC], card, id, MIC_IN_NAME);
-        /* set HDMI audio input info if need hdmi audio input */
-        get_specified_in_dev(&device->dev_in[SND_IN_SOUND_CARD_HDMI], card, id, HDMI_IN_NAME);
-        get_specified_in_dev(&device->dev_in[SND_IN_SOUND_CARD_BT], card, id, BT_IN_NAME);
-        get_specified_in_dev(&device->dev_in[SND_IN_SOUND_CARD_SIMCOM], card, id, SIMCOM_IN_NAME);
-    }
+    card_registry_refresh(device);
+    pthread_mutex_lock(&device->cards.lock);
+    memcpy(device->dev_in, device->cards.dev_in, sizeof(device->dev_in));
+    pthread_mutex_unlock(&device->cards.lock);
     dumpdev_info("in", device->dev_in, SND_IN_SOUND_CARD_MAX);
     return ;
 }
 
-static inline bool hasExtCodec()
+static inline bool hasExtCodec(struct audio_device *adev)
 {
-    char line[80];
-    bool ret = false;
-    FILE *fd = fopen("proc/asound/cards","r");
-    if(NULL != fd){
-      memset(line, 0, 80);
-      while((fgets(line,80,fd))!= NULL){
-          line[80-1]='\0';
-          if(strstr(line,"realtekrt5651co")){
-              ret = true;
-              break;
-          }
-      }
-      fclose(fd);
-    }
-    return ret;
+    return atomic_load_explicit(&adev->cards.ext_codec, memory_order_relaxed);
 }
 
 static bool is_bitstream(struct stream_out *out)
@@ -1350,7 +2931,7 @@ static int mixer_mode_set(struct stream_out *out)
      * 3) HDR: the stream is bitstream format, TrueHD/Atoms/DTS-HD/DTS-X use this format.
      */
     if (out->device & AUDIO_DEVICE_OUT_AUX_DIGITAL) {
-        pMixer = mixer_open_legacy(adev->dev_out[SND_OUT_SOUND_CARD_HDMI].card);
+        pMixer = mixer_cache_get(&adev->mixers, adev->dev_out[SND_OUT_SOUND_CARD_HDMI].card);
         if (!pMixer) {
             ALOGE("mMixer is a null point %s %d,CARD = %d",__func__, __LINE__,adev->dev_out[SND_OUT_SOUND_CARD_HDMI].card);
             return ret;
@@ -1372,11 +2953,11 @@ static int mixer_mode_set(struct stream_out *out)
 
             if (ret != 0) {
                 ALOGE("set_controls() can not set ctl!");
-                mixer_close_legacy(pMixer);
+                mixer_cache_put(&adev->mixers, pMixer);
                 return -EINVAL;
             }
         }
-        mixer_close_legacy(pMixer);
+        mixer_cache_put(&adev->mixers, pMixer);
     }
 
     return ret;
@@ -1420,14 +3001,375 @@ static void open_sound_card_policy(struct stream_out *out)
         }
     }
 
-    // some specail config for chips
-#ifdef RK3288
-    /*3288's hdmi & codec use the same i2s,so only config the codec card*/
-    audio_devices_t devices = (AUDIO_DEVICE_OUT_AUX_DIGITAL|AUDIO_DEVICE_OUT_SPEAKER);
-    if ((out->device & devices) == devices) {
-        out->device &= ~AUDIO_DEVICE_OUT_AUX_DIGITAL;
-    }
-#endif
+    // some specail config for chips
+#ifdef RK3288
+    /*3288's hdmi & codec use the same i2s,so only config the codec card*/
+    audio_devices_t devices = (AUDIO_DEVICE_OUT_AUX_DIGITAL|AUDIO_DEVICE_OUT_SPEAKER);
+    if ((out->device & devices) == devices) {
+        out->device &= ~AUDIO_DEVICE_OUT_AUX_DIGITAL;
+    }
+#endif
+}
+
+static int64_t elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * @brief out_card_writer_loop
+ * drain one card's ring into its pcm, never holding the ring lock across pcm_write()
+ *
+ * @param context
+ *
+ * @returns
+ */
+static void *out_card_writer_loop(void *context)
+{
+    struct out_card_writer *w = (struct out_card_writer *)context;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->exit) {
+        if (w->fill == 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+
+        size_t bytes = w->fill;
+        if (bytes > w->chunk)
+            bytes = w->chunk;
+        if (bytes > w->ring_size - w->rd)
+            bytes = w->ring_size - w->rd;
+        const uint8_t *data = w->ring + w->rd;
+
+        w->in_write = true;
+        clock_gettime(CLOCK_MONOTONIC, &w->write_start);
+        pthread_mutex_unlock(&w->lock);
+
+        /* the producer never touches [rd, rd + fill), so data stays valid here */
+        int ret = pcm_write(w->pcm, data, bytes);
+
+        pthread_mutex_lock(&w->lock);
+        w->in_write = false;
+        if (ret != 0) {
+            w->xruns++;
+            ALOGW("%s: card %d pcm_write failed (%s), xruns = %llu", __FUNCTION__,
+                  w->card, pcm_get_error(w->pcm), (unsigned long long)w->xruns);
+        }
+        if (w->stalled) {
+            ALOGI("%s: card %d recovered from stall", __FUNCTION__, w->card);
+            w->stalled = false;
+        }
+        /* like the synchronous path, data is consumed even if the write failed */
+        w->rd = (w->rd + bytes) % w->ring_size;
+        w->fill -= bytes;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief out_card_writer_stall_check_l
+ * must be called with writer lock held
+ *
+ * @param w
+ *
+ * @returns true if the card has been blocked in pcm_write() for too long
+ */
+static bool out_card_writer_stall_check_l(struct out_card_writer *w)
+{
+    if (!w->in_write || elapsed_ms(&w->write_start) < OUT_WRITER_STALL_MS)
+        return false;
+
+    if (!w->stalled) {
+        w->stalled = true;
+        w->stalls++;
+        ALOGW("%s: card %d stuck in pcm_write for %lld ms, dropping its data",
+              __FUNCTION__, w->card, (long long)elapsed_ms(&w->write_start));
+    }
+    return true;
+}
+
+/**
+ * @brief out_card_writer_push
+ * copy data into the card ring. The pacing card waits for room, bounded by the
+ * stall timeout; other cards drop what does not fit so they never block the caller.
+ *
+ * @param w
+ * @param buffer
+ * @param bytes
+ * @param pace
+ *
+ * @returns 0 if everything was queued, -EAGAIN if some data was dropped
+ */
+static int out_card_writer_push(struct out_card_writer *w, const void *buffer,
+                                size_t bytes, bool pace)
+{
+    const uint8_t *src = (const uint8_t *)buffer;
+    int ret = 0;
+
+    pthread_mutex_lock(&w->lock);
+    while (bytes > 0) {
+        size_t space = w->ring_size - w->fill;
+        if (space == 0) {
+            if (!pace || out_card_writer_stall_check_l(w))
+                break;
+
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += OUT_WRITER_STALL_MS / 1000;
+            ts.tv_nsec += (OUT_WRITER_STALL_MS % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            if (pthread_cond_timedwait(&w->cond, &w->lock, &ts) == ETIMEDOUT &&
+                    w->fill == w->ring_size) {
+                out_card_writer_stall_check_l(w);
+                break;
+            }
+            continue;
+        }
+
+        size_t wr = (w->rd + w->fill) % w->ring_size;
+        size_t n = bytes;
+        if (n > space)
+            n = space;
+        if (n > w->ring_size - wr)
+            n = w->ring_size - wr;
+        memcpy(w->ring + wr, src, n);
+        w->fill += n;
+        src += n;
+        bytes -= n;
+        pthread_cond_broadcast(&w->cond);
+    }
+    if (bytes > 0) {
+        w->dropped += bytes;
+        ret = -EAGAIN;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return ret;
+}
+
+/**
+ * @brief out_writers_stop
+ * ask all writer threads to exit, data still queued is discarded. With take_pcms
+ * the writers take their pcms from the stream and kick them out of pcm_write(),
+ * so the stream can go to standby without waiting for a stuck card.
+ * must be called with output stream mutex locked, before the pcms are closed,
+ * out_writers_join() has to follow before that mutex is released
+ *
+ * @param out
+ * @param take_pcms
+ */
+static void out_writers_stop(struct stream_out *out, bool take_pcms)
+{
+    int i;
+
+    for (i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
+        struct out_card_writer *w = &out->writers[i];
+        if (!w->active || w->exit)
+            continue;
+
+        pthread_mutex_lock(&w->lock);
+        w->exit = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        if (take_pcms) {
+            pcm_stop(w->pcm);
+            out->pcm[w->card] = NULL;
+            w->owns_pcm = true;
+        }
+    }
+    out->fanout = false;
+}
+
+/**
+ * @brief out_writers_join
+ * join the writers stopped by out_writers_stop() and close the pcms they took.
+ * May wait for a card stuck in pcm_write(), so callers drop adev->lock first.
+ * must be called with output stream mutex locked
+ *
+ * @param out
+ */
+static void out_writers_join(struct stream_out *out)
+{
+    int i;
+
+    for (i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
+        struct out_card_writer *w = &out->writers[i];
+        if (!w->active || !w->exit)
+            continue;
+
+        pthread_join(w->thread, NULL);
+
+        if (w->xruns || w->stalls || w->dropped) {
+            ALOGD("%s: card %d xruns = %llu stalls = %llu dropped = %llu bytes", __FUNCTION__,
+                  w->card, (unsigned long long)w->xruns, (unsigned long long)w->stalls,
+                  (unsigned long long)w->dropped);
+        }
+        if (w->owns_pcm)
+            pcm_close(w->pcm);
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        free(w->ring);
+        memset(w, 0, sizeof(*w));
+    }
+}
+
+/**
+ * @brief out_writers_start
+ * start one writer per open pcm when the stream fans out to more than one card
+ * must be called with output stream mutex locked, after the pcms are opened
+ *
+ * @param out
+ *
+ * @returns 0 on success or when no fan-out is needed
+ */
+static int out_writers_start(struct stream_out *out)
+{
+    size_t period_bytes = out->config.period_size * out->config.channels *
+                          (pcm_format_to_bits(out->config.format) / 8);
+    int i, count = 0;
+
+    for (i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
+        if (out->pcm[i] && i != SND_OUT_SOUND_CARD_SIMCOM)
+            count++;
+    }
+    if (count < 2 || is_bitstream(out) || period_bytes == 0)
+        return 0;
+
+    /* normally a no-op, writers are joined when the outputs are unlocked */
+    out_writers_join(out);
+    for (i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
+        struct out_card_writer *w = &out->writers[i];
+        if (!out->pcm[i] || i == SND_OUT_SOUND_CARD_SIMCOM)
+            continue;
+
+        w->out = out;
+        w->pcm = out->pcm[i];
+        w->card = i;
+        w->chunk = period_bytes;
+        w->ring_size = period_bytes * OUT_WRITER_RING_PERIODS;
+        w->ring = (uint8_t *)malloc(w->ring_size);
+        if (w->ring == NULL)
+            goto error;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, out_card_writer_loop, w) != 0) {
+            pthread_cond_destroy(&w->cond);
+            pthread_mutex_destroy(&w->lock);
+            goto error;
+        }
+        w->active = true;
+    }
+    out->fanout = true;
+    ALOGD("%s: out = %p fans out to %d cards", __FUNCTION__, out, count);
+    return 0;
+
+error:
+    ALOGE("%s: failed to start writer for card %d, using synchronous writes", __FUNCTION__, i);
+    free(out->writers[i].ring);
+    memset(&out->writers[i], 0, sizeof(out->writers[i]));
+    out_writers_stop(out, false);
+    out_writers_join(out);
+    return -ENOMEM;
+}
+
+/*
+ * hdmi/spdif are not written if they are taken by another bitstream/multi channel pcm stream
+ */
+static bool out_writer_card_taken(struct stream_out *out, int card)
+{
+    struct audio_device *adev = out->dev;
+
+    if (hasExtCodec(adev))
+        return false;
+    return ((card == SND_OUT_SOUND_CARD_HDMI) && (adev->owner[SOUND_CARD_HDMI] != (int*)out) &&
+            (adev->owner[SOUND_CARD_HDMI] != NULL)) ||
+           ((card == SND_OUT_SOUND_CARD_SPDIF) && (adev->owner[SOUND_CARD_SPDIF] != (int*)out) &&
+            (adev->owner[SOUND_CARD_SPDIF] != NULL));
+}
+
+/**
+ * @brief out_writers_pending_frames
+ * frames queued in the ring of the pacing card, not yet handed to its pcm
+ *
+ * @param out
+ *
+ * @returns
+ */
+static size_t out_writers_pending_frames(struct stream_out *out)
+{
+    size_t frame_size = out->config.channels * (pcm_format_to_bits(out->config.format) / 8);
+    size_t fill = 0;
+
+    if (!out->fanout || frame_size == 0)
+        return 0;
+
+    for (int i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
+        struct out_card_writer *w = &out->writers[i];
+        if (!w->active || out_writer_card_taken(out, i))
+            continue;
+        fill = atomic_load(&w->fill);
+        break;
+    }
+
+    return fill / frame_size;
+}
+
+/**
+ * @brief out_writers_write
+ * queue one buffer on every active card writer. The first card written paces
+ * the caller, the others run on their own.
+ *
+ * @param out
+ * @param buffer
+ * @param bytes
+ *
+ * @returns result of the pacing card
+ */
+static int out_writers_write(struct stream_out *out, const void *buffer, size_t bytes)
+{
+    bool paced = false;
+    int ret = -ENODEV;
+    int i;
+
+    for (i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
+        struct out_card_writer *w = &out->writers[i];
+        int err;
+
+        if (!w->active || out_writer_card_taken(out, i))
+            continue;
+#ifdef BT_AP_SCO
+        if (i == SND_OUT_SOUND_CARD_BT) {
+            // HARD CODE FIXME 48000 stereo -> 8000 stereo
+            size_t inFrameCount = bytes/2/2;
+            size_t outFrameCount = inFrameCount/(out->config.rate/pcm_config_ap_sco.rate);
+            int16_t out_buffer[outFrameCount*2];
+
+            out->resampler->resample_from_input(out->resampler,
+                                                (const int16_t *)buffer,
+                                                &inFrameCount,
+                                                out_buffer,
+                                                &outFrameCount);
+            err = out_card_writer_push(w, out_buffer, outFrameCount*2*2, !paced);
+        } else
+#endif
+        err = out_card_writer_push(w, buffer, bytes, !paced);
+        if (!paced) {
+            ret = err;
+            paced = true;
+        }
+    }
+
+    return ret;
 }
 
 /**
@@ -1447,7 +3389,7 @@ static int start_output_stream(struct stream_out *out)
     // set defualt value to true for compatible with mid project
     bool disable = true;
 
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
     /*
      * In Box Project, if output stream is 2 channels pcm,
      * the 2 channels pcm can simultaneous output over speaker,hdmi and spdif.
@@ -1478,7 +3420,7 @@ if (!hasExtCodec()){
         }
         ALOGI("SIMCOM: start_output_stream Telephony TX (device=0x%x)", out->device);
         out->config = simcom_pcm_config_tx;
-        ret = simcom_acquire_tx_pcm(adev, true);
+        ret = simcom_acquire_tx_pcm(adev);
         if (ret == 0) {
             out->simcom_attached = true;
             ALOGI("SIMCOM: telephony TX PCM attached (pcm=%p users=%d)",
@@ -1512,7 +3454,7 @@ if (!hasExtCodec()){
     out->disabled = false;
     read_out_sound_card(out);
 
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
     open_sound_card_policy(out);
 }
 
@@ -1524,7 +3466,7 @@ if (!hasExtCodec()){
             card = adev->dev_out[SND_OUT_SOUND_CARD_HDMI].card;
             device =adev->dev_out[SND_OUT_SOUND_CARD_HDMI].device;
             if (card != (int)SND_OUT_SOUND_CARD_UNKNOWN) {
-if (!hasExtCodec()){			
+if (!hasExtCodec(adev)){			
 #ifdef USE_DRM
             ret = mixer_mode_set(out);
 
@@ -1542,7 +3484,7 @@ if (!hasExtCodec()){
                     pcm_close(out->pcm[SND_OUT_SOUND_CARD_HDMI]);
                     return -ENOMEM;
                 }
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
                 if(is_multi_pcm(out) || is_bitstream(out)){
                     adev->owner[SOUND_CARD_HDMI] = (int*)out;
                 }
@@ -1602,7 +3544,7 @@ if (!hasExtCodec()){
                     return -ENOMEM;
                 }
 
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
                 if(is_multi_pcm(out) || is_bitstream(out)){
                     adev->owner[SOUND_CARD_SPDIF] = (int*)out;
                 }
@@ -1632,6 +3574,8 @@ if (!hasExtCodec()){
 		}
 	
 
+    out_writers_start(out);
+
     adev->out_device |= out->device;
     ALOGD("%s:%d, out = %p",__FUNCTION__,__LINE__,out);
     return 0;
@@ -1649,7 +3593,7 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                            struct resampler_buffer* buffer)
 {
     struct stream_in *in;
-    size_t i,size;
+    size_t size;
 
     if (buffer_provider == NULL || buffer == NULL)
         return -EINVAL;
@@ -1669,6 +3613,8 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
         size_t period_bytes = pcm_frames_to_bytes(in->pcm, in->config->period_size);
         if (in->is_simcom_voice) {
             in->read_status = simcom_rx_bus_acquire(in, period_bytes);
+        } else if (in->mic_hub_attached) {
+            in->read_status = mic_hub_read(in, in->buffer, period_bytes);
         } else {
             in->read_status = pcm_read(in->pcm, (void*)in->buffer, period_bytes);
         }
@@ -1682,13 +3628,8 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
         //fwrite(in->buffer,pcm_frames_to_bytes(in->pcm,pcm_get_buffer_size(in->pcm)),1,in_debug);
         in->frames_in = in->config->period_size;
 
-        /* Do stereo to mono conversion in place by discarding right channel */
-        if ((in->channel_mask == AUDIO_CHANNEL_IN_MONO)
-                &&(in->config->channels == 2)) {
-            //ALOGE("channel_mask = AUDIO_CHANNEL_IN_MONO");
-            for (i = 0; i < in->frames_in; i++)
-                in->buffer[i] = in->buffer[i * 2];
-        }
+        /* pcm channels to stream channels, in place */
+        channel_map_apply(&in->channel_map, in->buffer, in->frames_in);
     }
 
     //ALOGV("pcm_frames_to_bytes(in->pcm,pcm_get_buffer_size(in->pcm)):%d",size);
@@ -1722,9 +3663,6 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
     in->frames_in -= buffer->frame_count;
 }
 
-#define STR_32KHZ "32KHZ"
-#define STR_44_1KHZ "44.1KHZ"
-#define STR_48KHZ "48KHZ"
 /**
  * @brief get_hdmiin_audio_rate
  * @param
@@ -1732,21 +3670,8 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
  */
 static int get_hdmiin_audio_rate(struct audio_device *adev)
 {
-    int rate = 44100;
-    char value[PROPERTY_VALUE_MAX] = "";
-    property_get("vendor.hdmiin.audiorate", value, STR_44_1KHZ);
-
-    if ( 0 == strncmp(value, STR_32KHZ, strlen(STR_32KHZ)) ){
-        rate = 32000;
-    } else if ( 0 == strncmp(value, STR_44_1KHZ, strlen(STR_44_1KHZ)) ){
-        rate = 44100;
-    } else if ( 0 == strncmp(value, STR_48KHZ, strlen(STR_48KHZ)) ){
-        rate = 48000;
-    } else {
-        rate = atoi(value);
-        if (rate <= 0)
-            rate = 44100;
-    }
+    /* vendor.hdmiin.audiorate, "32KHZ"/"44.1KHZ"/"48KHZ" or Hz, parsed by audio_props */
+    int rate = audio_props_get(AUDIO_PROP_HDMIIN_RATE);
 
     // if hdmiin connect to codec, use 44100 sample rate
     if (adev->dev_out[SND_IN_SOUND_CARD_HDMI].card
@@ -1782,6 +3707,249 @@ int create_resampler_helper(struct stream_in *in, uint32_t in_rate)
     return ret;
 }
 
+#ifdef SPEEX_DENOISE_ENABLE
+#ifdef TARGET_RK2928
+/* the rk2928 codec records low, denoised output gets +3.5 dB */
+#define SPEEX_OUT_GAIN  (CHANNEL_MAP_UNITY * 3 / 2)
+#else
+#define SPEEX_OUT_GAIN  CHANNEL_MAP_UNITY
+#endif
+
+static bool speex_async_enabled(void)
+{
+    return property_get_bool("persist.vendor.audio.speex.async", false);
+}
+
+static size_t sample_fifo_fill(struct sample_fifo *f)
+{
+    return atomic_load_explicit(&f->head, memory_order_acquire) -
+           atomic_load_explicit(&f->tail, memory_order_acquire);
+}
+
+static int sample_fifo_init(struct sample_fifo *f, size_t min_samples)
+{
+    size_t size = 1024;
+
+    while (size < min_samples)
+        size <<= 1;
+    f->buf = (int16_t *)malloc(size * sizeof(int16_t));
+    f->size = f->buf ? size : 0;
+    atomic_init(&f->head, 0);
+    atomic_init(&f->tail, 0);
+    return f->buf ? 0 : -ENOMEM;
+}
+
+/* producer side, returns the samples that fit */
+static size_t sample_fifo_push(struct sample_fifo *f, const int16_t *src, size_t count)
+{
+    size_t head = atomic_load_explicit(&f->head, memory_order_relaxed);
+    size_t space = f->size - (head - atomic_load_explicit(&f->tail, memory_order_acquire));
+    size_t pos = head & (f->size - 1);
+    size_t first;
+
+    if (count > space)
+        count = space;
+    first = f->size - pos < count ? f->size - pos : count;
+    memcpy(f->buf + pos, src, first * sizeof(int16_t));
+    memcpy(f->buf, src + first, (count - first) * sizeof(int16_t));
+    atomic_store_explicit(&f->head, head + count, memory_order_release);
+    return count;
+}
+
+/* consumer side, dst NULL drops; returns the samples taken */
+static size_t sample_fifo_pop(struct sample_fifo *f, int16_t *dst, size_t count)
+{
+    size_t tail = atomic_load_explicit(&f->tail, memory_order_relaxed);
+    size_t fill = atomic_load_explicit(&f->head, memory_order_acquire) - tail;
+    size_t pos = tail & (f->size - 1);
+    size_t first;
+
+    if (count > fill)
+        count = fill;
+    if (dst) {
+        first = f->size - pos < count ? f->size - pos : count;
+        memcpy(dst, f->buf + pos, first * sizeof(int16_t));
+        memcpy(dst + first, f->buf, (count - first) * sizeof(int16_t));
+    }
+    atomic_store_explicit(&f->tail, tail + count, memory_order_release);
+    return count;
+}
+
+/**
+ * @brief speex_worker_loop
+ * denoise every whole speex frame in the raw fifo; a partial frame waits
+ * there for the next request
+ */
+static void *speex_worker_loop(void *context)
+{
+    struct stream_in *in = (struct stream_in *)context;
+    struct speex_worker *w = &in->speex_worker;
+    const size_t frame = in->mSpeexFrameSize;
+
+    while (!atomic_load(&w->exit)) {
+        sem_wait(&w->wake);
+        while (!atomic_load(&w->exit) && sample_fifo_fill(&w->raw) >= frame) {
+            sample_fifo_pop(&w->raw, in->mSpeexPcmIn, frame);
+            speex_preprocess_run(in->mSpeexState, in->mSpeexPcmIn);
+            /* clean never holds more than the pipeline delay, half its size */
+            sample_fifo_push(&w->clean, in->mSpeexPcmIn, frame);
+        }
+    }
+
+    return NULL;
+}
+
+/* at open, after the speex state; failure leaves the stream on the synchronous path */
+static void speex_worker_init(struct stream_in *in)
+{
+    struct speex_worker *w = &in->speex_worker;
+    size_t depth = (size_t)in->mSpeexFrameSize * SPEEX_WORKER_FIFO_REQUESTS;
+
+    memset(w, 0, sizeof(*w));
+    in->speex_async = false;
+    if (!speex_async_enabled())
+        return;
+    if (sample_fifo_init(&w->raw, depth) != 0 || sample_fifo_init(&w->clean, depth) != 0 ||
+            (w->mono = (int16_t *)malloc(w->raw.size / 2 * sizeof(int16_t))) == NULL ||
+            sem_init(&w->wake, 0, 0) != 0) {
+        ALOGE("%s: no memory for the speex worker, denoising inline", __FUNCTION__);
+        free(w->raw.buf);
+        free(w->clean.buf);
+        free(w->mono);
+        w->raw.buf = w->clean.buf = w->mono = NULL;
+        return;
+    }
+    in->speex_async = true;
+}
+
+static void speex_worker_release(struct stream_in *in)
+{
+    struct speex_worker *w = &in->speex_worker;
+
+    if (!in->speex_async)
+        return;
+    sem_destroy(&w->wake);
+    free(w->raw.buf);
+    free(w->clean.buf);
+    free(w->mono);
+    in->speex_async = false;
+}
+
+/* leaving standby: fifos are empty, the speex state carries on */
+static void speex_worker_start(struct stream_in *in)
+{
+    struct speex_worker *w = &in->speex_worker;
+
+    if (!in->speex_async || w->running)
+        return;
+    atomic_store(&w->raw.head, 0);
+    atomic_store(&w->raw.tail, 0);
+    atomic_store(&w->clean.head, 0);
+    atomic_store(&w->clean.tail, 0);
+    w->primed = false;
+    atomic_store(&w->exit, false);
+    w->running = pthread_create(&w->thread, NULL, speex_worker_loop, in) == 0;
+    if (!w->running)
+        ALOGE("%s: no speex worker thread, denoising inline", __FUNCTION__);
+}
+
+static void speex_worker_stop(struct stream_in *in)
+{
+    struct speex_worker *w = &in->speex_worker;
+
+    if (!w->running)
+        return;
+    atomic_store(&w->exit, true);
+    sem_post(&w->wake);
+    pthread_join(w->thread, NULL);
+    w->running = false;
+    if (w->underruns || w->overruns)
+        ALOGD("%s: %llu underruns, %llu overruns", __FUNCTION__,
+              (unsigned long long)w->underruns, (unsigned long long)w->overruns);
+}
+
+/* the original inline path: whole speex frames only, a tail is left as captured */
+static void speex_denoise_inline(struct stream_in *in, int16_t *data, size_t frames,
+                                 uint32_t channels)
+{
+    const size_t frame = in->mSpeexFrameSize;
+
+    if (frames != frame)
+        ALOGD("the current request have some error mSpeexFrameSize %d frames %zu ",
+              in->mSpeexFrameSize, frames);
+    for (size_t pos = 0; pos + frame <= frames; pos += frame) {
+        simcom_downmix_to_mono(in->mSpeexPcmIn, data + pos * channels, frame, channels);
+        speex_preprocess_run(in->mSpeexState, in->mSpeexPcmIn);
+        mono_fan_out(data + pos * channels, in->mSpeexPcmIn, frame, channels, SPEEX_OUT_GAIN);
+    }
+}
+
+/* one pass of at most half the raw fifo, delay is the same for every chunk of a request */
+static void speex_pipeline_chunk(struct stream_in *in, int16_t *data, size_t frames,
+                                 uint32_t channels, size_t delay)
+{
+    struct speex_worker *w = &in->speex_worker;
+    size_t pos = 0;
+
+    simcom_downmix_to_mono(w->mono, data, frames, channels);
+    if (sample_fifo_push(&w->raw, w->mono, frames) < frames)
+        w->overruns++;
+    sem_post(&w->wake);
+
+    if (!w->primed) {
+        /* the first chunk only fills the pipeline */
+        memset(w->mono, 0, frames * sizeof(int16_t));
+        pos = frames;
+        w->primed = true;
+    }
+    if (pos < frames) {
+        pos += sample_fifo_pop(&w->clean, w->mono + pos, frames - pos);
+        if (pos < frames) {
+            memset(w->mono + pos, 0, (frames - pos) * sizeof(int16_t));
+            w->underruns++;
+        }
+    }
+
+    /* give back delay added by earlier underruns once the worker caught up */
+    size_t queued = sample_fifo_fill(&w->raw) + sample_fifo_fill(&w->clean);
+    if (queued > delay)
+        sample_fifo_pop(&w->clean, NULL, queued - delay);
+
+    mono_fan_out(data, w->mono, frames, channels, SPEEX_OUT_GAIN);
+}
+
+/**
+ * @brief speex_denoise_pipelined
+ * hand this request to the worker and replace it with audio the worker has
+ * already denoised. The output runs one chunk plus one speex frame behind,
+ * which covers a partial frame waiting in the raw fifo. A request larger
+ * than the fifos allow goes through in chunks, so a running worker is never
+ * bypassed. If the worker falls behind the gap is filled with silence and
+ * the extra delay dropped later.
+ *
+ * @returns false if the worker is not running
+ */
+static bool speex_denoise_pipelined(struct stream_in *in, int16_t *data, size_t frames,
+                                    uint32_t channels)
+{
+    struct speex_worker *w = &in->speex_worker;
+    /* the raw fifo holds at least eight speex frames */
+    const size_t max_chunk = w->raw.size / 2 - in->mSpeexFrameSize;
+    size_t chunk = frames < max_chunk ? frames : max_chunk;
+    const size_t delay = chunk + in->mSpeexFrameSize;
+
+    if (!w->running)
+        return false;
+
+    for (size_t pos = 0; pos < frames; pos += chunk) {
+        if (chunk > frames - pos)
+            chunk = frames - pos;
+        speex_pipeline_chunk(in, data + pos * channels, chunk, channels, delay);
+    }
+    return true;
+}
+#endif
+
 /**
  * @brief start_input_stream
  * must be called with input stream and hw device mutexes locked
@@ -1812,10 +3980,11 @@ static int start_input_stream(struct stream_in *in)
         }
         ALOGI("SIMCOM: start_input_stream Telephony RX (device=0x%x)", in->device);
         in->config = &simcom_pcm_config_rx;
-        ret = simcom_acquire_rx_pcm(adev, true);
+        ret = simcom_acquire_rx_pcm(adev);
         if (ret == 0) {
             in->pcm = IN_SIMCOM_PCM(in);
             in->simcom_attached = true;
+            simcom_rx_bus_attach(in);
             ALOGI("SIMCOM: telephony RX PCM attached (pcm=%p users=%d)",
                   IN_SIMCOM_PCM(in), adev->simcom_rx_users);
         } else if (ret == -EAGAIN) {
@@ -1911,7 +4080,9 @@ static int start_input_stream(struct stream_in *in)
                in->device & AUDIO_DEVICE_IN_WIRED_HEADSET) {
         card = adev->dev_in[SND_IN_SOUND_CARD_MIC].card;
         device =  adev->dev_in[SND_IN_SOUND_CARD_MIC].device;
-        in->pcm = pcm_open(card, device, PCM_IN, in->config);
+        ret = mic_hub_acquire(in, card, device);
+        if (ret != 0)
+            return ret;
     } else {
         card = adev->dev_in[SND_IN_SOUND_CARD_BT].card;
         device = adev->dev_in[SND_IN_SOUND_CARD_BT].device;
@@ -1925,6 +4096,12 @@ static int start_input_stream(struct stream_in *in)
     }
 
 simcom_post_open:
+#ifdef SPEEX_DENOISE_ENABLE
+    speex_worker_start(in);
+#endif
+    if (channel_map_init_default(&in->channel_map, in->config->channels, in->channel_mask) == 0)
+        ALOGD("%s: capture channels %s", __FUNCTION__, in->channel_map.name);
+
     /* if no supported sample rate is available, use the resampler */
     if (in->resampler)
         in->resampler->reset(in->resampler);
@@ -2034,10 +4211,7 @@ frame_count :
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    char value[PROPERTY_VALUE_MAX];
-    property_get("vendor.vts_test", value, NULL);
-
-    if (strcmp(value, "true") == 0) {
+    if (audio_props_get(AUDIO_PROP_VTS_TEST)) {
         return out->aud_config.sample_rate;
     } else {
         return out->config.rate;
@@ -2083,10 +4257,7 @@ static size_t out_get_buffer_size(const struct audio_stream *stream)
 static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    char value[PROPERTY_VALUE_MAX];
-    property_get("vendor.vts_test", value, NULL);
-
-    if (strcmp(value, "true") == 0){
+    if (audio_props_get(AUDIO_PROP_VTS_TEST)){
         return out->aud_config.channel_mask;
     } else {
         return out->channel_mask;
@@ -2104,10 +4275,7 @@ static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
 static audio_format_t out_get_format(const struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    char value[PROPERTY_VALUE_MAX];
-    property_get("vendor.vts_test", value, NULL);
-
-    if (strcmp(value, "true") == 0){
+    if (audio_props_get(AUDIO_PROP_VTS_TEST)){
         return out->aud_config.format;
     } else {
         return AUDIO_FORMAT_PCM_16_BIT;
@@ -2174,7 +4342,9 @@ static void do_out_standby(struct stream_out *out)
             simcom_release_tx_pcm(adev);
             out->simcom_attached = false;
         }
-        simcom_release_tx_resampler(out);
+        simcom_uplink_release(&out->simcom_uplink);
+        /* joined by unlock_all_outputs(), after adev->lock is dropped */
+        out_writers_stop(out, true);
         for (i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
             if (out->pcm[i]) {
                 pcm_close(out->pcm[i]);
@@ -2190,7 +4360,7 @@ static void do_out_standby(struct stream_out *out)
              * necessary when restarted */
             force_non_hdmi_out_standby(adev);
         }
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
 #ifdef USE_DRM
         mixer_mode_set(out);
 #endif
@@ -2203,15 +4373,18 @@ if (!hasExtCodec()){
             adev->voice_api->flush();
         }
 #endif
-        route_pcm_close(PLAYBACK_OFF_ROUTE);
-        ALOGD("close device");
-
-        /* Skip resetting the mixer if no output device is active */
+        /*
+         * route_pcm_open() applies the off routes itself, merged with the new
+         * route, so only a full close needs PLAYBACK_OFF_ROUTE here
+         */
         if (adev->out_device) {
             route_pcm_open(getRouteFromDevice(adev->out_device));
             ALOGD("change device");
+        } else {
+            route_pcm_close(PLAYBACK_OFF_ROUTE);
+            ALOGD("close device");
         }
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
         if(adev->owner[SOUND_CARD_HDMI] == (int*)out){
             adev->owner[SOUND_CARD_HDMI] = NULL;
         }
@@ -2243,7 +4416,9 @@ static void lock_all_outputs(struct audio_device *adev)
 
 /**
  * @brief unlock_all_outputs
- * unlock device, all output streams (except specified stream), and outputs list
+ * unlock device, all output streams (except specified stream), and outputs list.
+ * Writers stopped by a standby are joined once the device is unlocked, the
+ * except stream is still locked by the caller.
  *
  * @param adev
  * @param except
@@ -2255,6 +4430,8 @@ static void unlock_all_outputs(struct audio_device *adev, struct stream_out *exc
     enum output_type type = OUTPUT_TOTAL;
     do {
         struct stream_out *out = adev->outputs[--type];
+        if (out)
+            out_writers_join(out);
         if (out && out != except)
             pthread_mutex_unlock(&out->lock);
     } while (type != (enum output_type) 0);
@@ -2299,6 +4476,21 @@ int out_dump(const struct audio_stream *stream, int fd)
     ALOGD("out->Channels   : %d", out->config.channels);
     ALOGD("out->Formate    : %d", out->config.format);
     ALOGD("out->PreiodSize : %d", out->config.period_size);
+    /* writers are stopped and joined under the stream lock, skip them if it is busy */
+    if (pthread_mutex_trylock(&out->lock) != 0)
+        return 0;
+    for (int i = 0; i < SND_OUT_SOUND_CARD_MAX; i++) {
+        struct out_card_writer *w = &out->writers[i];
+        if (w->active) {
+            pthread_mutex_lock(&w->lock);
+            ALOGD("out->Writer[%d]  : fill %zu/%zu xruns %llu stalls %llu dropped %llu%s", i,
+                  (size_t)w->fill, w->ring_size, (unsigned long long)w->xruns,
+                  (unsigned long long)w->stalls, (unsigned long long)w->dropped,
+                  w->stalled ? " (stalled)" : "");
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
     return 0;
 }
 /**
@@ -2528,9 +4720,11 @@ static char * out_get_parameters(const struct audio_stream *stream, const char *
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
+    size_t frames = out->config.period_size * out->config.period_count;
 
-    return (out->config.period_size * out->config.period_count * 1000) /
-           out->config.rate;
+    /* no stream lock, out_write() holds it while the pacing card blocks */
+    frames += out_writers_pending_frames(out);
+    return (frames * 1000) / out->config.rate;
 }
 
 /**
@@ -2568,9 +4762,7 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
  */
 static void dump_out_data(const void* buffer,size_t bytes)
 {
-    char value[PROPERTY_VALUE_MAX];
-    property_get("vendor.audio.record", value, "0");
-    int size = atoi(value);
+    int size = audio_props_get(AUDIO_PROP_RECORD);
     if (size <= 0)
         return ;
 
@@ -2593,7 +4785,7 @@ static void dump_out_data(const void* buffer,size_t bytes)
             fclose(fd);
             fd = NULL;
             offset = 0;
-            property_set("vendor.audio.record", "0");
+            audio_props_set(AUDIO_PROP_RECORD, "0");
             ALOGD("TEST playback pcmfile end");
         }
     }
@@ -2603,9 +4795,7 @@ static void dump_in_data(const void* buffer, size_t bytes)
 {
     static int offset = 0;
     static FILE* fd = NULL;
-    char value[PROPERTY_VALUE_MAX];
-    property_get("vendor.audio.record.in", value, "0");
-    int size = atoi(value);
+    int size = audio_props_get(AUDIO_PROP_RECORD_IN);
     if (size > 0) {
         if(fd == NULL) {
             fd=fopen("/data/misc/audioserver/debug_in.pcm","wb+");
@@ -2627,7 +4817,7 @@ static void dump_in_data(const void* buffer, size_t bytes)
             fclose(fd);
             fd = NULL;
             offset = 0;
-            property_set("vendor.audio.record.in", "0");
+            audio_props_set(AUDIO_PROP_RECORD_IN, "0");
             ALOGD("TEST record pcmfile end");
         }
     }
@@ -2677,6 +4867,7 @@ static void reset_bitstream_buf(struct stream_out *out)
             if (out->bitstream_buffer) {
                 free (out->bitstream_buffer);
                 out->bitstream_buffer = NULL;
+                out->bitstream_buffer_size = 0;
             }
         }
     }
@@ -2688,6 +4879,15 @@ static void check_hdmi_reconnect(struct stream_out *out)
         return ;
     }
 
+    /*
+     * fast path: snd_reopen is only raised by adev_set_parameters() on hdmi connect,
+     * so the steady-state write must not touch the device or other stream locks.
+     * The event is consumed here once, a connect arriving meanwhile raises it again.
+     */
+    if (!atomic_exchange_explicit(&out->snd_reopen, false, memory_order_acq_rel)) {
+        return ;
+    }
+
     struct audio_device *adev = out->dev;
     lock_all_outputs(adev);
     /*
@@ -2698,7 +4898,7 @@ static void check_hdmi_reconnect(struct stream_out *out)
      *   implement of driver of hdmi. If we contiune send bitstream to hdmi open in pcm mode,
      *   hdmi may make noies or mute.
      */
-    if (out->snd_reopen && !out->standby)
+    if (!out->standby)
     {
         /*
          * standby sound cards
@@ -2714,43 +4914,12 @@ static void check_hdmi_reconnect(struct stream_out *out)
     /*
      * audio hal recived the msg of hdmi plugin, and other part of sdk will reviced it too.
      * Other part(maybe hwc) will config hdmi after it reviced the msg.
-     * Audio must wait other part(maybe hwc) codes config hdmi finish, before send bitstream datas to hdmi
+     * Audio must wait other part(maybe hwc) codes config hdmi finish, before send bitstream
+     * datas to hdmi. The monitor thread waits for that, out_write() drops data meanwhile.
      */
-    if (out->snd_reopen && is_bitstream(out) && (out->device == AUDIO_DEVICE_OUT_AUX_DIGITAL)) {
-#ifdef USE_DRM
-        const char* PATH = "/sys/class/drm/card0-HDMI-A-1/enabled";
-#else
-        const char* PATH = "/sys/class/display/HDMI/enabled";
-#endif
-        if (access(PATH, R_OK) != 0) {
-            /*
-             * in most test, the time is 700~800ms between received msg of hdmi plug in
-             * and hdmi init finish, so we sleep 1 sec here if no way to get the status of hdmi.
-             */
-            usleep(1000000);
-        } else {
-            /*
-             * read this node to judge the status of hdmi is config finish?
-             */
-            char buffer[1024];
-            int counter  = 200;
-            FILE* file = NULL;
-            while (counter >= 0 && ((file = fopen(PATH,"r")) != NULL)) {
-                int size = fread(buffer,1,sizeof(buffer),file);
-                if(size >= 0) {
-                    if(strstr(buffer,"enabled")) {
-                        fclose(file);
-                        usleep(10000);
-                        break;
-                    }
-                }
-                usleep(10000);
-                counter --;
-                fclose(file);
-            }
-        }
+    if (is_bitstream(out) && (out->device == AUDIO_DEVICE_OUT_AUX_DIGITAL)) {
+        hdmi_monitor_kick(adev);
         ALOGD("%s: out = %p",__FUNCTION__,out);
-        out->snd_reopen = false;
     }
 }
 
@@ -2763,9 +4932,7 @@ static void out_mute_data(struct stream_out *out,void* buffer,size_t bytes)
     mute = adev->screenOff;
 #endif
     // for some special customer
-    char value[PROPERTY_VALUE_MAX];
-    property_get("vendor.audio.mute", value, "false");
-    if (!strcasecmp(value,"true")) {
+    if (audio_props_get(AUDIO_PROP_MUTE)) {
         mute = true;
     }
 
@@ -2777,12 +4944,16 @@ static void out_mute_data(struct stream_out *out,void* buffer,size_t bytes)
 static int fill_hdmi_bistream(struct stream_out *out,void* buffer,size_t insize)
 {
     int size = 2*insize;
-    if (out->bitstream_buffer == NULL) {
+    if ((out->bitstream_buffer == NULL) || (out->bitstream_buffer_size < (size_t)size)) {
+        free(out->bitstream_buffer);
         out->bitstream_buffer = (char *)malloc(size);
+        out->bitstream_buffer_size = out->bitstream_buffer ? size : 0;
         ALOGD("new bitstream buffer!");
+        if (out->bitstream_buffer == NULL)
+            return -ENOMEM;
     }
-    memset(out->bitstream_buffer, 0x00, size);
-    fill_hdmi_bitstream_buf((void *)buffer, (void *)out->bitstream_buffer,(void*)out->channel_buffer, (int)insize);
+    fill_hdmi_bitstream_buf((void *)buffer, (void *)out->bitstream_buffer,(void*)out->channel_buffer,
+                            &out->channel_pos, (int)insize);
     return size;
 }
 
@@ -2804,6 +4975,8 @@ static int bitstream_write_data(struct stream_out *out,void* buffer,size_t bytes
                 ret = pcm_write(out->pcm[SND_OUT_SOUND_CARD_HDMI], (void *)buffer, bytes);
             }else if(out->config.format == PCM_FORMAT_S24_LE){
                 int size = fill_hdmi_bistream(out,buffer,bytes);
+                if (size < 0)
+                    return size;
                 out_mute_data(out,(void*)out->bitstream_buffer,size);
                 dump_out_data((void*)out->bitstream_buffer, size);
                 ret = pcm_write(out->pcm[SND_OUT_SOUND_CARD_HDMI], (void *)out->bitstream_buffer, size);
@@ -2842,7 +5015,7 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
      * mutex
      */
 
-	if (!hasExtCodec()){
+	if (!hasExtCodec(adev)){
 	    check_hdmi_reconnect(out);
 	}
 
@@ -2894,7 +5067,14 @@ false_alarm:
 
     /* Write to all active PCMs */
     if ((out->device & AUDIO_DEVICE_OUT_AUX_DIGITAL) && is_bitstream(out)) {
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
+        if (!hdmi_monitor_configured(adev)) {
+            /* a bitstream can't be attenuated, drop it at the stream pace */
+            usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
+                   out_get_sample_rate(&stream->common));
+            ret = 0;
+            goto exit;
+        }
         ret = bitstream_write_data(out,(void*)buffer,bytes);
         if(ret < 0) {
             goto exit;
@@ -2902,9 +5082,16 @@ if (!hasExtCodec()){
 }
     } else {
         if (out->is_simcom_voice) {
+            if (simcom_call_owns_uplink(adev)) {
+                /* the call engine feeds the modem from the mic, keep the stream paced */
+                usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
+                       out_get_sample_rate(&stream->common));
+                ret = 0;
+                goto exit;
+            }
             if (!out->simcom_attached || !OUT_SIMCOM_PCM(out)) {
                 pthread_mutex_lock(&adev->lock);
-                int attach_ret = simcom_acquire_tx_pcm(adev, true);
+                int attach_ret = simcom_acquire_tx_pcm(adev);
                 if (attach_ret == 0) {
                     out->simcom_attached = true;
                     ALOGI("SIMCOM: out_write re-attached TX PCM (pcm=%p users=%d)",
@@ -2921,61 +5108,36 @@ if (!hasExtCodec()){
                 pthread_mutex_unlock(&adev->lock);
                 if (attach_ret != 0 || !OUT_SIMCOM_PCM(out)) {
                     ALOGW("SIMCOM: TX PCM not ready (ret=%d), dropping %zu bytes", attach_ret, bytes);
+                    usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
+                           out_get_sample_rate(&stream->common));
                     ret = 0;
                     goto exit;
                 }
             }
 
-            const void *write_buffer = buffer;
-            size_t write_bytes = bytes;
-            if (out->simcom_resampler && buffer && bytes > 0) {
-                size_t channels = out->config.channels;
-                if (channels == 0) {
-                    channels = 1;
-                }
-                size_t in_frames = bytes / (channels * sizeof(int16_t));
-                uint32_t in_rate = out->simcom_resampler_in_rate != 0 ?
-                        out->simcom_resampler_in_rate : out->requested_rate;
-                if (in_rate == 0) {
-                    in_rate = out->config.rate;
-                }
-                size_t out_frames = (size_t)(((uint64_t)in_frames * out->config.rate) /
-                        in_rate);
-                if (out_frames == 0) {
-                    out_frames = 1;
-                }
-                if (simcom_ensure_tx_resampler_buffer(out, out_frames, channels) != 0) {
-                    ALOGE("SIMCOM: unable to allocate resampler buffer, dropping %zu bytes", bytes);
-                    ret = 0;
-                    goto exit;
-                }
-                size_t tmp_in = in_frames;
-                size_t tmp_out = out_frames;
-                out->simcom_resampler->resample_from_input(out->simcom_resampler,
-                                                           (const int16_t *)buffer,
-                                                           &tmp_in,
-                                                           out->simcom_resampler_buffer,
-                                                           &tmp_out);
-                write_buffer = out->simcom_resampler_buffer;
-                write_bytes = tmp_out * channels * sizeof(int16_t);
-                ALOGD("SIMCOM: TX resampler %u->%u inFrames=%zu outFrames=%zu",
-                      in_rate, out->config.rate, tmp_in, tmp_out);
-            }
-            if (write_buffer && write_bytes > 0) {
-                simcom_log_pcm_snapshot("TX->modem", write_buffer, write_bytes);
+            size_t channels = out->config.channels;
+            if (channels == 0) {
+                channels = 1;
             }
-            ALOGV("SIMCOM: out_write telephony pcm=%p bytes=%zu", OUT_SIMCOM_PCM(out), write_bytes);
-            ret = pcm_write(OUT_SIMCOM_PCM(out), (void *)write_buffer, write_bytes);
-            if (ret) {
-                ALOGE("SIMCOM: out_write pcm_write failed ret=%d err=%s",
-                      ret, pcm_get_error(OUT_SIMCOM_PCM(out)));
+            ALOGV("SIMCOM: out_write telephony pcm=%p bytes=%zu", OUT_SIMCOM_PCM(out), bytes);
+            if (out->simcom_uplink.in_channels == 0) {
+                simcom_log_pcm_snapshot("TX->modem", buffer, bytes);
+                ret = simcom_tx_write(adev, buffer, bytes, NULL);
+                if (ret) {
+                    ALOGE("SIMCOM: out_write TX write failed ret=%d", ret);
+                }
+            } else {
+                ret = simcom_uplink_write(&out->simcom_uplink, adev,
+                                          (const int16_t *)buffer,
+                                          bytes / (channels * sizeof(int16_t)), "TX->modem");
             }
             goto exit;
         }
 
         // SIMCOM: If voice call is active and primary output is used in patch,
         // convert microphone data (48000 Hz, 2 channels) to SIMCOM format (8000 Hz, mono)
-        if (simcom_voice_mode_active(adev) && !out->is_simcom_voice && out->requested_rate > 0) {
+        if (simcom_voice_mode_active(adev) && !out->is_simcom_voice &&
+                !simcom_call_owns_uplink(adev) && out->requested_rate > 0) {
             // Log input buffer before conversion to diagnose zero data issue
             if (buffer && bytes > 0) {
                 simcom_log_pcm_snapshot("TX->primary (before conversion)", buffer, bytes);
@@ -2984,7 +5146,7 @@ if (!hasExtCodec()){
             // Ensure SIMCOM TX PCM is open
             if (adev->simcom_tx_pcm == NULL) {
                 pthread_mutex_lock(&adev->lock);
-                int attach_ret = simcom_acquire_tx_pcm(adev, true);
+                int attach_ret = simcom_acquire_tx_pcm(adev);
                 pthread_mutex_unlock(&adev->lock);
                 if (attach_ret != 0) {
                     ALOGW("SIMCOM: TX PCM not ready for conversion (ret=%d), skipping", attach_ret);
@@ -2994,7 +5156,7 @@ if (!hasExtCodec()){
             if (adev->simcom_tx_pcm != NULL) {
             // Check if this is microphone data that needs conversion
             uint32_t in_rate = out->requested_rate;
-            uint32_t out_rate = 8000;
+            uint32_t out_rate = adev->simcom_rate;
             size_t in_channels = audio_channel_count_from_out_mask(out->channel_mask);
             size_t out_channels = 1; // mono for SIMCOM
             
@@ -3002,77 +5164,13 @@ if (!hasExtCodec()){
                   in_rate, out_rate, in_channels, out_channels, bytes);
             
             if (in_rate != out_rate || in_channels != out_channels) {
-                // Need to convert: prepare resampler if not already done
-                if (!out->simcom_resampler) {
-                    ALOGI("SIMCOM: Preparing TX resampler for primary output in patch mode: %u Hz %zu ch -> %u Hz %zu ch",
-                          in_rate, in_channels, out_rate, out_channels);
-                    int ret = create_resampler(in_rate, out_rate, in_channels,
-                                               RESAMPLER_QUALITY_DEFAULT,
-                                               NULL, &out->simcom_resampler);
-                    if (ret == 0) {
-                        out->simcom_resampler_in_rate = in_rate;
-                        ALOGI("SIMCOM: TX resampler created for primary output");
-                    } else {
-                        ALOGE("SIMCOM: Failed to create TX resampler for primary output: %d", ret);
-                    }
-                }
-                
-                // Convert data if resampler is available
-                if (out->simcom_resampler && buffer && bytes > 0) {
-                    size_t in_frames = bytes / (in_channels * sizeof(int16_t));
-                    size_t out_frames = (size_t)(((uint64_t)in_frames * out_rate) / in_rate);
-                    if (out_frames == 0) {
-                        out_frames = 1;
-                    }
-                    
-                    // Allocate buffer for resampled stereo data
-                    if (simcom_ensure_tx_resampler_buffer(out, out_frames, in_channels) == 0) {
-                        size_t tmp_in = in_frames;
-                        size_t tmp_out = out_frames;
-                        out->simcom_resampler->resample_from_input(out->simcom_resampler,
-                                                                   (const int16_t *)buffer,
-                                                                   &tmp_in,
-                                                                   out->simcom_resampler_buffer,
-                                                                   &tmp_out);
-                        
-                        // Convert stereo to mono if needed
-                        int16_t *mono_buffer = NULL;
-                        size_t mono_bytes = 0;
-                        if (in_channels == 2 && out_channels == 1 && tmp_out > 0) {
-                            // Allocate temporary buffer for mono conversion
-                            mono_bytes = tmp_out * out_channels * sizeof(int16_t);
-                            mono_buffer = (int16_t *)malloc(mono_bytes);
-                            if (mono_buffer != NULL) {
-                                int16_t *stereo_data = (int16_t *)out->simcom_resampler_buffer;
-                                for (size_t i = 0; i < tmp_out; i++) {
-                                    // Average left and right channels
-                                    int32_t sum = (int32_t)stereo_data[i * 2] + (int32_t)stereo_data[i * 2 + 1];
-                                    mono_buffer[i] = (int16_t)(sum / 2);
-                                }
-                            } else {
-                                ALOGE("SIMCOM: Failed to allocate mono conversion buffer");
-                                ret = 0; // Drop this data
-                                goto exit;
-                            }
-                        }
-                        
-                        // Write converted data to SIMCOM TX PCM
-                        const void *write_buffer = (mono_buffer != NULL) ? mono_buffer : out->simcom_resampler_buffer;
-                        size_t write_bytes = (mono_buffer != NULL) ? mono_bytes : (tmp_out * in_channels * sizeof(int16_t));
-                        simcom_log_pcm_snapshot("TX->modem (converted)", write_buffer, write_bytes);
-                        ret = pcm_write(adev->simcom_tx_pcm, write_buffer, write_bytes);
-                        if (ret) {
-                            ALOGE("SIMCOM: out_write pcm_write failed for converted data ret=%d err=%s",
-                                  ret, pcm_get_error(adev->simcom_tx_pcm));
-                        } else {
-                            ALOGD("SIMCOM: TX converted %u Hz %zu ch -> %u Hz %zu ch: %zu bytes",
-                                  in_rate, in_channels, out_rate, out_channels, write_bytes);
-                        }
-                        if (mono_buffer != NULL) {
-                            free(mono_buffer);
-                        }
-                        goto exit;
-                    }
+                size_t in_frames = bytes / (in_channels * sizeof(int16_t));
+                if (simcom_uplink_prepare(&out->simcom_uplink, in_rate, in_channels,
+                                          out_rate, in_frames) == 0) {
+                    ret = simcom_uplink_write(&out->simcom_uplink, adev,
+                                              (const int16_t *)buffer, in_frames,
+                                              "TX->modem (converted)");
+                    goto exit;
                 }
             }
             } // Close if (adev->simcom_tx_pcm != NULL)
@@ -3080,6 +5178,10 @@ if (!hasExtCodec()){
 
         out_mute_data(out,(void*)buffer,bytes);
         dump_out_data(buffer, bytes);
+        if (out->fanout) {
+            ret = out_writers_write(out, buffer, bytes);
+            goto exit;
+        }
         ret = -1;
         for (i = 0; i < SND_OUT_SOUND_CARD_MAX; i++)
             if (out->pcm[i]) {
@@ -3104,7 +5206,7 @@ if (!hasExtCodec()){
 #else
                 {
 #endif
-if (!hasExtCodec()){
+if (!hasExtCodec(adev)){
                     /*
                      * do not write hdmi/spdif snd sound if they are taken by other bitstream/multi channle pcm stream
                      */
@@ -3225,6 +5327,8 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
                 //ALOGD("===============%s,%d==============",__FUNCTION__,__LINE__);
                 // FIXME This calculation is incorrect if there is buffering after app processor
                 int64_t signed_frames = out->written - kernel_buffer_size + avail;
+                // data still queued in the fan-out ring has not reached the pcm yet
+                signed_frames -= out_writers_pending_frames(out);
                 //signed_frames -= 17;
                 //ALOGV("============singed_frames:%lld=======",signed_frames);
                 //ALOGV("============timestamp:%lld==========",timestamp);
@@ -3342,6 +5446,8 @@ static void do_in_standby(struct stream_in *in)
             simcom_release_rx_pcm(adev);
             in->pcm = NULL;
             in->simcom_attached = false;
+        } else if (in->mic_hub_attached) {
+            mic_hub_release(in);
         } else {
             pcm_close(in->pcm);
             in->pcm = NULL;
@@ -3355,19 +5461,23 @@ static void do_in_standby(struct stream_in *in)
         in->dev->in_device = AUDIO_DEVICE_NONE;
         in->dev->in_channel_mask = 0;
         in->standby = true;
-        route_pcm_close(CAPTURE_OFF_ROUTE);
-        in->simcom_rx_last_gen = 0;
-        
-        // Release SIMCOM resampler if allocated
-        if (in->simcom_resampler) {
-            release_resampler(in->simcom_resampler);
-            in->simcom_resampler = NULL;
-        }
-        if (in->simcom_resampler_buffer) {
-            free(in->simcom_resampler_buffer);
-            in->simcom_resampler_buffer = NULL;
-            in->simcom_resampler_buffer_size = 0;
+        in->frames_read = 0;
+        /* the codec capture stays routed while the mic hub has clients */
+        if (adev->mic_hub.users == 0)
+            route_pcm_close(CAPTURE_OFF_ROUTE);
+        in->simcom_rx_cursor = 0;
+        if (in->simcom_plc.gaps) {
+            ALOGI("SIMCOM: RX concealed %llu gaps, %llu samples",
+                  (unsigned long long)in->simcom_plc.gaps,
+                  (unsigned long long)in->simcom_plc.concealed);
         }
+        memset(&in->simcom_plc, 0, sizeof(in->simcom_plc));
+        
+        // Release SIMCOM uplink converter if allocated
+        simcom_uplink_release(&in->simcom_uplink);
+#ifdef SPEEX_DENOISE_ENABLE
+        speex_worker_stop(in);
+#endif
     }
 
 }
@@ -3596,21 +5706,23 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
 
+    /*
+     * acquiring hw device mutex systematically is useful if a low
+     * priority thread is waiting on the input stream mutex - e.g.
+     * executing in_set_parameters() while holding the hw device
+     * mutex
+     */
+    pthread_mutex_lock(&in->lock);
     if (in->device & AUDIO_DEVICE_IN_HDMI) {
         unsigned int rate = get_hdmiin_audio_rate(adev);
         if(rate != in->config->rate){
             ALOGD("HDMI-In: rate is changed: %d -> %d, restart input stream",
                     in->config->rate, rate);
+            pthread_mutex_lock(&adev->lock);
             do_in_standby(in);
+            pthread_mutex_unlock(&adev->lock);
         }
     }
-    /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the input stream mutex - e.g.
-     * executing in_set_parameters() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&in->lock);
     if (in->standby) {
         pthread_mutex_lock(&adev->lock);
         ret = start_input_stream(in);
@@ -3643,10 +5755,11 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     if (in->is_simcom_voice) {
         if (!IN_SIMCOM_PCM(in)) {
             pthread_mutex_lock(&adev->lock);
-            int attach_ret = simcom_acquire_rx_pcm(adev, false);
+            int attach_ret = simcom_acquire_rx_pcm(adev);
             if (attach_ret == 0) {
                 in->simcom_attached = true;
                 in->pcm = IN_SIMCOM_PCM(in);
+                simcom_rx_bus_attach(in);
                 ALOGI("SIMCOM: in_read re-attached RX PCM (pcm=%p users=%d)",
                       IN_SIMCOM_PCM(in), adev->simcom_rx_users);
             }
@@ -3664,40 +5777,13 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         }
     }
 
-    int retry = 0;
-    do {
-        ret = read_frames(in, buffer, frames_rq);
-        if (ret >= 0) {
-            ret = 0;
-            break;
-        }
-
-        const bool can_retry = in->is_simcom_voice &&
-                               (ret == -EAGAIN || ret == -EBUSY || ret == -EINTR);
-        if (!can_retry) {
-            ALOGE("SIMCOM: in_read read_frames failed ret=%d pcm=%p", ret, in->pcm);
-            break;
-        }
-
-        if (retry == 0) {
-            ALOGW("SIMCOM: in_read pcm_read busy (ret=%d) pcm=%p, will retry up to %d times",
-                  ret, in->pcm, SIMCOM_RX_READ_MAX_RETRIES);
-        }
-
-        if (retry >= SIMCOM_RX_READ_MAX_RETRIES) {
-            ALOGE("SIMCOM: in_read still busy after %d retries, returning silence",
-                  SIMCOM_RX_READ_MAX_RETRIES);
-            memset(buffer, 0, bytes);
-            if (buffer && bytes > 0) {
-                simcom_log_pcm_snapshot("RX<-modem (retry timeout)", buffer, bytes);
-            }
-            ret = 0;
-            break;
-        }
-
-        retry++;
-        usleep(SIMCOM_RX_READ_RETRY_US);
-    } while (true);
+    /* modem downlink gaps are concealed in simcom_rx_bus_acquire(), no retry here */
+    ret = read_frames(in, buffer, frames_rq);
+    if (ret >= 0) {
+        ret = 0;
+    } else {
+        ALOGE("%s: read_frames failed ret=%d pcm=%p", __func__, ret, in->pcm);
+    }
 
     if (in->is_simcom_voice && buffer && bytes > 0) {
         simcom_log_pcm_snapshot("RX<-modem", buffer, bytes);
@@ -3705,11 +5791,12 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     
     // SIMCOM: If voice call is active and this is a microphone input (not SIMCOM voice),
     // convert and write data to SIMCOM TX PCM
-    if (simcom_voice_mode_active(adev) && !in->is_simcom_voice && buffer && bytes > 0 && ret == 0) {
+    if (simcom_voice_mode_active(adev) && !in->is_simcom_voice && !simcom_call_owns_uplink(adev) &&
+            buffer && bytes > 0 && ret == 0) {
         // Ensure SIMCOM TX PCM is open
         if (adev->simcom_tx_pcm == NULL) {
             pthread_mutex_lock(&adev->lock);
-            int attach_ret = simcom_acquire_tx_pcm(adev, true);
+            int attach_ret = simcom_acquire_tx_pcm(adev);
             pthread_mutex_unlock(&adev->lock);
             if (attach_ret != 0) {
                 ALOGW("SIMCOM: TX PCM not ready for microphone data (ret=%d), skipping", attach_ret);
@@ -3722,7 +5809,7 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
             
             // Check if conversion is needed
             uint32_t in_rate = in->config->rate;
-            uint32_t out_rate = 8000;
+            uint32_t out_rate = adev->simcom_rate;
             size_t in_channels = audio_channel_count_from_in_mask(in->channel_mask);
             size_t out_channels = 1; // mono for SIMCOM
             
@@ -3730,96 +5817,20 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                   in_rate, out_rate, in_channels, out_channels, bytes);
             
             if (in_rate != out_rate || in_channels != out_channels) {
-                // Need to convert: prepare resampler if not already done
-                if (!in->simcom_resampler) {
-                    ALOGI("SIMCOM: Preparing TX resampler for microphone input: %u Hz %zu ch -> %u Hz %zu ch",
-                          in_rate, in_channels, out_rate, out_channels);
-                    int resampler_ret = create_resampler(in_rate, out_rate, in_channels,
-                                                          RESAMPLER_QUALITY_DEFAULT,
-                                                          NULL, &in->simcom_resampler);
-                    if (resampler_ret == 0) {
-                        ALOGI("SIMCOM: TX resampler created for microphone input");
-                    } else {
-                        ALOGE("SIMCOM: Failed to create TX resampler for microphone input: %d", resampler_ret);
-                    }
-                }
-                
-                // Convert data if resampler is available
-                if (in->simcom_resampler && buffer && bytes > 0) {
-                    size_t in_frames = bytes / (in_channels * sizeof(int16_t));
-                    size_t out_frames = (size_t)(((uint64_t)in_frames * out_rate) / in_rate);
-                    if (out_frames == 0) {
-                        out_frames = 1;
-                    }
-                    
-                    // Allocate buffer for resampled data
-                    size_t required_size = out_frames * in_channels * sizeof(int16_t);
-                    if (in->simcom_resampler_buffer == NULL || in->simcom_resampler_buffer_size < required_size) {
-                        if (in->simcom_resampler_buffer) {
-                            free(in->simcom_resampler_buffer);
-                        }
-                        in->simcom_resampler_buffer = (int16_t *)malloc(required_size);
-                        if (in->simcom_resampler_buffer == NULL) {
-                            ALOGE("SIMCOM: failed to allocate microphone resampler buffer of size %zu", required_size);
-                            in->simcom_resampler_buffer_size = 0;
-                        } else {
-                            in->simcom_resampler_buffer_size = required_size;
-                            ALOGI("SIMCOM: allocated microphone resampler buffer of size %zu", required_size);
-                        }
-                    }
-                    
-                    if (in->simcom_resampler_buffer != NULL) {
-                        size_t tmp_in = in_frames;
-                        size_t tmp_out = out_frames;
-                        in->simcom_resampler->resample_from_input(in->simcom_resampler,
-                                                                  (const int16_t *)buffer,
-                                                                  &tmp_in,
-                                                                  in->simcom_resampler_buffer,
-                                                                  &tmp_out);
-                        
-                        // Convert stereo to mono if needed
-                        int16_t *mono_buffer = NULL;
-                        size_t mono_bytes = 0;
-                        if (in_channels == 2 && out_channels == 1 && tmp_out > 0) {
-                            // Allocate temporary buffer for mono conversion
-                            mono_bytes = tmp_out * out_channels * sizeof(int16_t);
-                            mono_buffer = (int16_t *)malloc(mono_bytes);
-                            if (mono_buffer != NULL) {
-                                int16_t *stereo_data = (int16_t *)in->simcom_resampler_buffer;
-                                for (size_t i = 0; i < tmp_out; i++) {
-                                    // Average left and right channels
-                                    int32_t sum = (int32_t)stereo_data[i * 2] + (int32_t)stereo_data[i * 2 + 1];
-                                    mono_buffer[i] = (int16_t)(sum / 2);
-                                }
-                            } else {
-                                ALOGE("SIMCOM: Failed to allocate mono conversion buffer for microphone");
-                            }
-                        }
-                        
-                        // Write converted data to SIMCOM TX PCM
-                        const void *write_buffer = (mono_buffer != NULL) ? mono_buffer : in->simcom_resampler_buffer;
-                        size_t write_bytes = (mono_buffer != NULL) ? mono_bytes : (tmp_out * in_channels * sizeof(int16_t));
-                        simcom_log_pcm_snapshot("TX->modem (from microphone)", write_buffer, write_bytes);
-                        int write_ret = pcm_write(adev->simcom_tx_pcm, write_buffer, write_bytes);
-                        if (write_ret) {
-                            ALOGE("SIMCOM: in_read pcm_write failed for microphone data ret=%d err=%s",
-                                  write_ret, pcm_get_error(adev->simcom_tx_pcm));
-                        } else {
-                            ALOGD("SIMCOM: TX converted from microphone %u Hz %zu ch -> %u Hz %zu ch: %zu bytes",
-                                  in_rate, in_channels, out_rate, out_channels, write_bytes);
-                        }
-                        if (mono_buffer != NULL) {
-                            free(mono_buffer);
-                        }
-                    }
+                size_t in_frames = bytes / (in_channels * sizeof(int16_t));
+                if (simcom_uplink_prepare(&in->simcom_uplink, in_rate, in_channels,
+                                          out_rate, in_frames) == 0) {
+                    simcom_uplink_write(&in->simcom_uplink, adev,
+                                        (const int16_t *)buffer, in_frames,
+                                        "TX->modem (from microphone)");
                 }
             } else {
                 // No conversion needed, write directly
                 simcom_log_pcm_snapshot("TX->modem (from microphone, direct)", buffer, bytes);
-                int write_ret = pcm_write(adev->simcom_tx_pcm, buffer, bytes);
+                int write_ret = simcom_tx_write(adev, buffer, bytes, NULL);
                 if (write_ret) {
-                    ALOGE("SIMCOM: in_read pcm_write failed for microphone data (direct) ret=%d err=%s",
-                          write_ret, pcm_get_error(adev->simcom_tx_pcm));
+                    ALOGE("SIMCOM: in_read TX write failed for microphone data (direct) ret=%d",
+                          write_ret);
                 } else {
                     ALOGD("SIMCOM: TX wrote microphone data directly: %zu bytes", bytes);
                 }
@@ -3857,43 +5868,11 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
 
 #ifdef SPEEX_DENOISE_ENABLE
     if(!adev->mic_mute && ret== 0) {
-        int index = 0;
-        int startPos = 0;
-        spx_int16_t* data = (spx_int16_t*) buffer;
-
         int channel_count = audio_channel_count_from_out_mask(in->channel_mask);
-        int curFrameSize = bytes/(channel_count*sizeof(int16_t));
-        long ch;
+        size_t frames = bytes/(channel_count*sizeof(int16_t));
         ALOGV("channel_count:%d",channel_count);
-        if(curFrameSize != in->mSpeexFrameSize)
-            ALOGD("the current request have some error mSpeexFrameSize %d bytes %d ",in->mSpeexFrameSize, bytes);
-
-        while(curFrameSize >= startPos+in->mSpeexFrameSize) {
-            if( 2 == channel_count) {
-                for(index = startPos; index< startPos +in->mSpeexFrameSize ; index++ )
-                    in->mSpeexPcmIn[index-startPos] = data[index*channel_count]/2 + data[index*channel_count+1]/2;
-            } else {
-                for(index = startPos; index< startPos +in->mSpeexFrameSize ; index++ )
-                    in->mSpeexPcmIn[index-startPos] = data[index*channel_count];
-            }
-            speex_preprocess_run(in->mSpeexState,in->mSpeexPcmIn);
-#ifndef TARGET_RK2928
-            for(ch = 0 ; ch < channel_count; ch++)
-                for(index = startPos; index< startPos + in->mSpeexFrameSize ; index++ ) {
-                    data[index*channel_count+ch] = in->mSpeexPcmIn[index-startPos];
-                }
-#else
-            for(index = startPos; index< startPos + in->mSpeexFrameSize ; index++ ) {
-                int tmp = (int)in->mSpeexPcmIn[index-startPos]+ in->mSpeexPcmIn[index-startPos]/2;
-                data[index*channel_count+0] = tmp > 32767 ? 32767 : (tmp < -32768 ? -32768 : tmp);
-            }
-            for(int ch = 1 ; ch < channel_count; ch++)
-                for(index = startPos; index< startPos + in->mSpeexFrameSize ; index++ ) {
-                    data[index*channel_count+ch] = data[index*channel_count+0];
-                }
-#endif
-            startPos += in->mSpeexFrameSize;
-        }
+        if (!speex_denoise_pipelined(in, (int16_t *)buffer, frames, channel_count))
+            speex_denoise_inline(in, (int16_t *)buffer, frames, channel_count);
     }
 #endif
 
@@ -3904,7 +5883,11 @@ exit:
     if (ret < 0) {
         usleep(bytes * 1000000 / audio_stream_in_frame_size(stream) /
                in_get_sample_rate(&stream->common));
+        pthread_mutex_lock(&adev->lock);
         do_in_standby(in);
+        pthread_mutex_unlock(&adev->lock);
+    } else {
+        in->frames_read += frames_rq;
     }
 
     pthread_mutex_unlock(&in->lock);
@@ -3920,7 +5903,23 @@ exit:
  */
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    uint32_t frames = 0;
+
+    /* only consumers of a shared capture bus can lose data in the HAL */
+    pthread_mutex_lock(&in->lock);
+    if ((in->simcom_rx_lost_bytes || in->mic_lost_bytes) && in->config &&
+            in->config->channels && in->config->rate) {
+        /* both buses carry the pcm format, the stream counts frames at requested_rate */
+        uint64_t lost = (in->simcom_rx_lost_bytes + in->mic_lost_bytes) /
+                        (in->config->channels * sizeof(int16_t));
+        frames = (uint32_t)(lost * in->requested_rate / in->config->rate);
+        in->simcom_rx_lost_bytes = 0;
+        in->mic_lost_bytes = 0;
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return frames;
 }
 
 /**
@@ -4006,6 +6005,63 @@ static int adev_get_microphones(const struct audio_hw_device *dev,
     return 0;
 }
 
+/**
+ * @brief in_get_capture_position
+ * frames read since the stream left standby and the time the next frame was
+ * captured. For a stream started from the mic history that time is in the past.
+ *
+ * @param stream
+ * @param frames
+ * @param time
+ *
+ * @returns 0, -ENOSYS while in standby or without a timestamp
+ */
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+    int ret = -ENOSYS;
+
+    if (frames == NULL || time == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&in->lock);
+    if (!in->standby && in->pcm && in->config) {
+        unsigned int rate = in->config->rate;
+        /* frames already taken from the pcm but not handed to the client yet */
+        int64_t behind = in->frames_in;
+        int64_t ns = 0;
+
+        if (in->mic_hub_attached) {
+            struct capture_bus *bus = &in->dev->mic_hub.bus;
+            size_t frame_bytes = in->config->channels * sizeof(int16_t);
+            uint64_t head;
+
+            if (capture_bus_get_stamp(bus, &head, &ns)) {
+                behind += (int64_t)(head - in->mic_cursor) / (int64_t)frame_bytes;
+                ret = 0;
+            }
+        } else {
+            unsigned int avail;
+            struct timespec ts;
+
+            if (pcm_get_htimestamp(in->pcm, &avail, &ts) == 0) {
+                ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+                behind += avail;
+                ret = 0;
+            }
+        }
+
+        if (ret == 0) {
+            *frames = in->frames_read;
+            *time = ns - behind * 1000000000LL / rate;
+        }
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    return ret;
+}
+
 static int in_get_active_microphones(const struct audio_stream_in *stream,
                          struct audio_microphone_characteristic_t *mic_array,
                          size_t *mic_count)
@@ -4056,12 +6112,11 @@ static int in_get_active_microphones(const struct audio_stream_in *stream,
 /*
  * get support channels mask of hdmi from parsing edid of hdmi
  */
-static void get_hdmi_support_channels_masks(struct stream_out *out)
+static void get_hdmi_support_channels_masks(struct stream_out *out, int channels)
 {
     if(out == NULL)
         return ;
 
-    int channels = get_hdmi_audio_speaker_allocation(&out->hdmi_audio);
     switch (channels) {
     case AUDIO_CHANNEL_OUT_5POINT1:
         ALOGD("%s: HDMI Support 5.1 channels pcm",__FUNCTION__);
@@ -4108,6 +6163,8 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     int ret;
     enum output_type type = OUTPUT_LOW_LATENCY;
     bool isPcm = audio_is_linear_pcm(config->format);
+    /* speaker allocation of the sink, audio_channel_mask_t */
+    int hdmi_layout = AUDIO_CHANNEL_OUT_STEREO;
 
     bool telephony_tx = (devices & AUDIO_DEVICE_OUT_TELEPHONY_TX);
     bool call_mode_active = simcom_voice_mode_active(adev);
@@ -4125,15 +6182,20 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         if (telephony_tx && !adev->simcom_card_available) {
             ALOGW("SIMCOM: telephony TX requested but SIMCOM device not detected");
         }
-        ALOGD("SIMCOM: forcing output stream request to 8kHz mono PCM16 for voice call");
-        config->sample_rate = 8000;
+        config->sample_rate = simcom_rate_pin(adev);
         config->channel_mask = AUDIO_CHANNEL_OUT_MONO;
         config->format = AUDIO_FORMAT_PCM_16_BIT;
+        ALOGD("SIMCOM: forcing output stream request to %u Hz mono PCM16 for voice call",
+              config->sample_rate);
     }
 
     out = (struct stream_out *)calloc(1, sizeof(struct stream_out));
-    if (!out)
+    if (!out) {
+        if (telephony_tx || call_mode_active)
+            simcom_rate_unpin(adev);
         return -ENOMEM;
+    }
+    out->simcom_rate_pinned = telephony_tx || call_mode_active;
 
     /*get default supported channel_mask*/
     memset(out->supported_channel_masks, 0, sizeof(out->supported_channel_masks));
@@ -4150,10 +6212,6 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->simcom_attached = false;
     out->requested_rate = client_requested_rate != 0 ?
             client_requested_rate : config->sample_rate;
-    out->simcom_resampler = NULL;
-    out->simcom_resampler_buffer = NULL;
-    out->simcom_resampler_buffer_frames = 0;
-    out->simcom_resampler_in_rate = 0;
 
     if (telephony_tx && force_patch) {
         ALOGI("SIMCOM: Telephony Tx requested - NO PCM in adev_open (patch mode)");
@@ -4178,14 +6236,21 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
      */
     out->output_direct_mode = LPCM;
     out->output_direct = false;
-    out->snd_reopen = false;
+    atomic_init(&out->snd_reopen, false);
     out->channel_buffer = NULL;
+    out->channel_pos = 0;
     out->bitstream_buffer = NULL;
+    out->bitstream_buffer_size = 0;
 
-    init_hdmi_audio(&out->hdmi_audio);
     if(devices & AUDIO_DEVICE_OUT_AUX_DIGITAL) {
-        parse_hdmi_audio(&out->hdmi_audio);
-        get_hdmi_support_channels_masks(out);
+        /* without uevents a plug is never seen, read the EDID as before */
+        if (!adev->cards.uevent_running) {
+            hdmi_edid_cache_invalidate(&adev->hdmi_edid);
+            hdmi_edid_cache_refresh(&adev->hdmi_edid);
+        }
+        hdmi_layout = hdmi_caps_speaker_allocation(hdmi_edid_cache_get_caps(&adev->hdmi_edid));
+        hdmi_edid_cache_put_caps(&adev->hdmi_edid);
+        get_hdmi_support_channels_masks(out, hdmi_layout);
     }
 
     if (out->is_simcom_voice) {
@@ -4236,7 +6301,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
                 if (config->channel_mask == 0)
                     config->channel_mask = AUDIO_CHANNEL_OUT_5POINT1;
 
-                int layout = get_hdmi_audio_speaker_allocation(&out->hdmi_audio);
+                int layout = hdmi_layout;
                 unsigned int mask = (layout&config->channel_mask);
                 ALOGD("%s:out = %p HDMI multi pcm: layout = 0x%x,mask = 0x%x",
                     __FUNCTION__,out,layout,mask);
@@ -4387,7 +6452,8 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
 err_open:
     if (out != NULL) {
-        destory_hdmi_audio(&out->hdmi_audio);
+        if (out->simcom_rate_pinned)
+            simcom_rate_unpin(adev);
         free(out);
     }
     *stream_out = NULL;
@@ -4408,6 +6474,10 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
 
     ALOGD("adev_close_output_stream!");
     out_standby(&stream->common);
+    /* a stream replaced in adev->outputs is not joined by unlock_all_outputs() */
+    pthread_mutex_lock(&((struct stream_out *)stream)->lock);
+    out_writers_join((struct stream_out *)stream);
+    pthread_mutex_unlock(&((struct stream_out *)stream)->lock);
     adev = (struct audio_device *)dev;
     pthread_mutex_lock(&adev->lock_outputs);
     for (type = 0; type < OUTPUT_TOTAL; ++type) {
@@ -4421,6 +6491,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
         if (out->bitstream_buffer != NULL) {
             free(out->bitstream_buffer);
             out->bitstream_buffer = NULL;
+            out->bitstream_buffer_size = 0;
         }
 
         if (out->channel_buffer != NULL) {
@@ -4428,10 +6499,11 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
             out->channel_buffer = NULL;
         }
 
-        destory_hdmi_audio(&out->hdmi_audio);
-        simcom_release_tx_resampler(out);
+        simcom_uplink_release(&out->simcom_uplink);
     }
     pthread_mutex_unlock(&adev->lock_outputs);
+    if (((struct stream_out *)stream)->simcom_rate_pinned)
+        simcom_rate_unpin(adev);
     free(stream);
 }
 
@@ -4465,6 +6537,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
      *              if the things we do is correct, we set status = 0, or status < 0 means fail.
      */
     int status = 0;
+    int call_engine = 0; /* 1 start, -1 stop, applied once adev->lock is dropped */
 
     ALOGD("%s: kvpairs = %s", __func__, kvpairs);
     parms = str_parms_create_str(kvpairs);
@@ -4481,8 +6554,15 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         }
     }
 
+    // the sink may be another one, its EDID is read again on the next query
+    if ((str_parms_get_str(parms, AUDIO_PARAMETER_DEVICE_CONNECT, value, sizeof(value)) >= 0 ||
+            str_parms_get_str(parms, AUDIO_PARAMETER_DEVICE_DISCONNECT, value, sizeof(value)) >= 0) &&
+            atoi(value) == (int)AUDIO_DEVICE_OUT_AUX_DIGITAL) {
+        hdmi_edid_cache_invalidate(&adev->hdmi_edid);
+    }
+
 #ifdef AUDIO_BITSTREAM_REOPEN_HDMI
-	if (!hasExtCodec()){
+	if (!hasExtCodec(adev)){
     // hdmi reconnect
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_DEVICE_CONNECT, // hdmi reconnect
                             value, sizeof(value));
@@ -4492,7 +6572,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             struct stream_out *out = adev->outputs[OUTPUT_HDMI_MULTI];
             if((out != NULL) && is_bitstream(out) && (out->device == AUDIO_DEVICE_OUT_AUX_DIGITAL)) {
                 ALOGD("%s: hdmi connect when audio stream is output over hdmi, do something,out = %p",__FUNCTION__,out);
-                out->snd_reopen = true;
+                atomic_store_explicit(&out->snd_reopen, true, memory_order_release);
             }
 	        }
         }
@@ -4507,10 +6587,12 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
                 status = -ENODEV;
             } else {
                 adev->voice_call_active = true;
+                call_engine = 1;
                 ALOGI("SIMCOM: voice call flag set");
             }
         } else if (!strcmp(value, "stop")) {
             adev->voice_call_active = false;
+            call_engine = -1;
             ALOGI("SIMCOM: voice call flag cleared");
         } else {
             ALOGW("SIMCOM: unknown simcom_voice_call value: %s", value);
@@ -4520,6 +6602,12 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     pthread_mutex_unlock(&adev->lock);
     str_parms_destroy(parms);
+
+    if (call_engine > 0) {
+        simcom_call_start(adev);
+    } else if (call_engine < 0) {
+        simcom_call_stop(adev);
+    }
     return status;
 }
 
@@ -4528,36 +6616,34 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
  * There is no stand interface in andorid to get the formats can be bistream,
  * so we extend get parameter to report formats
  */
-static int get_support_bitstream_formats(struct str_parms *query,
-                                    struct str_parms *reply)
+static int get_support_bitstream_formats(struct audio_device *adev,
+                                         struct str_parms *query,
+                                         struct str_parms *reply)
 {
     int avail = 1024;
     char value[avail];
 
-    struct hdmi_audio_infors hdmi_edid;
-    init_hdmi_audio(&hdmi_edid);
     const char* AUDIO_PARAMETER_STREAM_SUP_BITSTREAM_FORMAT = "sup_bitstream_formats";
     if (str_parms_has_key(query, AUDIO_PARAMETER_STREAM_SUP_BITSTREAM_FORMAT)) {
         memset(value,0,avail);
 
         // get the format can be bistream?
-        if(parse_hdmi_audio(&hdmi_edid) >= 0){
-            int cursor = 0;
-            for(int i = 0; i < ARRAY_SIZE(sSurroundFormat); i++){
-                if(is_support_format(&hdmi_edid,sSurroundFormat[i].format)){
-                    avail -= cursor;
-                    int length = snprintf(value + cursor, avail, "%s%s",
-                                   cursor > 0 ? "|" : "",
-                                   sSurroundFormat[i].value);
-                    if (length < 0 || length >= avail) {
-                        break;
-                    }
-                    cursor += length;
+        const struct hdmi_audio_caps *caps = hdmi_edid_cache_get_caps(&adev->hdmi_edid);
+        int cursor = 0;
+        for(int i = 0; i < ARRAY_SIZE(sSurroundFormat); i++){
+            if(hdmi_caps_support_format(caps, sSurroundFormat[i].format)){
+                avail -= cursor;
+                int length = snprintf(value + cursor, avail, "%s%s",
+                               cursor > 0 ? "|" : "",
+                               sSurroundFormat[i].value);
+                if (length < 0 || length >= avail) {
+                    break;
                 }
+                cursor += length;
             }
         }
+        hdmi_edid_cache_put_caps(&adev->hdmi_edid);
 
-        destory_hdmi_audio(&hdmi_edid);
         str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_BITSTREAM_FORMAT, value);
         return 0;
     }
@@ -4585,7 +6671,7 @@ static char * adev_get_parameters(const struct audio_hw_device *dev,
         str_parms_destroy(parms);
         parms = str_parms_create_str("ec_supported=yes");
         str = str_parms_to_str(parms);
-    } else if (get_support_bitstream_formats(parms,reply) == 0) {
+    } else if (get_support_bitstream_formats(adev,parms,reply) == 0) {
         str = str_parms_to_str(reply);
     } else {
         str = strdup("");
@@ -4672,6 +6758,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
     } else if (!now_call && adev->voice_call_active) {
         ALOGI("SIMCOM: exited call mode, clearing voice flag");
         adev->voice_call_active = false;
+        simcom_call_stop(adev);
     }
 
     return 0;
@@ -4768,7 +6855,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     /* Respond with a request for mono if a different format is given. */
     //ALOGV("%s:config->channel_mask %d",__FUNCTION__,config->channel_mask);
     if (telephony_rx || call_mode_active) {
-        config->sample_rate = 8000;
+        config->sample_rate = simcom_rate_pin(adev);
         config->channel_mask = AUDIO_CHANNEL_IN_MONO;
         config->format = AUDIO_FORMAT_PCM_16_BIT;
     } else if (config->channel_mask != AUDIO_CHANNEL_IN_STEREO) {
@@ -4778,8 +6865,12 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     }
 
     in = (struct stream_in *)calloc(1, sizeof(struct stream_in));
-    if (!in)
+    if (!in) {
+        if (telephony_rx || call_mode_active)
+            simcom_rate_unpin(adev);
         return -ENOMEM;
+    }
+    in->simcom_rate_pinned = telephony_rx || call_mode_active;
 
     /*get default supported channel_mask*/
     memset(in->supported_channel_masks, 0, sizeof(in->supported_channel_masks));
@@ -4807,6 +6898,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
     in->stream.get_active_microphones = in_get_active_microphones;
+    in->stream.get_capture_position = in_get_capture_position;
 
     in->dev = adev;
     in->is_simcom_voice = telephony_rx;
@@ -4843,6 +6935,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 #endif
 
     in->config = pcm_config;
+    channel_map_init_default(&in->channel_map, pcm_config->channels, in->channel_mask);
 
     in->buffer = malloc(pcm_config->period_size * pcm_config->channels
                         * audio_stream_in_frame_size(&in->stream));
@@ -4912,6 +7005,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     speex_preprocess_ctl(in->mSpeexState, SPEEX_PREPROCESS_SET_DENOISE, &denoise);
     speex_preprocess_ctl(in->mSpeexState, SPEEX_PREPROCESS_SET_NOISE_SUPPRESS, &noiseSuppress);
+    speex_worker_init(in);
 
 #endif
 
@@ -4926,6 +7020,8 @@ err_speex_malloc:
 err_resampler:
     free(in->buffer);
 err_malloc:
+    if (in->simcom_rate_pinned)
+        simcom_rate_unpin(adev);
     free(in);
     return ret;
 }
@@ -4961,6 +7057,7 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 #endif
 
 #ifdef SPEEX_DENOISE_ENABLE
+    speex_worker_release(in);
     if (in->mSpeexState) {
         speex_preprocess_state_destroy(in->mSpeexState);
     }
@@ -4969,6 +7066,8 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
     }
 #endif
     free(in->buffer);
+    if (in->simcom_rate_pinned)
+        simcom_rate_unpin(adev);
     free(stream);
 }
 
@@ -4982,6 +7081,12 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
  */
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+
+    simcom_tx_fifo_dump(adev, fd);
+    dprintf(fd, "HDMI monitor: %s, %u plugs\n",
+            hdmi_monitor_configured(adev) ? "configured" : "waiting",
+            atomic_load(&adev->hdmi_monitor.plugs));
     return 0;
 }
 
@@ -4997,7 +7102,19 @@ static int adev_close(hw_device_t *device)
     struct audio_device *adev = (struct audio_device *)device;
 
     //audio_route_free(adev->ar);
+    simcom_call_stop(adev);
+    /* stop the uevent thread first, it attaches and detaches the modem pcms */
+    card_registry_release(adev);
+    hdmi_monitor_release(adev);
+    simcom_attach_release(adev);
+    simcom_tx_fifo_release(&adev->simcom_tx_fifo);
+    capture_bus_release(&adev->simcom_rx_bus);
+    capture_bus_release(&adev->mic_hub.bus);
     route_uninit();
+    route_set_mixer_cache(NULL);
+    mixer_cache_release(&adev->mixers);
+    hdmi_edid_cache_release(&adev->hdmi_edid);
+    audio_props_release();
 
     free(device);
     return 0;
@@ -5031,7 +7148,22 @@ static void adev_open_init(struct audio_device *adev)
     adev->dev_in[SND_IN_SOUND_CARD_SIMCOM].id = "SIMCOM_IN";
     adev->owner[0] = NULL;
     adev->owner[1] = NULL;
-    simcom_rx_bus_init(&adev->simcom_rx_bus);
+    mixer_cache_init(&adev->mixers);
+    route_set_mixer_cache(&adev->mixers);
+    hdmi_edid_cache_init(&adev->hdmi_edid);
+    hdmi_monitor_init(adev);
+    card_registry_init(adev);
+    audio_props_init();
+    if (capture_bus_init(&adev->simcom_rx_bus, SIMCOM_RX_RING_BYTES) != 0 ||
+            mic_hub_init(&adev->mic_hub) != 0) {
+        ALOGE("%s: no memory for the capture buses", __func__);
+    }
+    if (simcom_tx_fifo_init(&adev->simcom_tx_fifo) != 0) {
+        ALOGE("SIMCOM: no memory for the TX fifo, uplink disabled");
+    }
+    pthread_mutex_init(&adev->simcom_call.lock, NULL);
+    atomic_init(&adev->simcom_call.exit, false);
+    atomic_init(&adev->simcom_call.uplink, false);
 
     char value[PROPERTY_VALUE_MAX];
     if (property_get("vendor.audio.period_size", value, NULL) > 0) {
@@ -5045,6 +7177,7 @@ static void adev_open_init(struct audio_device *adev)
     adev->simcom_card_available = false;
     adev->simcom_pcm_card = -1;
     adev->simcom_pcm_device = SIMCOM_PCM_DEVICE;
+    adev->simcom_rate = SIMCOM_PCM_RATE;
 }
 
 /**
@@ -5100,8 +7233,9 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev_open_init(adev);
     adev->simcom_card_available = simcom_detect_card(adev);
     if (!adev->simcom_card_available) {
-        ALOGW("SIMCOM audio device not found - voice calls unavailable");
+        ALOGW("SIMCOM audio device not found - waiting for it to enumerate");
     }
+    simcom_attach_init(adev);
     return 0;
 }
 
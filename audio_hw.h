@@ -40,12 +40,14 @@
 #define AUIDO_HW_H
 #include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
@@ -72,8 +74,10 @@
 #include <linux/fb.h>
 #include <hardware_legacy/uevent.h>
 
+#include "alsa_audio.h"
 #include "voice_preprocess.h"
 #include "audio_hw_hdmi.h"
+#include "audio_channel_map.h"
 
 #define AUDIO_HAL_VERSION "ALSA Audio Version: V1.1.0"
 
@@ -106,19 +110,64 @@
 #define SPEEX_DENOISE_ENABLE
 #endif
 
+#ifdef SPEEX_DENOISE_ENABLE
+/*
+ * with persist.vendor.audio.speex.async set, denoise runs on a worker one
+ * request behind capture. Samples travel as mono through two single producer,
+ * single consumer fifos: raw (in_read -> worker) and clean (worker -> in_read).
+ */
+struct sample_fifo {
+    _Atomic size_t head;        /* written by the producer only */
+    _Atomic size_t tail;        /* written by the consumer only */
+    int16_t *buf;
+    size_t size;                /* power of two */
+};
+
+/* fifo depth in requests of the stream buffer size */
+#define SPEEX_WORKER_FIFO_REQUESTS   8
+
+struct speex_worker {
+    pthread_t thread;
+    bool running;
+    atomic_bool exit;
+    sem_t wake;
+    struct sample_fifo raw;
+    struct sample_fifo clean;
+    int16_t *mono;              /* in_read scratch, half the raw fifo */
+    bool primed;                /* clean holds the one request of delay */
+    uint64_t underruns;         /* in_read found too little clean audio */
+    uint64_t overruns;          /* raw fifo full, samples not denoised */
+};
+#endif
+
 #define HW_PARAMS_FLAG_LPCM 0
 #define HW_PARAMS_FLAG_NLPCM 1
 
-#define SIMCOM_WAIT_STEP_MS          50
-#define SIMCOM_RX_TIMEOUT_MS         12000
-#define SIMCOM_TX_TIMEOUT_MS         5000
-#define SIMCOM_RX_READ_RETRY_US      20000
-#define SIMCOM_RX_READ_MAX_RETRIES   50
+#define SIMCOM_ATTACH_RETRY_MS       1000
+/* frame moved per cycle by the in-HAL call engine */
+#define SIMCOM_CALL_FRAME_MS         20
+#define SIMCOM_CALL_PERIOD_COUNT     4
+#define SIMCOM_CALL_PRIORITY         2
+/* downlink a RX consumer may lag behind the modem before the oldest audio is dropped */
+#define SIMCOM_RX_JITTER_MAX_MS      300
+
+/*
+ * When one PCM stream fans out to several sound cards (speaker + HDMI + SPDIF),
+ * every card gets its own writer thread and ring so a slow sink can not hold back
+ * the others. Ring depth is counted in periods of the stream config.
+ */
+#define OUT_WRITER_RING_PERIODS      4
+/* a card blocked in pcm_write() longer than this is reported as stalled */
+#define OUT_WRITER_STALL_MS          200
 
+/* narrowband until the modem pcm is probed for wideband, see adev->simcom_rate */
 #define SIMCOM_PCM_RATE              8000
+#define SIMCOM_PCM_RATE_WB           16000
+#define SIMCOM_PCM_RATE_MAX          SIMCOM_PCM_RATE_WB
 #define SIMCOM_PCM_CHANNELS          1
 #define SIMCOM_PCM_BITS              16
-#define SIMCOM_RX_BUS_MAX_BYTES      (SIMCOM_PCM_RATE * SIMCOM_PCM_CHANNELS * (SIMCOM_PCM_BITS / 8))
+/* power of two, at least twice the largest chunk */
+#define SIMCOM_RX_RING_BYTES         32768
 
 #ifdef BOX_HAL
 struct pcm_config pcm_config = {
@@ -287,15 +336,226 @@ struct dev_info
     int device;
 };
 
-struct simcom_rx_bus {
+#define SNDRV_CARDS 8
+#define SNDRV_DEVICES 8
+#define SND_CARD_ID_LEN 20
+
+/*
+ * cached view of /proc/asound, built at adev_open() and rebuilt on the next
+ * stream start only after an ALSA card add/remove uevent bumped generation.
+ */
+struct card_registry {
+    pthread_mutex_t lock;
+    atomic_uint generation;
+    unsigned int built_generation;
+    bool valid;
+    int count;
+    char ids[SNDRV_CARDS][SND_CARD_ID_LEN];
+    struct dev_info dev_out[SND_OUT_SOUND_CARD_MAX];
+    struct dev_info dev_in[SND_IN_SOUND_CARD_MAX];
+    atomic_bool ext_codec;
+    pthread_t uevent_thread;
+    bool uevent_running;
+    atomic_bool uevent_exit;
+};
+
+/*
+ * waits for the display side to finish configuring HDMI after a hotplug,
+ * off the write thread. Bitstream writes to HDMI are dropped until configured.
+ */
+#define HDMI_MONITOR_POLL_MS         10
+/* without a readiness node, the time hwc usually needs after a plug */
+#define HDMI_MONITOR_SETTLE_MS       1000
+#define HDMI_MONITOR_TIMEOUT_MS      2000
+
+struct hdmi_monitor {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    bool exit;
+    bool kick;
+    atomic_bool configured;
+    atomic_uint plugs;          /* hotplugs seen, for dump */
+};
+
+struct stream_out;
+
+struct out_card_writer {
+    struct stream_out *out;
+    struct pcm *pcm;
+    int card;               /* enum snd_out_sound_cards */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* signalled on data pushed and on space freed */
+    bool active;
+    bool exit;
+    bool owns_pcm;          /* taken from the stream at standby, closed once joined */
+    uint8_t *ring;
+    size_t ring_size;
+    size_t rd;
+    _Atomic size_t fill;    /* written under lock, read without it by out_get_latency() */
+    size_t chunk;           /* max bytes handed to one pcm_write() */
+    bool in_write;
+    struct timespec write_start;
+    bool stalled;
+    uint64_t xruns;         /* failed pcm_write() calls */
+    uint64_t stalls;        /* times the card was found stuck in pcm_write() */
+    uint64_t dropped;       /* bytes discarded because the card fell behind */
+};
+
+/*
+ * one capture pcm shared by several readers: single producer, one read cursor
+ * per reader. head and reserve count bytes since the pcm was opened. Used for
+ * the modem downlink and the mic hub.
+ */
+struct capture_bus {
+    pthread_mutex_t lock;       /* only for consumers waiting on another producer */
+    pthread_cond_t cond;
+    _Atomic uint64_t head;      /* bytes published */
+    _Atomic uint64_t reserve;   /* bytes published or being written */
+    atomic_bool producing;      /* a consumer is inside pcm_read() */
+    atomic_int waiters;
+    /* capture time of the newest chunk, seqlock: odd stamp_seq while updating */
+    atomic_uint stamp_seq;
+    _Atomic uint64_t stamp_head;
+    _Atomic int64_t stamp_ns;   /* CLOCK_MONOTONIC when stamp_head was read */
+    uint8_t *ring;
+    size_t ring_bytes;          /* power of two */
+};
+
+/*
+ * the codec mic opened once and fanned out to every mic stream_in through a
+ * capture bus. Each client keeps its own resampler, channel mapping and cursor.
+ * pcm, config and users are protected by adev->lock.
+ */
+#define MIC_HUB_RING_BYTES           131072
+/*
+ * with persist.vendor.audio.mic.preroll_ms set, a hotword client keeps the ring
+ * filled and a voice recognition stream joining the hub starts that far back
+ */
+#define MIC_HUB_PREROLL_MAX_MS       10000
+
+struct mic_hub {
+    struct capture_bus bus;
+    struct pcm *pcm;
+    struct pcm_config config;   /* what the pcm was opened with */
+    int card;
+    int device;
+    int users;
+    int history_users;          /* attached AUDIO_SOURCE_HOTWORD clients */
+    unsigned int preroll_ms;    /* 0: no history kept */
+};
+
+/*
+ * background opener for the modem pcms. The hot paths only post a request and
+ * pick up a handle once the attach thread has opened it, they never wait for
+ * the modem to enumerate. Index 0 is TX (playback), 1 is RX (capture).
+ */
+struct simcom_attach {
     pthread_mutex_t lock;
     pthread_cond_t cond;
-    bool frame_ready;
-    bool producer_active;
-    size_t frame_bytes;
-    uint32_t frame_gen;
-    uint32_t pending_consumers;
-    uint8_t frame_buf[SIMCOM_RX_BUS_MAX_BYTES];
+    pthread_t thread;
+    bool running;
+    bool exit;
+    bool kick;                  /* a sound card uevent arrived */
+    bool want[2];
+    unsigned int rate[2];       /* rate the ready handle was opened at */
+    struct pcm *_Atomic ready[2];
+};
+
+/*
+ * optional in-HAL call path, enabled by persist.vendor.audio.simcom.call_engine:
+ * one SCHED_FIFO thread moves SIMCOM_CALL_FRAME_MS frames mic -> modem and
+ * modem -> speaker without going through AudioFlinger. Each leg is only taken
+ * over when the engine could open its local pcm.
+ */
+struct simcom_call {
+    pthread_mutex_t lock;       /* serialises start and stop */
+    pthread_t thread;
+    bool running;
+    atomic_bool exit;
+    atomic_bool uplink;         /* engine owns mic -> modem, streams stop forwarding */
+};
+
+/*
+ * concealment of modem downlink gaps: the last pitch period of good audio is
+ * repeated with a linear fade to silence instead of stalling the reader, and the
+ * first good chunk after a gap is faded back in. Mono, at the modem rate.
+ */
+#define SIMCOM_PLC_HIST_MS           40
+#define SIMCOM_PLC_FADE_MS           60
+#define SIMCOM_PLC_RAMP_MS           5
+#define SIMCOM_PLC_HIST_SAMPLES      (SIMCOM_PCM_RATE_MAX * SIMCOM_PLC_HIST_MS / 1000)
+
+struct simcom_plc {
+    unsigned int rate;      /* modem rate the history was taken at */
+    int16_t hist[SIMCOM_PLC_HIST_SAMPLES];  /* newest good audio, oldest first */
+    size_t hist_len;        /* SIMCOM_PLC_HIST_MS at rate */
+    size_t hist_fill;
+    bool in_gap;
+    size_t pitch;           /* repetition period of the current gap, 0 for silence */
+    size_t pos;             /* position inside the repeated period */
+    size_t faded;           /* samples concealed in the current gap */
+    uint64_t gaps;
+    uint64_t concealed;     /* samples synthesised */
+};
+
+/*
+ * re-framing FIFO in front of the shared modem TX pcm. Writers append any size,
+ * the pcm only ever sees whole periods, and the first write after the pcm is
+ * (re)started is preceded by silence up to the start threshold.
+ */
+#define SIMCOM_TX_FIFO_PERIODS       4
+
+struct simcom_tx_fifo {
+    pthread_mutex_t lock;       /* also serialises pcm_write() on the TX pcm */
+    uint8_t *buf;               /* sized for the widest modem rate */
+    size_t size;                /* SIMCOM_TX_FIFO_PERIODS periods at the current rate */
+    size_t period_bytes;
+    size_t prefill_bytes;       /* start threshold of the TX pcm */
+    size_t fill;
+    bool primed;
+    /* stats, reported by adev_dump() */
+    uint64_t bytes_in;
+    uint64_t pcm_writes;
+    uint64_t prefills;
+    uint64_t errors;
+    size_t max_fill;
+};
+
+/*
+ * drift trim between the modem and codec clocks, which both run free. The fill
+ * of the playback pcm the converted audio goes to is held at the level seen when
+ * it started: a PI controller turns the fill error into a ppm trim and whole
+ * samples are inserted or dropped as the trim accumulates.
+ */
+#define SIMCOM_DRIFT_MAX_PPM         1000
+
+struct simcom_drift {
+    int32_t target;         /* playback fill aimed for in frames, 0 until primed */
+    int32_t fill_q4;        /* smoothed fill, Q4 */
+    int64_t integ;          /* summed fill error */
+    int32_t ppm;            /* current trim, positive inserts samples */
+    int64_t phase;          /* accumulated trim in millionths of a sample */
+    uint64_t slips;         /* samples inserted or dropped */
+};
+
+/*
+ * uplink converter towards the modem: downmix to mono first, then resample the
+ * single channel. Buffers are sized once per configuration, longer inputs are
+ * converted in chunks so the data path never allocates.
+ */
+struct simcom_uplink {
+    struct resampler_itfe *resampler;
+    uint32_t in_rate;
+    uint32_t in_channels;   /* 0 when not prepared */
+    uint32_t out_rate;
+    size_t max_in_frames;   /* input frames converted per chunk */
+    int16_t *mono;          /* max_in_frames */
+    int16_t *out;           /* out_frames */
+    size_t out_frames;
+    struct simcom_drift drift;
 };
 
 struct audio_device {
@@ -329,17 +589,28 @@ struct audio_device {
 
     struct dev_info dev_out[SND_OUT_SOUND_CARD_MAX];
     struct dev_info dev_in[SND_IN_SOUND_CARD_MAX];
+    struct card_registry cards;
+    struct hdmi_monitor hdmi_monitor;
+    struct hdmi_edid_cache hdmi_edid;
+    /* legacy mixers shared by the route layer and mixer_mode_set() */
+    struct mixer_cache mixers;
 
     /* SIMCOM voice call support */
     bool voice_call_active;
     bool simcom_card_available;
     int  simcom_pcm_card;
     int  simcom_pcm_device;
+    unsigned int simcom_rate;   /* negotiated modem rate, only changes while no modem pcm is open */
+    int simcom_rate_pins;       /* open streams sized for simcom_rate, it is kept while any exists */
     struct pcm *simcom_tx_pcm;
     struct pcm *simcom_rx_pcm;
     int simcom_tx_users;
     int simcom_rx_users;
-    struct simcom_rx_bus simcom_rx_bus;
+    struct capture_bus simcom_rx_bus;
+    struct mic_hub mic_hub;
+    struct simcom_tx_fifo simcom_tx_fifo;
+    struct simcom_attach simcom_attach;
+    struct simcom_call simcom_call;
 };
 
 struct stream_out {
@@ -381,20 +652,23 @@ struct stream_out {
     struct resampler_itfe *resampler;
     // for hdmi bitstream
     char* channel_buffer;
+    int   channel_pos;      /* next subframe's entry in channel_buffer */
     char* bitstream_buffer;
+    size_t bitstream_buffer_size;
 
-    struct hdmi_audio_infors hdmi_audio;
+    /* per card writers, only used when more than one pcm is open */
+    struct out_card_writer writers[SND_OUT_SOUND_CARD_MAX];
+    bool   fanout;
 
-    bool   snd_reopen;
+    /* raised by adev_set_parameters() on hdmi connect, consumed by out_write() */
+    atomic_bool snd_reopen;
     bool   is_simcom_voice;
     bool   bypass_pcm;
     bool   simcom_attached;
+    bool   simcom_rate_pinned;  /* sized for adev->simcom_rate at open */
 
     uint32_t requested_rate;
-    struct resampler_itfe *simcom_resampler;
-    uint32_t simcom_resampler_in_rate;
-    int16_t *simcom_resampler_buffer;
-    size_t simcom_resampler_buffer_frames;
+    struct simcom_uplink simcom_uplink;
 };
 
 struct stream_in {
@@ -419,6 +693,7 @@ struct stream_in {
     audio_channel_mask_t channel_mask;
     audio_input_flags_t flags;
     struct pcm_config *config;
+    struct channel_map channel_map;  /* config->channels to channel_mask, in in->buffer */
 
     struct audio_device *dev;
     audio_channel_mask_t supported_channel_masks[MAX_SUPPORTED_CHANNEL_MASKS + 1];
@@ -427,14 +702,21 @@ struct stream_in {
     SpeexPreprocessState* mSpeexState;
     int mSpeexFrameSize;
     int16_t *mSpeexPcmIn;
+    bool speex_async;
+    struct speex_worker speex_worker;
 #endif
     bool is_simcom_voice;
     bool bypass_pcm;
     bool simcom_attached;
-    uint32_t simcom_rx_last_gen;
-    struct resampler_itfe *simcom_resampler;
-    int16_t *simcom_resampler_buffer;
-    size_t simcom_resampler_buffer_size;
+    bool simcom_rate_pinned;    /* sized for adev->simcom_rate at open */
+    uint64_t simcom_rx_cursor;
+    uint64_t simcom_rx_lost_bytes;  /* reported and cleared by in_get_input_frames_lost() */
+    bool mic_hub_attached;
+    uint64_t mic_cursor;
+    uint64_t mic_lost_bytes;        /* reported and cleared by in_get_input_frames_lost() */
+    uint64_t frames_read;           /* since the stream left standby, for get_capture_position() */
+    struct simcom_plc simcom_plc;
+    struct simcom_uplink simcom_uplink;
 };
 
 #define STRING_TO_ENUM(string) { #string, string }
@@ -369,23 +369,19 @@ int get_hdmi_audio_speaker_allocation(struct hdmi_audio_infors *infor)
     return layout;
 }
 
-int parse_hdmi_audio(struct hdmi_audio_infors *infor)
+/*
+ * read the raw EDID, base block and extensions, into edid
+ * return the number of bytes read, 0 if the node is empty
+ */
+static int hdmi_edid_read(unsigned char *edid, int size)
 {
-    if(infor == NULL) {
-        ALOGD("%s: error, input parameter is NULL",__FUNCTION__);
-        return -1;
-    }
-
     FILE* file = fopen(HDMI_EDID_NODE,"rb");
     if(file == NULL) {
         ALOGVV("%s: open %s fail,reason = %s",__FUNCTION__,HDMI_EDID_NODE,strerror(errno));
         return -1;
     }
-    pthread_mutex_lock(&infor->lock);
-    // there is 128 bytes in every block
-    unsigned char buffer[HDMI_EDID_BLOCK_SIZE];
-    memset(buffer, 0, HDMI_EDID_BLOCK_SIZE);
-    int size = 0;
+
+    int total = 0;
     int retry = 20;
     do{
         /*
@@ -394,43 +390,215 @@ int parse_hdmi_audio(struct hdmi_audio_infors *infor)
          * May be this is no information in Node HDMI_EDID_NODE,
          * so if read fail ,we retry to read.
          */
-        size = fread(buffer, 1, HDMI_EDID_BLOCK_SIZE, file);
-        if(size == 0){
+        total = fread(edid, 1, HDMI_EDID_BLOCK_SIZE, file);
+        if(total == 0){
             usleep(20000);
             retry --;
         }
-    }while((size==0) && (retry>0));
-    ALOGVV("%s: %d: size = %d",__FUNCTION__,__LINE__,size);
-    int extendblock = 0;
-    int i = 0;
-
-    // parse base block, we just need the information of the numbers of extend block
-    hdmi_parse_base_block(buffer, &extendblock);
-    ALOGVV("%s: %d: extendblock = %d",__FUNCTION__,__LINE__,extendblock);
-    // paser extend block
-    if(extendblock > 0) {
-        for (i = 1; (i < extendblock + 1) && (i < HDMI_MAX_EDID_BLOCK); i++) {
-            memset(buffer, 0, HDMI_EDID_BLOCK_SIZE);
-            size = fread(buffer, 1, HDMI_EDID_BLOCK_SIZE, file);
-            if(size > 0) {
-                hdmi_edid_parse_extensions(buffer,infor);
-            } else {
+    }while((total==0) && (retry>0));
+
+    if (total == HDMI_EDID_BLOCK_SIZE) {
+        int extendblock = 0;
+        // parse base block, we just need the information of the numbers of extend block
+        hdmi_parse_base_block(edid, &extendblock);
+        for (int i = 1; (i < extendblock + 1) && (i < HDMI_MAX_EDID_BLOCK) &&
+                (total + HDMI_EDID_BLOCK_SIZE <= size); i++) {
+            int got = fread(edid + total, 1, HDMI_EDID_BLOCK_SIZE, file);
+            if (got != HDMI_EDID_BLOCK_SIZE)
                 break;
-            }
+            total += got;
         }
     }
+    fclose(file);
+    ALOGVV("%s: %d: size = %d",__FUNCTION__,__LINE__,total);
+
+    return total;
+}
+
+/*
+ * parse the extension blocks of a raw EDID into infor, must hold infor->lock
+ */
+static void hdmi_edid_parse(unsigned char *edid, int size, struct hdmi_audio_infors *infor)
+{
+    for (int offset = HDMI_EDID_BLOCK_SIZE; offset + HDMI_EDID_BLOCK_SIZE <= size;
+            offset += HDMI_EDID_BLOCK_SIZE) {
+        hdmi_edid_parse_extensions(edid + offset, infor);
+    }
+}
+
+int parse_hdmi_audio(struct hdmi_audio_infors *infor)
+{
+    if(infor == NULL) {
+        ALOGD("%s: error, input parameter is NULL",__FUNCTION__);
+        return -1;
+    }
+
+    unsigned char edid[HDMI_EDID_BLOCK_SIZE * HDMI_MAX_EDID_BLOCK];
+    memset(edid, 0, sizeof(edid));
+    int size = hdmi_edid_read(edid, sizeof(edid));
+    if (size < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&infor->lock);
+    hdmi_edid_parse(edid, size, infor);
     pthread_mutex_unlock(&infor->lock);
 
     dump(infor);
-EXIT:
-    if(file != NULL) {
-        fclose(file);
-        file = NULL;
+    return 0;
+}
+
+/* FNV-1a, only used to tell whether the sink changed */
+static uint32_t hdmi_edid_hash(const unsigned char *edid, int size)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < size; i++) {
+        hash ^= edid[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
+
+void hdmi_edid_cache_init(struct hdmi_edid_cache *cache)
+{
+    pthread_mutex_init(&cache->lock, NULL);
+    atomic_init(&cache->generation, 0);
+    cache->read_generation = 0;
+    cache->valid = false;
+    cache->hash = 0;
+    cache->size = 0;
+    init_hdmi_audio(&cache->infor);
+    cache->caps = NULL;
+}
+
+void hdmi_edid_cache_release(struct hdmi_edid_cache *cache)
+{
+    free(cache->caps);
+    cache->caps = NULL;
+    destory_hdmi_audio(&cache->infor);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+bool is_support_ac4(int type,int support);
+
+/*
+ * fold the descriptors of infor into a capability table, must hold infor->lock
+ */
+static struct hdmi_audio_caps *hdmi_audio_caps_build(struct hdmi_audio_infors *infor)
+{
+    struct hdmi_audio_caps *caps = calloc(1, sizeof(*caps));
+    if (caps == NULL) {
+        ALOGD("%s: malloc hdmi_audio_caps fail",__FUNCTION__);
+        return NULL;
+    }
+
+    for (int i = 0; i < infor->number && infor->audio != NULL; i++) {
+        const struct hdmi_audio_information *audio = &infor->audio[i];
+        int type = audio->type & (HDMI_AUDIO_TYPE_MAX - 1);
+
+        if (type == HDMI_AUDIO_NLPCM)
+            continue;
+        caps->types |= 1u << type;
+        if (is_support_ac4(type, audio->value))
+            caps->ac4 = true;
+    }
+
+    caps->speaker_allocation = AUDIO_CHANNEL_OUT_STEREO;
+    if (infor->channel_layout != -1) {
+        int layout = AUDIO_CHANNEL_NONE;
+        for (int i = 0; i < (int)ARRAY_SIZE(HDMI_SPEAKER_ALLOCATION_TABLE); i++) {
+            if (infor->channel_layout & HDMI_SPEAKER_ALLOCATION_TABLE[i].index)
+                layout |= HDMI_SPEAKER_ALLOCATION_TABLE[i].location;
+        }
+        caps->speaker_allocation = layout;
+    }
+
+    return caps;
+}
+
+/*
+ * the sink may have changed, cheap enough for the uevent thread
+ */
+void hdmi_edid_cache_invalidate(struct hdmi_edid_cache *cache)
+{
+    atomic_fetch_add(&cache->generation, 1);
+}
+
+/*
+ * read the EDID again if a hotplug happened since the last read, and parse
+ * it only if its bytes changed, must hold cache->lock
+ * return 0, or -1 if the EDID can't be read
+ */
+static int hdmi_edid_cache_refresh_l(struct hdmi_edid_cache *cache)
+{
+    unsigned int generation = atomic_load(&cache->generation);
+
+    if (cache->valid && cache->read_generation == generation)
+        return 0;
+
+    unsigned char edid[HDMI_EDID_BLOCK_SIZE * HDMI_MAX_EDID_BLOCK];
+    memset(edid, 0, sizeof(edid));
+    int size = hdmi_edid_read(edid, sizeof(edid));
+    if (size < 0) {
+        /* keep the last table, the next query tries again */
+        ALOGW("%s: can't read the EDID", __FUNCTION__);
+        return -1;
+    }
+
+    uint32_t hash = hdmi_edid_hash(edid, size);
+    if (!cache->valid || hash != cache->hash || size != cache->size) {
+        pthread_mutex_lock(&cache->infor.lock);
+        free(cache->infor.audio);
+        cache->infor.audio = NULL;
+        cache->infor.number = 0;
+        cache->infor.channel_layout = -1;
+        hdmi_edid_parse(edid, size, &cache->infor);
+        struct hdmi_audio_caps *caps = hdmi_audio_caps_build(&cache->infor);
+        pthread_mutex_unlock(&cache->infor.lock);
+        if (caps != NULL) {
+            /* every reader holds cache->lock, nobody is looking at the old table */
+            free(cache->caps);
+            cache->caps = caps;
+        }
+        cache->hash = hash;
+        cache->size = size;
+        ALOGD("%s: parsed %d bytes of EDID, hash 0x%08x", __FUNCTION__, size, hash);
+        dump(&cache->infor);
+    }
+    cache->read_generation = generation;
+    cache->valid = true;
 
     return 0;
 }
 
+int hdmi_edid_cache_refresh(struct hdmi_edid_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    int ret = hdmi_edid_cache_refresh_l(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+/*
+ * the capability table of the connected sink, read again first if a hotplug
+ * happened since the EDID was last read. Returns with cache->lock held so the
+ * table can't be freed during the query, hdmi_edid_cache_put_caps() ends it.
+ * NULL only if the EDID was never read or out of memory.
+ */
+const struct hdmi_audio_caps *hdmi_edid_cache_get_caps(struct hdmi_edid_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    hdmi_edid_cache_refresh_l(cache);
+    return cache->caps;
+}
+
+void hdmi_edid_cache_put_caps(struct hdmi_edid_cache *cache)
+{
+    pthread_mutex_unlock(&cache->lock);
+}
+
 int translate_format(audio_format_t format)
 {
     int type = (int)HDMI_AUDIO_FORMAT_INVALID;
@@ -501,6 +669,35 @@ bool is_support_format(struct hdmi_audio_infors *infor,audio_format_t format)
     return support;
 }
 
+bool hdmi_caps_support_format(const struct hdmi_audio_caps *caps, audio_format_t format)
+{
+    if (caps == NULL) {
+        return false;
+    }
+
+    // AC4 have the same value with EAC3, only the byte3 of cea_audio tells them apart
+    if (format == AUDIO_FORMAT_AC4) {
+        return caps->ac4;
+    }
+
+    int type = translate_format(format);
+    if (type == (int)HDMI_AUDIO_FORMAT_INVALID) {
+        return false;
+    }
+    return (caps->types & (1u << type)) != 0;
+}
+
+/*
+ * same as get_hdmi_audio_speaker_allocation() on the cached table
+ */
+int hdmi_caps_speaker_allocation(const struct hdmi_audio_caps *caps)
+{
+    if (caps == NULL) {
+        return AUDIO_CHANNEL_OUT_STEREO;
+    }
+    return caps->speaker_allocation;
+}
+
 void dump_hdmi_audio_sample(int index,char*name,int size)
 {
     int i = 0;
@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <system/audio.h>
 #include <pthread.h>
 
@@ -87,10 +89,48 @@ struct hdmi_audio_infors {
     struct hdmi_audio_information* audio;
 };
 
+/* hdmi_audio_type is the 4 bit audio format code of a short audio descriptor */
+#define HDMI_AUDIO_TYPE_MAX     16
+
+/*
+ * capabilities of one sink folded per hdmi_audio_type, built once per parse
+ * and never modified; a query holds the cache lock, so a reparse can free the
+ * table it replaces right away
+ */
+struct hdmi_audio_caps {
+    uint32_t types;                                 /* bit per hdmi_audio_type */
+    bool ac4;                                       /* an E-AC3 descriptor accepts AC4 */
+    int speaker_allocation;                         /* audio_channel_mask_t */
+};
+
+/*
+ * the parsed audio capabilities of the connected sink, shared by all streams.
+ * The EDID is only read again after hdmi_edid_cache_invalidate(), and only
+ * parsed again if its hash changed.
+ */
+struct hdmi_edid_cache {
+    pthread_mutex_t lock;
+    atomic_uint generation;         /* bumped on every hotplug */
+    unsigned int read_generation;   /* generation the EDID was last read at */
+    bool valid;
+    uint32_t hash;                  /* of the raw EDID bytes */
+    int size;
+    struct hdmi_audio_infors infor;
+    struct hdmi_audio_caps *caps;   /* replaced under lock after each parse */
+};
+
 extern void init_hdmi_audio(struct hdmi_audio_infors *infor);
 extern int parse_hdmi_audio(struct hdmi_audio_infors *audios);
 extern int get_hdmi_audio_speaker_allocation(struct hdmi_audio_infors *infor);
 extern bool is_support_format(struct hdmi_audio_infors *infor,audio_format_t format);
 extern void destory_hdmi_audio(struct hdmi_audio_infors *infor);
 extern void dump(struct hdmi_audio_infors *infor);
+extern void hdmi_edid_cache_init(struct hdmi_edid_cache *cache);
+extern void hdmi_edid_cache_release(struct hdmi_edid_cache *cache);
+extern void hdmi_edid_cache_invalidate(struct hdmi_edid_cache *cache);
+extern int hdmi_edid_cache_refresh(struct hdmi_edid_cache *cache);
+extern const struct hdmi_audio_caps *hdmi_edid_cache_get_caps(struct hdmi_edid_cache *cache);
+extern void hdmi_edid_cache_put_caps(struct hdmi_edid_cache *cache);
+extern bool hdmi_caps_support_format(const struct hdmi_audio_caps *caps, audio_format_t format);
+extern int hdmi_caps_speaker_allocation(const struct hdmi_audio_caps *caps);
 #endif
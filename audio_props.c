@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * @file audio_props.c
+ * @brief cached vendor properties for the audio data path
+ */
+
+#define LOG_TAG "audio_props"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <sys/system_properties.h>
+
+#include "audio_props.h"
+
+struct audio_prop_desc {
+    const char *name;
+    const char *def;
+    int (*parse)(const char *value);
+};
+
+static int parse_true(const char *value)
+{
+    return !strcasecmp(value, "true");
+}
+
+/* vendor.vts_test was always compared case sensitively */
+static int parse_true_exact(const char *value)
+{
+    return !strcmp(value, "true");
+}
+
+static int parse_int(const char *value)
+{
+    return atoi(value);
+}
+
+static int parse_hdmiin_rate(const char *value)
+{
+    int rate;
+
+    if (!strncmp(value, "32KHZ", strlen("32KHZ")))
+        return 32000;
+    if (!strncmp(value, "44.1KHZ", strlen("44.1KHZ")))
+        return 44100;
+    if (!strncmp(value, "48KHZ", strlen("48KHZ")))
+        return 48000;
+    rate = atoi(value);
+    return rate > 0 ? rate : 44100;
+}
+
+static const struct audio_prop_desc prop_table[AUDIO_PROP_COUNT] = {
+    [AUDIO_PROP_MUTE]        = { "vendor.audio.mute",       "false",   parse_true },
+    [AUDIO_PROP_RECORD]      = { "vendor.audio.record",     "0",       parse_int },
+    [AUDIO_PROP_RECORD_IN]   = { "vendor.audio.record.in",  "0",       parse_int },
+    [AUDIO_PROP_HDMIIN_RATE] = { "vendor.hdmiin.audiorate", "44.1KHZ", parse_hdmiin_rate },
+    [AUDIO_PROP_VTS_TEST]    = { "vendor.vts_test",         "false",   parse_true_exact },
+};
+
+static struct {
+    pthread_mutex_t lock;       /* serializes init/release */
+    int users;
+    pthread_t thread;
+    bool running;
+    atomic_bool exit;
+    atomic_int values[AUDIO_PROP_COUNT];
+} props = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void audio_props_refresh(enum audio_prop_id id)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(prop_table[id].name, value, prop_table[id].def);
+    atomic_store_explicit(&props.values[id], prop_table[id].parse(value),
+                          memory_order_relaxed);
+}
+
+static void audio_props_refresh_all(void)
+{
+    int i;
+
+    for (i = 0; i < AUDIO_PROP_COUNT; i++)
+        audio_props_refresh((enum audio_prop_id)i);
+}
+
+/**
+ * @brief audio_props_watch
+ * wait on the global property serial, which moves whenever any property is set,
+ * and re-read the table. The timeout only bounds how long release() waits.
+ */
+static void *audio_props_watch(void *arg)
+{
+    uint32_t serial = __system_property_area_serial();
+
+    /* values may have changed between init() and the serial read above */
+    audio_props_refresh_all();
+    while (!atomic_load(&props.exit)) {
+        struct timespec timeout = { 1, 0 };
+        uint32_t new_serial;
+
+        if (!__system_property_wait(NULL, serial, &new_serial, &timeout))
+            continue;
+        serial = new_serial;
+        audio_props_refresh_all();
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief audio_props_init
+ * load the snapshot and start the watcher, reference counted
+ *
+ * @returns 0 on success, the snapshot stays usable even if the watcher fails
+ */
+int audio_props_init(void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&props.lock);
+    if (props.users++ == 0) {
+        audio_props_refresh_all();
+        atomic_store(&props.exit, false);
+        ret = -pthread_create(&props.thread, NULL, audio_props_watch, NULL);
+        props.running = (ret == 0);
+        if (ret)
+            ALOGW("%s: watcher not started (%d), properties read on demand", __FUNCTION__, ret);
+    }
+    pthread_mutex_unlock(&props.lock);
+
+    return ret;
+}
+
+void audio_props_release(void)
+{
+    pthread_mutex_lock(&props.lock);
+    if (props.users > 0 && --props.users == 0 && props.running) {
+        atomic_store(&props.exit, true);
+        pthread_join(props.thread, NULL);
+        props.running = false;
+    }
+    pthread_mutex_unlock(&props.lock);
+}
+
+/**
+ * @brief audio_props_get
+ *
+ * @param id
+ *
+ * @returns parsed value of the property, see enum audio_prop_id
+ */
+int audio_props_get(enum audio_prop_id id)
+{
+    if (id < 0 || id >= AUDIO_PROP_COUNT)
+        return 0;
+    /* no watcher: fall back to a direct read so changes are still seen */
+    if (!props.running)
+        audio_props_refresh(id);
+    return atomic_load_explicit(&props.values[id], memory_order_relaxed);
+}
+
+/**
+ * @brief audio_props_set
+ * set the property and update the snapshot at once, so the caller
+ * does not see its own stale value until the watcher catches up
+ *
+ * @param id
+ * @param value
+ */
+void audio_props_set(enum audio_prop_id id, const char *value)
+{
+    if (id < 0 || id >= AUDIO_PROP_COUNT || value == NULL)
+        return;
+    property_set(prop_table[id].name, value);
+    atomic_store_explicit(&props.values[id], prop_table[id].parse(value),
+                          memory_order_relaxed);
+}
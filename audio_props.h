@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file audio_props.h
+ * @brief snapshot of the vendor properties read on the audio data path.
+ * property_get() is a lookup in the bionic property area on every call, too much
+ * for once per period; readers here only load an atomic int that a watcher thread
+ * refreshes whenever the property area serial changes.
+ */
+
+#ifndef AUDIO_PROPS_H
+#define AUDIO_PROPS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum audio_prop_id {
+    AUDIO_PROP_MUTE,            /* vendor.audio.mute, 1 if "true" */
+    AUDIO_PROP_RECORD,          /* vendor.audio.record, playback dump size in MB */
+    AUDIO_PROP_RECORD_IN,       /* vendor.audio.record.in, capture dump size in MB */
+    AUDIO_PROP_HDMIIN_RATE,     /* vendor.hdmiin.audiorate, in Hz */
+    AUDIO_PROP_VTS_TEST,        /* vendor.vts_test, 1 if "true" */
+    AUDIO_PROP_COUNT,
+};
+
+int audio_props_init(void);
+void audio_props_release(void);
+int audio_props_get(enum audio_prop_id id);
+void audio_props_set(enum audio_prop_id id, const char *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,6 +33,7 @@
 #include <dlfcn.h>  // for dlopen/dlclose
 #include <fcntl.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
@@ -44,12 +45,15 @@
 
 
 #include "voice_preprocess.h"
+#include "audio_props.h"
 
 #define LOG_TAG "voice_process"
 
 
-#define MAX_BUFFER_SIZE (500 * 1024)
 #define PROCESS_BUFFER_SIZE (256)
+/* default for persist.vendor.audio.3a.latency_ms, the depth of the process queues */
+#define QUEUE_LATENCY_MS (200)
+#define QUEUE_LATENCY_MS_MAX (1000)
 #define FILE_PATH "/etc/RK_VoicePara.bin"
 #define false (0)
 #define true  (1)
@@ -68,12 +72,23 @@ typedef struct voiceThread_t_ {
     pthread_t       thread;
     sem_t           sem;
     int             threadStatus;
-    pthread_mutex_t queueCapLock;
-    pthread_mutex_t queuePlyLock;
-    pthread_mutex_t getCapOutLock;
-    pthread_mutex_t getPlyOutLock;
 } voiceThread_t;
 
+/*
+ * single producer single consumer byte queue, size is a power of two.
+ * wr and rd are free running, only the producer moves wr and only the
+ * consumer moves rd. Other threads ask for a flush by bumping flushReq,
+ * the consumer drops the queued data on its next read.
+ */
+typedef struct voiceRing_t_ {
+    char*           data;
+    unsigned int    size;
+    atomic_uint     wr;
+    atomic_uint     rd;
+    atomic_uint     flushReq;
+    unsigned int    flushSeen;  /* consumer only */
+} voiceRing_t;
+
 typedef struct rk_voice_api_ {
     int (*init)(char *para);
     void  (*processCapture)(short  *in, short *ref, short *out, int len);
@@ -86,19 +101,15 @@ typedef struct rk_voice_handle_ {
     void*   voiceLibHandle;
     rk_voice_api *voiceApi;
     rk_process_api *processApi;
-    char*  playBackBuffer;
-    char*  captureBuffer;
-    char*  outPlayBuffer;
-    char*  outCaptureBuffer;
+    voiceRing_t playBackRing;
+    voiceRing_t captureRing;
+    voiceRing_t outPlayRing;
+    voiceRing_t outCaptureRing;
     SpeexResamplerState* speexCapureDownResample;
     SpeexResamplerState* speexCapureUpResample;
     SpeexResamplerState* speexPlaybackDownResample;
     SpeexResamplerState* speexPlaybackUpResample;
     voiceThread_t voice_thread;
-    int    playbackBufferSize;
-    int    captureBufferSize;
-    int    outPlaybackBufferSize;
-    int    outCaptureBufferSize;
     int    captureInSamplerate;
     int    processSamplerate;
     int    playbackInSamplerate;
@@ -142,6 +153,92 @@ static inline rk_voice_handle* getHandle()
     return voice_handle;
 }
 
+static int ringInit(voiceRing_t *ring, int minSize)
+{
+    unsigned int size = 1;
+
+    while (size < (unsigned int)minSize)
+        size <<= 1;
+
+    ring->data = (char *)malloc(size);
+    ring->size = ring->data ? size : 0;
+    atomic_init(&ring->wr, 0);
+    atomic_init(&ring->rd, 0);
+    atomic_init(&ring->flushReq, 0);
+    ring->flushSeen = 0;
+    return ring->data ? 0 : -ENOMEM;
+}
+
+static void ringFree(voiceRing_t *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+    ring->size = 0;
+}
+
+static inline unsigned int ringAvail(voiceRing_t *ring)
+{
+    return atomic_load_explicit(&ring->wr, memory_order_acquire) -
+           atomic_load_explicit(&ring->rd, memory_order_relaxed);
+}
+
+/* producer side, never overwrites unread data */
+static int ringWrite(voiceRing_t *ring, const char *buf, int size)
+{
+    unsigned int wr = atomic_load_explicit(&ring->wr, memory_order_relaxed);
+    unsigned int rd = atomic_load_explicit(&ring->rd, memory_order_acquire);
+    unsigned int pos = wr & (ring->size - 1);
+    unsigned int first = ring->size - pos;
+
+    if (ring->size - (wr - rd) < (unsigned int)size)
+        return -1;
+
+    if (first > (unsigned int)size)
+        first = size;
+    memcpy(ring->data + pos, buf, first);
+    memcpy(ring->data, buf + first, size - first);
+    atomic_store_explicit(&ring->wr, wr + size, memory_order_release);
+    return 0;
+}
+
+/* consumer side, applies a pending flush first so rd keeps a single writer */
+static int ringRead(voiceRing_t *ring, char *buf, int size)
+{
+    unsigned int req = atomic_load_explicit(&ring->flushReq, memory_order_acquire);
+    unsigned int rd = atomic_load_explicit(&ring->rd, memory_order_relaxed);
+    unsigned int wr = atomic_load_explicit(&ring->wr, memory_order_acquire);
+
+    if (req != ring->flushSeen) {
+        ring->flushSeen = req;
+        rd = wr;
+        atomic_store_explicit(&ring->rd, rd, memory_order_release);
+    }
+    unsigned int pos = rd & (ring->size - 1);
+    unsigned int first = ring->size - pos;
+
+    if (wr - rd < (unsigned int)size)
+        return -1;
+
+    if (first > (unsigned int)size)
+        first = size;
+    memcpy(buf, ring->data + pos, first);
+    memcpy(buf + first, ring->data, size - first);
+    atomic_store_explicit(&ring->rd, rd + size, memory_order_release);
+    return 0;
+}
+
+/* any thread, the consumer drops everything queued on its next ringRead() */
+static void ringFlush(voiceRing_t *ring)
+{
+    atomic_fetch_add_explicit(&ring->flushReq, 1, memory_order_release);
+}
+
+static inline bool isBlockReady(rk_voice_handle* voiceHandle)
+{
+    return (ringAvail(&voiceHandle->captureRing) >= (unsigned int)voiceHandle->minCaptureBuffersize)
+           && (ringAvail(&voiceHandle->playBackRing) >= (unsigned int)voiceHandle->minPlaybackBuffersize);
+}
+
 
 static int start()
 {
@@ -162,24 +259,16 @@ static int queueCaputureBuffer(void *buf, int size)
 {
     rk_voice_handle* voiceHandle = getHandle();
 
-    if (voiceHandle->playbackBufferSize <= 0) {
+    if (ringAvail(&voiceHandle->playBackRing) == 0) {
         ALOGV("not queue capture buffer until playback buffer queued");
         return -1;
     }
 
-    pthread_mutex_lock(&voiceHandle->voice_thread.queueCapLock);
-    if (voiceHandle->captureBufferSize + size >= MAX_BUFFER_SIZE) {
-        ALOGW("capture buffer size out of range, flush");
-        memset(voiceHandle->captureBuffer, 0x00, MAX_BUFFER_SIZE);
-        voiceHandle->captureBufferSize = 0;
+    if (ringWrite(&voiceHandle->captureRing, (char *)buf, size) < 0) {
+        ALOGW("capture buffer size out of range, drop %d bytes", size);
     }
-    memcpy((char *)voiceHandle->captureBuffer + voiceHandle->captureBufferSize, (char *)buf, size);
-    voiceHandle->captureBufferSize += size;
-    pthread_mutex_unlock(&voiceHandle->voice_thread.queueCapLock);
-
 
-    if ((voiceHandle->captureBufferSize >= voiceHandle->minCaptureBuffersize)
-            && (voiceHandle->playbackBufferSize >= voiceHandle->minPlaybackBuffersize)) {
+    if (isBlockReady(voiceHandle)) {
         sem_post(&voiceHandle->voice_thread.sem);
     }
     return 0;
@@ -189,18 +278,11 @@ static int queuePlaybackBuffer(void *buf, int size)
 {
     rk_voice_handle* voiceHandle = getHandle();
 
-    pthread_mutex_lock(&voiceHandle->voice_thread.queuePlyLock);
-    if (voiceHandle->playbackBufferSize + size >= MAX_BUFFER_SIZE) {
-        ALOGW("capture buffer size out of range, flush");
-        memset(voiceHandle->playBackBuffer, 0x00, MAX_BUFFER_SIZE);
-        voiceHandle->playbackBufferSize = 0;
+    if (ringWrite(&voiceHandle->playBackRing, (char *)buf, size) < 0) {
+        ALOGW("playback buffer size out of range, drop %d bytes", size);
     }
-    memcpy((char *)voiceHandle->playBackBuffer+ voiceHandle->playbackBufferSize, (char *)buf, size);
-    voiceHandle->playbackBufferSize+= size;
-    pthread_mutex_unlock(&voiceHandle->voice_thread.queuePlyLock);
 
-    if ((voiceHandle->captureBufferSize >= voiceHandle->minCaptureBuffersize)
-            && (voiceHandle->playbackBufferSize >= voiceHandle->minPlaybackBuffersize)) {
+    if (isBlockReady(voiceHandle)) {
         sem_post(&voiceHandle->voice_thread.sem);
     }
     return 0;
@@ -210,15 +292,10 @@ static int getCapureBuffer(void *buf, int size)
 {
     rk_voice_handle* voiceHandle = getHandle();
 
-    if (voiceHandle->outCaptureBufferSize < size) {
+    if (ringRead(&voiceHandle->outCaptureRing, (char *)buf, size) < 0) {
         ALOGW("cannot get caputre buffer currently, try next time");
         return -1;
     }
-    pthread_mutex_lock(&voiceHandle->voice_thread.getCapOutLock);
-    memcpy((char *)buf, voiceHandle->outCaptureBuffer, size);
-    memcpy(voiceHandle->outCaptureBuffer, voiceHandle->outCaptureBuffer+size, MAX_BUFFER_SIZE-size);
-    voiceHandle->outCaptureBufferSize -= size;
-    pthread_mutex_unlock(&voiceHandle->voice_thread.getCapOutLock);
     return 0;
 }
 
@@ -226,16 +303,10 @@ static int getPlaybackBuffer(void *buf, int size)
 {
     rk_voice_handle* voiceHandle = getHandle();
 
-    if (voiceHandle->outPlaybackBufferSize < size) {
+    if (ringRead(&voiceHandle->outPlayRing, (char *)buf, size) < 0) {
         ALOGW("cannot get playback buffer currently, try next time");
         return -1;
     }
-    pthread_mutex_lock(&voiceHandle->voice_thread.getPlyOutLock);
-    memcpy((char *)buf, (char *)voiceHandle->outPlayBuffer, size);
-    memcpy((char *)voiceHandle->outPlayBuffer, (char *)voiceHandle->outPlayBuffer+size, MAX_BUFFER_SIZE-size);
-    voiceHandle->outPlaybackBufferSize -= size;
-    pthread_mutex_unlock(&voiceHandle->voice_thread.getPlyOutLock);
-
     return 0;
 }
 
@@ -243,15 +314,8 @@ static int flush()
 {
     rk_voice_handle* voiceHandle = getHandle();
 
-    pthread_mutex_lock(&voiceHandle->voice_thread.queuePlyLock);
-    memset((char *)voiceHandle->playBackBuffer, 0x00, MAX_BUFFER_SIZE);
-    voiceHandle->playbackBufferSize = 0;
-    pthread_mutex_unlock(&voiceHandle->voice_thread.queuePlyLock);
-
-    pthread_mutex_lock(&voiceHandle->voice_thread.queueCapLock);
-    memset((char *)voiceHandle->captureBuffer, 0x00, MAX_BUFFER_SIZE);
-    voiceHandle->captureBufferSize = 0;
-    pthread_mutex_unlock(&voiceHandle->voice_thread.queueCapLock);
+    ringFlush(&voiceHandle->playBackRing);
+    ringFlush(&voiceHandle->captureRing);
 
     return 0;
 }
@@ -274,16 +338,14 @@ rk_process_api* rk_voiceprocess_create(int ply_sr, int ply_ch, int cap_sr, int c
     voice_handle->voiceLibHandle        = NULL;
     voice_handle->voiceApi              = NULL;
     voice_handle->processApi            = NULL;
-    voice_handle->playBackBuffer        = NULL;
-    voice_handle->captureBuffer         = NULL;
+    memset(&voice_handle->playBackRing, 0, sizeof(voiceRing_t));
+    memset(&voice_handle->captureRing, 0, sizeof(voiceRing_t));
+    memset(&voice_handle->outPlayRing, 0, sizeof(voiceRing_t));
+    memset(&voice_handle->outCaptureRing, 0, sizeof(voiceRing_t));
     voice_handle->speexCapureDownResample   = NULL;
     voice_handle->speexCapureUpResample     = NULL;
     voice_handle->speexPlaybackDownResample = NULL;
     voice_handle->speexPlaybackUpResample   = NULL;
-    voice_handle->playbackBufferSize     = 0;
-    voice_handle->captureBufferSize      = 0;
-    voice_handle->outPlaybackBufferSize  = 0;
-    voice_handle->outCaptureBufferSize   = 0;
     voice_handle->captureInSamplerate    = cap_sr;
     voice_handle->processSamplerate      = 16000;
     voice_handle->playbackInSamplerate   = ply_sr;
@@ -349,22 +411,26 @@ rk_process_api* rk_voiceprocess_create(int ply_sr, int ply_ch, int cap_sr, int c
     voice_handle->processApi->quueCaputureBuffer = queueCaputureBuffer;
     voice_handle->processApi->flush = flush;
 
-    // malloc process buffers
-    voice_handle->playBackBuffer = (char *)malloc(MAX_BUFFER_SIZE);
-    voice_handle->captureBuffer = (char *)malloc(MAX_BUFFER_SIZE);
-    voice_handle->outPlayBuffer = (char *)malloc(MAX_BUFFER_SIZE);
-    voice_handle->outCaptureBuffer = (char *)malloc(MAX_BUFFER_SIZE);
-
-    if ((voice_handle->playBackBuffer == NULL) || (voice_handle->captureBuffer == NULL)
-            ||(voice_handle->outPlayBuffer == NULL) || (voice_handle->outCaptureBuffer == NULL)) {
+    // malloc process queues, the configured latency of audio but at least a few process blocks
+    int latencyMs = property_get_int32("persist.vendor.audio.3a.latency_ms", QUEUE_LATENCY_MS);
+    if (latencyMs <= 0 || latencyMs > QUEUE_LATENCY_MS_MAX)
+        latencyMs = QUEUE_LATENCY_MS;
+    int playbackQueueSize = ply_sr * ply_ch * 2 / 1000 * latencyMs;
+    int captureQueueSize = cap_sr * cap_ch * 2 / 1000 * latencyMs;
+    if (playbackQueueSize < voice_handle->minPlaybackBuffersize * 4)
+        playbackQueueSize = voice_handle->minPlaybackBuffersize * 4;
+    if (captureQueueSize < voice_handle->minCaptureBuffersize * 4)
+        captureQueueSize = voice_handle->minCaptureBuffersize * 4;
+
+    if ((ringInit(&voice_handle->playBackRing, playbackQueueSize) < 0)
+            || (ringInit(&voice_handle->captureRing, captureQueueSize) < 0)
+            || (ringInit(&voice_handle->outPlayRing, playbackQueueSize) < 0)
+            || (ringInit(&voice_handle->outCaptureRing, captureQueueSize) < 0)) {
         ALOGE("malloc playback or capure buffer falied!");
         goto failed;
     }
-
-    pthread_mutex_init(&voice_handle->voice_thread.queuePlyLock, NULL);
-    pthread_mutex_init(&voice_handle->voice_thread.queueCapLock, NULL);
-    pthread_mutex_init(&voice_handle->voice_thread.getCapOutLock, NULL);
-    pthread_mutex_init(&voice_handle->voice_thread.getPlyOutLock, NULL);
+    ALOGD("voice process queues: %d ms, playback %u bytes, capture %u bytes", latencyMs,
+          voice_handle->playBackRing.size, voice_handle->captureRing.size);
 
     if (voice_handle->captureInSamplerate != voice_handle->processSamplerate) {
         voice_handle->speexCapureDownResample = speex_resampler_init(1, voice_handle->captureInSamplerate, voice_handle->processSamplerate, SPEEX_RESAMPLER_QUALITY_DESKTOP, NULL);
@@ -426,37 +492,10 @@ int rk_voiceprocess_destory()
         voice_handle->speexPlaybackDownResample = NULL;
     }
 
-    if (voice_handle->playBackBuffer != NULL) {
-        pthread_mutex_lock(&voice_handle->voice_thread.queuePlyLock);
-        free(voice_handle->playBackBuffer);
-        voice_handle->playBackBuffer = NULL;
-        voice_handle->playbackBufferSize = 0;
-        pthread_mutex_unlock(&voice_handle->voice_thread.queuePlyLock);
-    }
-
-    if (voice_handle->captureBuffer != NULL) {
-        pthread_mutex_lock(&voice_handle->voice_thread.queueCapLock);
-        free(voice_handle->captureBuffer);
-        voice_handle->captureBuffer = NULL;
-        voice_handle->captureBufferSize = 0;
-        pthread_mutex_unlock(&voice_handle->voice_thread.queueCapLock);
-    }
-
-    if (voice_handle->outPlayBuffer != NULL) {
-        pthread_mutex_lock(&voice_handle->voice_thread.getPlyOutLock);
-        free(voice_handle->outPlayBuffer);
-        voice_handle->outPlayBuffer = NULL;
-        voice_handle->outPlaybackBufferSize = 0;
-        pthread_mutex_unlock(&voice_handle->voice_thread.getPlyOutLock);
-    }
-
-    if (voice_handle->outCaptureBuffer != NULL) {
-        pthread_mutex_lock(&voice_handle->voice_thread.getCapOutLock);
-        free(voice_handle->outCaptureBuffer);
-        voice_handle->outCaptureBuffer = NULL;
-        voice_handle->outCaptureBufferSize = 0;
-        pthread_mutex_unlock(&voice_handle->voice_thread.getCapOutLock);
-    }
+    ringFree(&voice_handle->playBackRing);
+    ringFree(&voice_handle->captureRing);
+    ringFree(&voice_handle->outPlayRing);
+    ringFree(&voice_handle->outCaptureRing);
 
     if (voice_handle->processApi) {
         free(voice_handle->processApi);
@@ -545,28 +584,18 @@ static void thread_loop(rk_voice_handle* handle)
         bool isGetBuffer = false;
 
         //wait the enough raw buffer
-        if ((handle->captureBufferSize < capture_min_buffersize) || (handle->playbackBufferSize < playback_min_buffersize)) {
+        if (!isBlockReady(handle)) {
             sem_wait(&handle->voice_thread.sem);
         }
 
-        char value[PROPERTY_VALUE_MAX] = "";
-        property_get("vendor.audio.record", value, NULL);
-        prop_pcm_record = atoi(value);
+        prop_pcm_record = audio_props_get(AUDIO_PROP_RECORD);
 
         // try to get the raw buffer to process
-        if ((handle->captureBufferSize >= capture_min_buffersize) && (handle->playbackBufferSize >= playback_min_buffersize)) {
-            pthread_mutex_lock(&handle->voice_thread.queueCapLock);
-            memcpy(tmp_capture_buffer, handle->captureBuffer, capture_min_buffersize);
-            memcpy(handle->captureBuffer, handle->captureBuffer+capture_min_buffersize, MAX_BUFFER_SIZE-capture_min_buffersize);
-            handle->captureBufferSize -= capture_min_buffersize;
-            pthread_mutex_unlock(&handle->voice_thread.queueCapLock);
-
-            pthread_mutex_lock(&handle->voice_thread.queuePlyLock);
-            memcpy(tmp_playback_buffer, handle->playBackBuffer, playback_min_buffersize);
-            memcpy(handle->playBackBuffer, handle->playBackBuffer+playback_min_buffersize, MAX_BUFFER_SIZE-playback_min_buffersize);
-            handle->playbackBufferSize -= playback_min_buffersize;
-            pthread_mutex_unlock(&handle->voice_thread.queuePlyLock);
-            isGetBuffer = true;
+        // a flush() may run in between, so each read is checked on its own
+        if (isBlockReady(handle)
+                && (ringRead(&handle->captureRing, tmp_capture_buffer, capture_min_buffersize) == 0)) {
+            if (ringRead(&handle->playBackRing, tmp_playback_buffer, playback_min_buffersize) == 0)
+                isGetBuffer = true;
         }
 
         // process the raw buffer and queue to output list
@@ -654,15 +683,11 @@ static void thread_loop(rk_voice_handle* handle)
             }
 
             // queue processed buffer to output list
-            pthread_mutex_lock(&handle->voice_thread.getCapOutLock);
-            memcpy((char *)handle->outCaptureBuffer + handle->outCaptureBufferSize, tmp_outcapture_buffer, capture_min_buffersize);
-            handle->outCaptureBufferSize += capture_min_buffersize;
-            pthread_mutex_unlock(&handle->voice_thread.getCapOutLock);
-
-            pthread_mutex_lock(&handle->voice_thread.getPlyOutLock);
-            memcpy((char *)handle->outPlayBuffer + handle->outPlaybackBufferSize, tmp_outplayback_buffer, playback_min_buffersize);
-            handle->outPlaybackBufferSize += playback_min_buffersize;
-            pthread_mutex_unlock(&handle->voice_thread.getPlyOutLock);
+            if (ringWrite(&handle->outCaptureRing, tmp_outcapture_buffer, capture_min_buffersize) < 0)
+                ALOGW("processed capture queue full, drop block");
+
+            if (ringWrite(&handle->outPlayRing, tmp_outplayback_buffer, playback_min_buffersize) < 0)
+                ALOGW("processed playback queue full, drop block");
         }
     }
 